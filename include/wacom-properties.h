@@ -114,6 +114,41 @@
 /* 32 bit, 1 values */
 #define WACOM_PROP_PANSCROLL_THRESHOLD "Wacom Panscroll Threshold"
 
+/* CARD32, 21 values, read-only. Runtime counters shared by all tools of the
+   same tablet: frames, events, frames dropped on event queue overflow,
+   frames dropped for serial 0, empty frames, touch frames dropped while the
+   pen is in proximity, frames dropped for lack of a channel, events without
+   a matching tool, events for tools not yet initialized, suppressed events,
+   proximity, motion, button, key and touch events posted, touch frames
+   posted, touch frames not posted while touch is disabled, touch frames
+   posted while the hardware touch switch is off, reads from the device,
+   bytes read and events discarded as duplicate multitouch data.
+   Counters wrap around at 2^32. More values may be appended in the future.
+ */
+#define WACOM_PROP_STATISTICS "Wacom Statistics"
+
+/* 8 bit, 1 value
+   Setting this to 1 writes the last raw input frames of the tablet to a
+   file in the directory set with the FlightRecorder option, in the
+   wacom-record format. The driver writes the same file by itself on some
+   errors in the event stream. Without that option setting this fails with
+   BadMatch. At most one file is written every 10 seconds, setting the
+   property again before that fails with BadAccess. */
+#define WACOM_PROP_RECORDER "Wacom Flight Recorder"
+
+/* BOOL, 1 value,
+   TRUE == record timing histograms, FALSE == don't. Enabling resets the
+   histograms. Only available if the driver was built with timing
+   histograms. */
+#define WACOM_PROP_TIMING "Wacom Timing"
+
+/* CARD32, 4 * 16 values, read-only
+   Latency histograms for reading, parsing, processing and emitting events,
+   16 buckets per stage in that order. Bucket 0 counts durations below 1us,
+   bucket n counts durations from 2^(n-1) to 2^n us and the last bucket
+   counts anything longer. */
+#define WACOM_PROP_TIMING_HISTOGRAMS "Wacom Timing Histograms"
+
 /* The following are tool types used by the driver in WACOM_PROP_TOOL_TYPE
  * or in the 'type' field for XI1 clients. Clients may check for one of
  * these types to identify tool types.
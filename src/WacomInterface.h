@@ -69,17 +69,14 @@ enum WacomAxisType {
 	_WACOM_AXIS_LAST = WACOM_AXIS_SCROLL_Y,
 };
 
+/* Axis n has the mask bit 1 << n */
+#define WACOM_AXIS_COUNT 14
+
+/* value[n] is the value of axis n if its bit is set in the mask. The
+ * layout is the same as the gwacom WacomEventData. */
 typedef struct {
 	uint32_t mask;
-	int x, y;
-	int pressure;
-	int tilt_x, tilt_y;
-	int strip_x, strip_y;
-	int rotation;
-	int throttle;
-	int wheel;
-	int ring, ring2;
-	int scroll_x, scroll_y;
+	int value[WACOM_AXIS_COUNT];
 } WacomAxisData;
 
 
@@ -149,28 +146,18 @@ void wcmSetName(WacomDevicePtr priv, const char *name);
 
 uint32_t wcmTimeInMillis(void);
 
+/* The axis number of which, its index in WacomAxisData.value */
+static inline unsigned int wcmAxisIndex(enum WacomAxisType which)
+{
+	assert(which && (which & (which - 1)) == 0 && which <= _WACOM_AXIS_LAST);
+	return __builtin_ctz(which);
+}
+
 static inline void wcmAxisSet(WacomAxisData *data,
 			      enum WacomAxisType which, int value)
 {
 	data->mask |= which;
-	switch (which){
-	case WACOM_AXIS_X: data->x = value; break;
-	case WACOM_AXIS_Y: data->y = value; break;
-	case WACOM_AXIS_PRESSURE: data->pressure = value; break;
-	case WACOM_AXIS_TILT_X: data->tilt_x = value; break;
-	case WACOM_AXIS_TILT_Y: data->tilt_y = value; break;
-	case WACOM_AXIS_STRIP_X: data->strip_x = value; break;
-	case WACOM_AXIS_STRIP_Y: data->strip_y = value; break;
-	case WACOM_AXIS_ROTATION: data->rotation = value; break;
-	case WACOM_AXIS_THROTTLE: data->wheel = value; break;
-	case WACOM_AXIS_WHEEL: data->wheel = value; break;
-	case WACOM_AXIS_RING: data->ring = value; break;
-	case WACOM_AXIS_RING2: data->ring2 = value; break;
-	case WACOM_AXIS_SCROLL_X: data->scroll_x = value; break;
-	case WACOM_AXIS_SCROLL_Y: data->scroll_y = value; break;
-	default:
-		abort();
-	}
+	data->value[wcmAxisIndex(which)] = value;
 }
 
 static inline bool wcmAxisGet(const WacomAxisData *data,
@@ -179,63 +166,19 @@ static inline bool wcmAxisGet(const WacomAxisData *data,
 	if (!(data->mask & which))
 		return FALSE;
 
-	switch (which){
-	case WACOM_AXIS_X: *value_out = data->x; break;
-	case WACOM_AXIS_Y: *value_out = data->y; break;
-	case WACOM_AXIS_PRESSURE: *value_out = data->pressure; break;
-	case WACOM_AXIS_TILT_X: *value_out = data->tilt_x; break;
-	case WACOM_AXIS_TILT_Y: *value_out = data->tilt_y; break;
-	case WACOM_AXIS_STRIP_X: *value_out = data->strip_x; break;
-	case WACOM_AXIS_STRIP_Y: *value_out = data->strip_y; break;
-	case WACOM_AXIS_ROTATION: *value_out = data->rotation; break;
-	case WACOM_AXIS_THROTTLE: *value_out = data->wheel; break;
-	case WACOM_AXIS_WHEEL: *value_out = data->wheel; break;
-	case WACOM_AXIS_RING: *value_out = data->ring; break;
-	case WACOM_AXIS_RING2: *value_out = data->ring2; break;
-	case WACOM_AXIS_SCROLL_X: *value_out = data->scroll_x; break;
-	case WACOM_AXIS_SCROLL_Y: *value_out = data->scroll_y; break;
-	default:
-		abort();
-	}
+	*value_out = data->value[wcmAxisIndex(which)];
 	return TRUE;
 }
 
-static inline void wcmAxisValue(const WacomAxisData *data,
-			       enum WacomAxisType which,
-			       char *buf, size_t len)
-{
-	int val = 0;
-	int rc;
-
-	if (!wcmAxisGet(data, which, &val)) {
-		rc = snprintf(buf, len, "N/A");
-		assert(rc > 0 && (size_t)rc < len);
-		return;
-	}
-	rc = snprintf(buf, len, "%d", val);
-	assert(rc > 0 && (size_t)rc < len);
-}
-
 static inline const char* wcmAxisName(enum WacomAxisType which)
 {
-	switch (which){
-	case WACOM_AXIS_X: return "x";
-	case WACOM_AXIS_Y: return "y";
-	case WACOM_AXIS_PRESSURE: return "pressure";
-	case WACOM_AXIS_TILT_X: return "tilt-x";
-	case WACOM_AXIS_TILT_Y: return "tilt-y";
-	case WACOM_AXIS_STRIP_X: return "strip-x";
-	case WACOM_AXIS_STRIP_Y: return "strip-y";
-	case WACOM_AXIS_ROTATION: return "rotation";
-	case WACOM_AXIS_THROTTLE: return "throttle";
-	case WACOM_AXIS_WHEEL: return "wheel";
-	case WACOM_AXIS_RING: return "ring";
-	case WACOM_AXIS_RING2: return "ring2";
-	case WACOM_AXIS_SCROLL_X: return "scroll-x";
-	case WACOM_AXIS_SCROLL_Y: return "scroll-y";
-	default:
-		abort();
-	}
+	static const char * const names[WACOM_AXIS_COUNT] = {
+		"x", "y", "pressure", "tilt-x", "tilt-y", "strip-x", "strip-y",
+		"rotation", "throttle", "wheel", "ring", "ring2",
+		"scroll-x", "scroll-y",
+	};
+
+	return names[wcmAxisIndex(which)];
 }
 
 static inline void wcmAxisDump(const WacomAxisData *data, char *buf, size_t len)
@@ -245,17 +188,13 @@ static inline void wcmAxisDump(const WacomAxisData *data, char *buf, size_t len)
 
 	assert(len > 0);
 	buf[0] = '\0';
-	for (uint32_t flag = 0x1; flag <= _WACOM_AXIS_LAST; flag <<= 1) {
-		const char *name = wcmAxisName(flag);
-		char value[32];
+	while (mask) {
+		unsigned int n = __builtin_ctz(mask);
 		int rc;
 
-		if ((mask & flag) == 0)
-			continue;
-
-		wcmAxisValue(data, flag, value, sizeof(value));
-
-		rc = snprintf(buf, len, "%s%s: %s", prefix, name, value);
+		mask &= mask - 1;
+		rc = snprintf(buf, len, "%s%s: %d", prefix,
+			      wcmAxisName(1u << n), data->value[n]);
 		assert(rc > 0 && (size_t)rc < len);
 		buf += rc;
 		len -= rc;
@@ -276,7 +215,21 @@ void wcmEmitButton(WacomDevicePtr priv, bool is_absolute, int button, bool is_pr
 		   const WacomAxisData *axes);
 void wcmEmitProximity(WacomDevicePtr priv, bool is_proximity_in,
 		      const WacomAxisData *axes);
-void wcmEmitTouch(WacomDevicePtr priv, int type, unsigned int touchid, int x, int y);
+
+/* One contact in a touch frame */
+typedef struct {
+	int type;		/* XI_TouchBegin, XI_TouchUpdate or XI_TouchEnd */
+	unsigned int touchid;
+	int x, y;
+} WacomTouchRecord;
+
+/**
+ * Send all touch changes of one hardware frame. Each contact appears at
+ * most once and the records are a consistent snapshot of the contacts
+ * at the end of the frame.
+ */
+void wcmEmitTouchFrame(WacomDevicePtr priv, const WacomTouchRecord *touches,
+		       unsigned int ntouches);
 
 
 struct input_event;
@@ -304,6 +257,10 @@ char *wcmOptCheckStr(WacomDevicePtr priv, const char *key, const char *default_v
 int wcmOptCheckInt(WacomDevicePtr priv, const char *key, int default_value);
 bool wcmOptCheckBool(WacomDevicePtr priv, const char *key, bool default_value);
 
+/* Hash the values of the given options, keys is NULL-terminated. Devices
+ * with the same hash have the same values for all of these options. */
+uint64_t wcmOptHash(WacomDevicePtr priv, const char * const *keys);
+
 /* Change the option to the new value */
 void wcmOptSetStr(WacomDevicePtr priv, const char *key, const char *value);
 void wcmOptSetInt(WacomDevicePtr priv, const char *key, int value);
@@ -69,6 +69,17 @@ G_DEFINE_TYPE (WacomOptions, wacom_options, G_TYPE_OBJECT)
 G_DEFINE_TYPE (WacomDevice, wacom_device, G_TYPE_OBJECT)
 G_DEFINE_BOXED_TYPE (WacomEventData, wacom_event_data, wacom_event_data_copy, wacom_event_data_free)
 G_DEFINE_BOXED_TYPE (WacomAxis, wacom_axis, wacom_axis_copy, wacom_axis_free)
+G_DEFINE_BOXED_TYPE (WacomStats, wacom_stats, wacom_stats_copy, wacom_stats_free)
+G_DEFINE_BOXED_TYPE (WacomTiming, wacom_timing, wacom_timing_copy, wacom_timing_free)
+
+G_STATIC_ASSERT(WACOM_TIMING_BUCKETS == WTIME_BUCKETS);
+
+/* The core's WacomAxisData is emitted as WacomEventData as-is */
+G_STATIC_ASSERT(sizeof(WacomEventData) == sizeof(WacomAxisData));
+G_STATIC_ASSERT(G_STRUCT_OFFSET(WacomEventData, x) == G_STRUCT_OFFSET(WacomAxisData, value[0]));
+G_STATIC_ASSERT(G_STRUCT_OFFSET(WacomEventData, throttle) == G_STRUCT_OFFSET(WacomAxisData, value[8]));
+G_STATIC_ASSERT(G_STRUCT_OFFSET(WacomEventData, scroll_y) == G_STRUCT_OFFSET(WacomAxisData, value[13]));
+G_STATIC_ASSERT((int)_WAXIS_LAST == (int)_WACOM_AXIS_LAST);
 
 WacomOptions *wacom_options_new(const char *key, ...)
 {
@@ -183,6 +194,7 @@ enum {
 	SIGNAL_BUTTON,
 	SIGNAL_MOTION,
 	SIGNAL_TOUCH,
+	SIGNAL_TOUCH_FRAME,
 	SIGNAL_PROXIMITY,
 
 	SIGNAL_LOGMSG, /* A log message from the driver */
@@ -310,8 +322,9 @@ void wacom_device_set_runtime_option(WacomDevice *device, const char *name, cons
 
 	if (g_str_equal(name, "PanButton")) {
 		guint btn = atoi(value) - 1; /* array is zero-indexed, config options use 1-indexed ones */
-		assert(btn < sizeof(priv->key_actions));
-		wcmActionSet(&priv->key_actions[btn], 0, AC_PANSCROLL);
+		unsigned action = AC_PANSCROLL;
+		assert(btn < ARRAY_SIZE(priv->key_actions));
+		wcmActionCompile(&priv->key_actions[btn], &action, 1);
 	} else {
 		wcmLog(priv, W_ERROR, ":::::::::::::::: Unsupported runtime option %s ::::::::::::::::\n", name);
 	}
@@ -496,6 +509,21 @@ bool wcmOptCheckBool(WacomDevicePtr priv, const char *key, bool default_value)
 	return wcmOptGetBool(priv, key, default_value);
 }
 
+uint64_t wcmOptHash(WacomDevicePtr priv, const char * const *keys)
+{
+	WacomDevice *dev = priv->frontend;
+	WacomOptions *opts = dev->options;
+	uint64_t hash = 0;
+
+	for (int i = 0; keys[i]; i++)
+	{
+		const char *value = wacom_options_get(opts, keys[i]);
+
+		hash = hash * 33 + (value ? g_str_hash(value) : 0);
+	}
+	return hash;
+}
+
 /* Change the option to the new value */
 void wcmOptSetStr(WacomDevicePtr priv, const char *key, const char *value)
 {
@@ -519,42 +547,77 @@ void wcmOptSetBool(WacomDevicePtr priv, const char *key, bool value)
 
 void wcmEmitKeycode(WacomDevicePtr priv, int keycode, int state)
 {
+	uint64_t start = wcmTimingStart(priv->common);
 	WacomDevice *device = priv->frontend;
+	WCM_PROBE(emit_key, keycode, state);
+	priv->common->wcmStats[WSTAT_EMIT_KEY]++;
 	g_signal_emit(device, signals[SIGNAL_KEY], 0, keycode, state);
+	wcmTimingEnd(priv->common, WTIME_EMIT, start);
 }
 
 void wcmEmitProximity(WacomDevicePtr priv, bool is_proximity_in,
 		      const WacomAxisData *axes)
 {
+	uint64_t start = wcmTimingStart(priv->common);
 	WacomDevice *device = priv->frontend;
+	WCM_PROBE(emit_proximity, is_proximity_in,
+		  axes->value[wcmAxisIndex(WACOM_AXIS_X)],
+		  axes->value[wcmAxisIndex(WACOM_AXIS_Y)]);
+	priv->common->wcmStats[WSTAT_EMIT_PROXIMITY]++;
 	g_signal_emit(device, signals[SIGNAL_PROXIMITY], 0, is_proximity_in, axes);
+	wcmTimingEnd(priv->common, WTIME_EMIT, start);
 }
 
 void wcmEmitMotion(WacomDevicePtr priv, bool is_absolute, const WacomAxisData *axes)
 {
+	uint64_t start = wcmTimingStart(priv->common);
 	WacomDevice *device = priv->frontend;
+	WCM_PROBE(emit_motion, axes->mask,
+		  axes->value[wcmAxisIndex(WACOM_AXIS_X)],
+		  axes->value[wcmAxisIndex(WACOM_AXIS_Y)],
+		  axes->value[wcmAxisIndex(WACOM_AXIS_PRESSURE)]);
+	priv->common->wcmStats[WSTAT_EMIT_MOTION]++;
 	g_signal_emit(device, signals[SIGNAL_MOTION], 0, is_absolute, axes);
+	wcmTimingEnd(priv->common, WTIME_EMIT, start);
 }
 
 void wcmEmitButton(WacomDevicePtr priv, bool is_absolute, int button, bool is_press, const WacomAxisData *axes)
 {
+	uint64_t start = wcmTimingStart(priv->common);
 	WacomDevice *device = priv->frontend;
+	WCM_PROBE(emit_button, button, is_press,
+		  axes->value[wcmAxisIndex(WACOM_AXIS_X)],
+		  axes->value[wcmAxisIndex(WACOM_AXIS_Y)]);
+	priv->common->wcmStats[WSTAT_EMIT_BUTTON]++;
 	g_signal_emit(device, signals[SIGNAL_BUTTON], 0, is_absolute, button, is_press, axes);
+	wcmTimingEnd(priv->common, WTIME_EMIT, start);
 }
 
-void wcmEmitTouch(WacomDevicePtr priv, int type, unsigned int touchid, int x, int y)
+void wcmEmitTouchFrame(WacomDevicePtr priv, const WacomTouchRecord *touches,
+		       unsigned int ntouches)
 {
+	uint64_t start = wcmTimingStart(priv->common);
 	WacomDevice *device = priv->frontend;
-	WacomTouchState state;
 
-	switch (type) {
-	case XI_TouchBegin: state = WTOUCH_BEGIN; break;
-	case XI_TouchUpdate: state = WTOUCH_UPDATE; break;
-	case XI_TouchEnd: state = WTOUCH_END; break;
-	default:
-			  abort();
+	WCM_PROBE(emit_touch_frame, ntouches);
+	priv->common->wcmStats[WSTAT_EMIT_TOUCH_FRAME]++;
+	for (unsigned int i = 0; i < ntouches; i++) {
+		const WacomTouchRecord *t = &touches[i];
+		WacomTouchState state;
+
+		switch (t->type) {
+		case XI_TouchBegin: state = WTOUCH_BEGIN; break;
+		case XI_TouchUpdate: state = WTOUCH_UPDATE; break;
+		case XI_TouchEnd: state = WTOUCH_END; break;
+		default:
+				  abort();
+		}
+		WCM_PROBE(emit_touch, t->type, t->touchid, t->x, t->y);
+		priv->common->wcmStats[WSTAT_EMIT_TOUCH]++;
+		g_signal_emit(device, signals[SIGNAL_TOUCH], 0, state, t->touchid, t->x, t->y);
 	}
-	g_signal_emit(device, signals[SIGNAL_TOUCH], 0, state, touchid, x, y);
+	g_signal_emit(device, signals[SIGNAL_TOUCH_FRAME], 0, ntouches);
+	wcmTimingEnd(priv->common, WTIME_EMIT, start);
 }
 
 void wcmNotifyEvdev(WacomDevicePtr priv, const struct input_event *event)
@@ -655,6 +718,54 @@ int wacom_device_get_num_axes(WacomDevice *device)
 	return device->naxes;
 }
 
+WacomStats *wacom_device_get_stats(WacomDevice *device)
+{
+	const uint32_t *counters = device->priv->common->wcmStats;
+	WacomStats *stats = calloc(1, sizeof(*stats));
+
+	stats->frames = counters[WSTAT_FRAMES];
+	stats->events = counters[WSTAT_EVENTS];
+	stats->dropped_queue_overflow = counters[WSTAT_DROP_QUEUE_OVERFLOW];
+	stats->dropped_serial_zero = counters[WSTAT_DROP_SERIAL_ZERO];
+	stats->dropped_empty_frame = counters[WSTAT_DROP_EMPTY_FRAME];
+	stats->dropped_pen_over_touch = counters[WSTAT_DROP_PEN_OVER_TOUCH];
+	stats->dropped_no_channel = counters[WSTAT_DROP_NO_CHANNEL];
+	stats->dropped_no_tool = counters[WSTAT_DROP_NO_TOOL];
+	stats->dropped_tool_disabled = counters[WSTAT_DROP_TOOL_DISABLED];
+	stats->suppressed = counters[WSTAT_SUPPRESSED];
+	stats->emitted_proximity = counters[WSTAT_EMIT_PROXIMITY];
+	stats->emitted_motion = counters[WSTAT_EMIT_MOTION];
+	stats->emitted_button = counters[WSTAT_EMIT_BUTTON];
+	stats->emitted_key = counters[WSTAT_EMIT_KEY];
+	stats->emitted_touch = counters[WSTAT_EMIT_TOUCH];
+	stats->emitted_touch_frames = counters[WSTAT_EMIT_TOUCH_FRAME];
+	stats->dropped_touch_disabled = counters[WSTAT_DROP_TOUCH_DISABLED];
+	stats->touch_frames_muted = counters[WSTAT_TOUCH_MUTED];
+	stats->reads = counters[WSTAT_READS];
+	stats->bytes_read = counters[WSTAT_BYTES_READ];
+	stats->dropped_filtered = counters[WSTAT_DROP_FILTERED];
+
+	return stats;
+}
+
+void wacom_device_set_timing_enabled(WacomDevice *device, gboolean enabled)
+{
+	wcmTimingSetEnabled(device->priv->common, enabled);
+}
+
+WacomTiming *wacom_device_get_timing(WacomDevice *device)
+{
+	WacomCommonPtr common = device->priv->common;
+	WacomTiming *timing = calloc(1, sizeof(*timing));
+
+	memcpy(timing->read, common->wcmTiming[WTIME_READ], sizeof(timing->read));
+	memcpy(timing->parse, common->wcmTiming[WTIME_PARSE], sizeof(timing->parse));
+	memcpy(timing->core, common->wcmTiming[WTIME_CORE], sizeof(timing->core));
+	memcpy(timing->emit, common->wcmTiming[WTIME_EMIT], sizeof(timing->emit));
+
+	return timing;
+}
+
 int wcmOpen(WacomDevicePtr priv)
 {
 	WacomDevice *device = priv->frontend;
@@ -909,6 +1020,21 @@ wacom_device_class_init(WacomDeviceClass *klass)
 			     /* type, touchid, x, y */
 			     3, G_TYPE_INT, G_TYPE_UINT, G_TYPE_INT, G_TYPE_INT);
 
+	/**
+	 * WacomDevice::touch-frame:
+	 * @device: the device that sent the event
+	 * @ntouches: the number of touch signals in this frame
+	 *
+	 * The touch-frame signal is emitted after the touch signals of one
+	 * hardware frame. Each touch appears at most once per frame.
+	 */
+	signals[SIGNAL_TOUCH_FRAME] =
+		g_signal_new("touch-frame",
+			     G_TYPE_FROM_CLASS(klass),
+			     G_SIGNAL_RUN_FIRST,
+			     0, NULL, NULL, NULL, G_TYPE_NONE,
+			     1, G_TYPE_UINT);
+
 	/**
 	 * WacomDevice::proximity:
 	 * @device: the device that sent the event
@@ -1012,6 +1138,30 @@ void wacom_axis_free(WacomAxis *axis)
 	free(axis);
 }
 
+WacomStats* wacom_stats_copy(const WacomStats *stats)
+{
+	WacomStats *new_stats = malloc(sizeof(*stats));
+	memcpy(new_stats, stats, sizeof(*stats));
+	return new_stats;
+}
+
+void wacom_stats_free(WacomStats *stats)
+{
+	free(stats);
+}
+
+WacomTiming* wacom_timing_copy(const WacomTiming *timing)
+{
+	WacomTiming *new_timing = malloc(sizeof(*timing));
+	memcpy(new_timing, timing, sizeof(*timing));
+	return new_timing;
+}
+
+void wacom_timing_free(WacomTiming *timing)
+{
+	free(timing);
+}
+
 WacomEventData* wacom_event_data_copy(const WacomEventData *event_data)
 {
 	WacomEventData *new_event_data = malloc(sizeof(*event_data));
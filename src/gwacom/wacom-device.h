@@ -115,7 +115,8 @@ typedef enum {
 } WacomEventAxis;
 
 /* The pointer argument to all the event signals. If the mask is set for
- * a given axis, that value contains the current state of the axis */
+ * a given axis, that value contains the current state of the axis. The
+ * values are in the order of the WacomEventAxis bits. */
 typedef struct {
 	uint32_t mask; /* bitmask of WacomEventAxis */
 	int x, y;
@@ -146,6 +147,55 @@ GType wacom_axis_get_type(void);
 WacomAxis* wacom_axis_copy(const WacomAxis *axis);
 void wacom_axis_free(WacomAxis *axis);
 
+/* Runtime counters of the tablet a device belongs to, shared by all devices
+ * of the same tablet. See the Wacom Statistics property */
+typedef struct {
+	guint32 frames;
+	guint32 events;
+	guint32 dropped_queue_overflow;
+	guint32 dropped_serial_zero;
+	guint32 dropped_empty_frame;
+	guint32 dropped_pen_over_touch;
+	guint32 dropped_no_channel;
+	guint32 dropped_no_tool;
+	guint32 dropped_tool_disabled;
+	guint32 suppressed;
+	guint32 emitted_proximity;
+	guint32 emitted_motion;
+	guint32 emitted_button;
+	guint32 emitted_key;
+	guint32 emitted_touch;
+	guint32 emitted_touch_frames;
+	guint32 dropped_touch_disabled;
+	guint32 touch_frames_muted;
+	guint32 reads;
+	guint32 bytes_read;
+	guint32 dropped_filtered;
+} WacomStats;
+
+#define WACOM_TYPE_STATS (wacom_stats_get_type())
+
+GType wacom_stats_get_type(void);
+WacomStats* wacom_stats_copy(const WacomStats *stats);
+void wacom_stats_free(WacomStats *stats);
+
+#define WACOM_TIMING_BUCKETS 16
+
+/* Latency histograms of the tablet a device belongs to, see the Wacom
+ * Timing Histograms property for the bucket layout */
+typedef struct {
+	guint32 read[WACOM_TIMING_BUCKETS];
+	guint32 parse[WACOM_TIMING_BUCKETS];
+	guint32 core[WACOM_TIMING_BUCKETS];
+	guint32 emit[WACOM_TIMING_BUCKETS];
+} WacomTiming;
+
+#define WACOM_TYPE_TIMING (wacom_timing_get_type())
+
+GType wacom_timing_get_type(void);
+WacomTiming* wacom_timing_copy(const WacomTiming *timing);
+void wacom_timing_free(WacomTiming *timing);
+
 /**
  * wacom_device_new:
  *
@@ -230,4 +280,29 @@ int wacom_device_get_num_axes(WacomDevice *device);
 const WacomAxis* wacom_device_get_axis(WacomDevice *device,
 				       WacomEventAxis which);
 
+/**
+ * wacom_device_get_stats:
+ *
+ * Returns: (transfer full): a snapshot of the runtime counters for this
+ * device's tablet.
+ */
+WacomStats* wacom_device_get_stats(WacomDevice *device);
+
+/**
+ * wacom_device_set_timing_enabled:
+ *
+ * Start or stop recording timing histograms for this device's tablet.
+ * Enabling resets the histograms. This has no effect unless the driver was
+ * built with timing histograms.
+ */
+void wacom_device_set_timing_enabled(WacomDevice *device, gboolean enabled);
+
+/**
+ * wacom_device_get_timing:
+ *
+ * Returns: (transfer full): a snapshot of the timing histograms for this
+ * device's tablet.
+ */
+WacomTiming* wacom_device_get_timing(WacomDevice *device);
+
 G_END_DECLS
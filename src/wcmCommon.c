@@ -27,6 +27,13 @@
 #include <xkbsrv.h>
 #include <xf86_OSproc.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WCM_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define WCM_X86_KERNELS 0
+#endif
+
 #ifdef ENABLE_TESTS
 #include "wacom-test-suite.h"
 #endif
@@ -48,7 +55,7 @@ void wcmRemoveActive(WacomDevicePtr priv)
  * Static functions
  ****************************************************************************/
 
-static int applyPressureCurve(WacomDevicePtr pDev, const WacomDeviceStatePtr pState);
+static int applyPressureCurve(WacomDevicePtr pDev, int pressure);
 static void commonDispatchDevice(WacomDevicePtr priv,
 				 const WacomChannelPtr pChannel);
 static void sendAButton(WacomDevicePtr pDev, const WacomDeviceState* ds, int button,
@@ -129,33 +136,35 @@ static void wcmPanscroll(WacomDevicePtr priv, const WacomDeviceState *ds, int x,
 
 void wcmResetButtonAction(WacomDevicePtr priv, int button)
 {
-	WacomAction new_action = {};
 	int x11_button = priv->button_default[button];
+	unsigned new_action[] = {
+		AC_BUTTON | AC_KEYBTNPRESS | x11_button,
+	};
 
-	wcmActionSet(&new_action, 0, AC_BUTTON | AC_KEYBTNPRESS | x11_button);
-	wcmActionCopy(&priv->key_actions[button], &new_action);
+	wcmActionCompile(&priv->key_actions[button], new_action, ARRAY_SIZE(new_action));
 }
 
 void wcmResetStripAction(WacomDevicePtr priv, int index)
 {
-	WacomAction new_action = {};
+	unsigned new_action[] = {
+		AC_BUTTON | AC_KEYBTNPRESS | (priv->strip_default[index]),
+		AC_BUTTON | (priv->strip_default[index]),
+	};
 
-	wcmActionSet(&new_action, 0, AC_BUTTON | AC_KEYBTNPRESS | (priv->strip_default[index]));
-	wcmActionSet(&new_action, 1, AC_BUTTON | (priv->strip_default[index]));
-	wcmActionCopy(&priv->strip_actions[index], &new_action);
+	wcmActionCompile(&priv->strip_actions[index], new_action, ARRAY_SIZE(new_action));
 }
 
 void wcmResetWheelAction(WacomDevicePtr priv, int index)
 {
-	WacomAction new_action = {};
+	unsigned new_action[] = {
+		AC_BUTTON | AC_KEYBTNPRESS | (priv->wheel_default[index]),
+		AC_BUTTON | (priv->wheel_default[index]),
+	};
 
-	wcmActionSet(&new_action, 0, AC_BUTTON | AC_KEYBTNPRESS | (priv->wheel_default[index]));
-	wcmActionSet(&new_action, 1, AC_BUTTON | (priv->wheel_default[index]));
-	wcmActionCopy(&priv->wheel_actions[index], &new_action);
+	wcmActionCompile(&priv->wheel_actions[index], new_action, ARRAY_SIZE(new_action));
 }
 
-/* Main event hanlding function */
-int wcmReadPacket(WacomDevicePtr priv)
+static int commonReadPacket(WacomDevicePtr priv)
 {
 	WacomCommonPtr common = priv->common;
 	int len, pos, cnt, remaining;
@@ -177,6 +186,8 @@ int wcmReadPacket(WacomDevicePtr priv)
 	}
 
 	/* account for new data */
+	common->wcmStats[WSTAT_READS]++;
+	common->wcmStats[WSTAT_BYTES_READ] += len;
 	common->bufpos += len;
 	DBG(10, common, "buffer has %d bytes\n", common->bufpos);
 
@@ -209,6 +220,36 @@ int wcmReadPacket(WacomDevicePtr priv)
 	return pos;
 }
 
+/* Main event hanlding function */
+int wcmReadPacket(WacomDevicePtr priv)
+{
+	WacomCommonPtr common = priv->common;
+	uint64_t start = wcmTimingStart(common);
+	int rc;
+
+	rc = commonReadPacket(priv);
+	wcmTimingEnd(common, WTIME_READ, start);
+
+	return rc;
+}
+
+void wcmTimingSetEnabled(WacomCommonPtr common, Bool enabled)
+{
+	if (enabled && !common->wcmTimingEnabled)
+		memset(common->wcmTiming, 0, sizeof(common->wcmTiming));
+	common->wcmTimingEnabled = enabled;
+}
+
+int wcmDumpRecorder(WacomDevicePtr priv, const char *reason)
+{
+	WacomHWClassPtr cls = priv->common->wcmDevCls;
+
+	if (!cls || !cls->DumpRecorder)
+		return -ENOTSUP;
+
+	return cls->DumpRecorder(priv, reason);
+}
+
 
 /*****************************************************************************
  * wcmSendButtons --
@@ -320,6 +361,72 @@ static int countPresses(int keybtn, const unsigned int* keys, int size)
 	return count;
 }
 
+/**
+ * Replace action with a copy of the len actions in data. The releases for
+ * presses that data leaves pending are worked out here, once, so that
+ * releasing the button doesn't have to rescan the actions.
+ *
+ * This frees the old program. The frontend must hold the input lock when
+ * action may be in use on the input thread.
+ *
+ * @return FALSE if data is too long or memory ran out, action is left
+ * unchanged then.
+ */
+Bool wcmActionCompile(WacomAction *action, const unsigned *data, size_t len)
+{
+	unsigned releases[WCM_MAX_ACTIONS];
+	size_t i, nreleases = 0;
+	unsigned *program = NULL;
+
+	if (len > WCM_MAX_ACTIONS)
+		return FALSE;
+
+	for (i = 0; i < len; i++)
+	{
+		unsigned int act = data[i];
+
+		switch ((act & AC_TYPE))
+		{
+			case AC_BUTTON:
+			case AC_KEY:
+				/* don't care about releases here */
+				if (!(act & AC_KEYBTNPRESS))
+					break;
+
+				if (countPresses(act & AC_CODE, &data[i], len - i))
+					releases[nreleases++] = act & ~AC_KEYBTNPRESS;
+				break;
+			case AC_PANSCROLL:
+				releases[nreleases++] = act;
+				break;
+		}
+	}
+
+	if (len + nreleases > 0)
+	{
+		program = malloc((len + nreleases) * sizeof(*program));
+		if (!program)
+			return FALSE;
+		memcpy(program, data, len * sizeof(*program));
+		memcpy(program + len, releases, nreleases * sizeof(*program));
+	}
+
+	free(action->program);
+	action->program = program;
+	action->nactions = len;
+	action->nreleases = nreleases;
+
+	return TRUE;
+}
+
+void wcmActionFree(WacomAction *action)
+{
+	free(action->program);
+	action->program = NULL;
+	action->nactions = 0;
+	action->nreleases = 0;
+}
+
 static void sendAction(WacomDevicePtr priv,  const WacomDeviceState* ds,
 		       int press, const WacomAction *act,
 		       const WacomAxisData *axes)
@@ -327,6 +434,8 @@ static void sendAction(WacomDevicePtr priv,  const WacomDeviceState* ds,
 	int i;
 	int nkeys = wcmActionSize(act);
 	const unsigned *keys = wcmActionData(act);
+	int nreleases = wcmActionReleaseSize(act);
+	const unsigned *releases = wcmActionReleases(act);
 
 	/* Actions only trigger on press, not release */
 	for (i = 0; press && i < nkeys; i++)
@@ -373,36 +482,18 @@ static void sendAction(WacomDevicePtr priv,  const WacomDeviceState* ds,
 	}
 
 	/* Release all non-released keys for this button. */
-	for (i = 0; !press && i < nkeys; i++)
+	for (i = 0; !press && i < nreleases; i++)
 	{
-		unsigned int action = keys[i];
+		unsigned int action = releases[i];
 
 		switch ((action & AC_TYPE))
 		{
 			case AC_BUTTON:
-				{
-					int btn_no = (action & AC_CODE);
-
-					/* don't care about releases here */
-					if (!(action & AC_KEYBTNPRESS))
-						break;
-
-					if (countPresses(btn_no, &keys[i], nkeys - i))
-						wcmEmitButton(priv, is_absolute(priv), btn_no,
-							      FALSE, axes);
-				}
+				wcmEmitButton(priv, is_absolute(priv), action & AC_CODE,
+					      FALSE, axes);
 				break;
 			case AC_KEY:
-				{
-					int key_code = (action & AC_CODE);
-
-					/* don't care about releases here */
-					if (!(action & AC_KEYBTNPRESS))
-						break;
-
-					if (countPresses(key_code, &keys[i], nkeys - i))
-						wcmEmitKeycode(priv, key_code, 0);
-				}
+				wcmEmitKeycode(priv, action & AC_CODE, 0);
 				break;
 			case AC_PANSCROLL:
 				priv->flags &= ~SCROLLMODE_FLAG;
@@ -431,6 +522,17 @@ static void sendAButton(WacomDevicePtr priv, const WacomDeviceState* ds, int but
 	sendAction(priv, ds, (mask != 0), &priv->key_actions[button], axes);
 }
 
+/**
+ * The 1-based index of the highest bit set in value, 0 if no bit is set.
+ * Strips report a single bit for the finger position.
+ */
+static int bitIndex(int value)
+{
+	unsigned int bits = ((unsigned int)value << 1) | 0x01;
+
+	return 31 - __builtin_clz(bits);
+}
+
 /**
  * Get the distance an axis was scrolled. This function is aware
  * of the different ways different scrolling axes work and strives
@@ -448,9 +550,9 @@ static int getScrollDelta(int current, int old, int wrap, int flags)
 
 	if (flags & AXIS_BITWISE)
 	{
-		current = log2((current << 1) | 0x01);
-		old = log2((old << 1) | 0x01);
-		wrap = log2((wrap << 1) | 0x01);
+		current = bitIndex(current);
+		old = bitIndex(old);
+		wrap = bitIndex(wrap);
 	}
 
 	delta = current - old;
@@ -622,47 +724,329 @@ int wcmScaleAxis(int Cx, int to_max, int to_min, int from_max, int from_min)
 }
 
 
-/* rotate x and y before post X inout events */
-void wcmRotateAndScaleCoordinates(WacomDevicePtr priv, int* x, int* y)
+/**
+ * Set up scale to map from_min..from_max to to_min..to_max the way
+ * wcmScaleAxis() does, for ranges that are used for many events.
+ *
+ * Inside the range wcmScaleAxis() is floor(n * width / range) for
+ * n = |Cx - from_min|. With factor = ceil(width * 2^shift / range) and
+ * range^2 <= 2^shift, (n * factor) >> shift adds less than 1/range to
+ * that quotient, which is never enough to reach the next integer. So the
+ * multiplication gives the same result as the division for every n.
+ */
+void wcmScaleInit(WacomScale *scale, int to_max, int to_min, int from_max, int from_min)
 {
-	WacomCommonPtr common = priv->common;
-	int tmp_coord;
-	int xmax, xmin, ymax, ymin;
+	int64_t from_width = (int64_t)from_max - from_min;
+	int64_t to_width = (int64_t)to_max - to_min;
+	int range_bits, width_bits;
+
+	memset(scale, 0, sizeof(*scale));
+	scale->to_max = to_max;
+	scale->to_min = to_min;
+	scale->from_max = from_max;
+	scale->from_min = from_min;
+
+	/* every input gives the same result */
+	if (from_width == 0 || to_width < 0)
+	{
+		scale->low = wcmScaleAxis(from_min, to_max, to_min, from_max, from_min);
+		return;
+	}
 
-	/* scale into the topX/topY area we had when we initialized the
-	 * valuator */
-	xmin = priv->valuatorMinX;
-	xmax = priv->valuatorMaxX;
-	ymin = priv->valuatorMinY;
-	ymax = priv->valuatorMaxY;
+	scale->direction = from_width < 0 ? -1 : 1;
+	scale->range = from_width < 0 ? -from_width : from_width;
+	scale->width = to_width;
+	scale->low = to_min;
+	scale->high = to_max;
 
-	/* Don't try to scale relative axes */
-	if (xmax > xmin)
-		*x = wcmScaleAxis(*x, xmax, xmin, priv->bottomX, priv->topX);
+	range_bits = 64 - __builtin_clzll(scale->range);
+	width_bits = 64 - __builtin_clzll(scale->width | 1);
+	if (2 * range_bits + width_bits < 64)
+	{
+		scale->shift = 2 * range_bits;
+		scale->factor = ((scale->width << scale->shift) + scale->range - 1) /
+				scale->range;
+	}
+}
 
-	if (ymax > ymin)
-		*y = wcmScaleAxis(*y, ymax, ymin, priv->bottomY, priv->topY);
+/**
+ * wcmScaleAxis() for a range set up with wcmScaleInit(). Outside the range
+ * the result is clamped to either end.
+ */
+int wcmScaleApply(const WacomScale *scale, int Cx)
+{
+	int64_t n = ((int64_t)Cx - scale->from_min) * scale->direction;
+	uint64_t q;
 
-	/* coordinates are now in the axis rage we advertise for the device */
+	if (n <= 0)
+		return scale->low;
+	if ((uint64_t)n >= scale->range)
+		return scale->high;
 
-	if (common->wcmRotate == ROTATE_CW || common->wcmRotate == ROTATE_CCW)
+	if (scale->shift)
+		q = ((uint64_t)n * scale->factor) >> scale->shift;
+	else
+		q = (uint64_t)n * scale->width / scale->range;
+
+	return (int)(scale->to_min + (int64_t)q);
+}
+
+/* Batch versions of wcmScaleApply(), one per instruction set. The vector
+ * kernels only handle scales that use the multiplication, the rest and
+ * the tail of each batch go through the next smaller kernel. */
+typedef void (*WacomScaleKernel)(const WacomScale *scale, const int *in,
+				 int *out, size_t n);
+
+static void scaleBatchScalar(const WacomScale *scale, const int *in,
+			     int *out, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = wcmScaleApply(scale, in[i]);
+}
+
+#if WCM_X86_KERNELS
+/*
+ * Inside the range n = |Cx - from_min| is below 2^31 (wcmScaleInit() only
+ * picks the multiplication if 2 * range_bits + width_bits < 64) and
+ * n * factor below 2^64. The 64 bit product is put together from two
+ * 32x32 bit multiplications, which is exact modulo 2^64. The range checks
+ * are signed 32 bit compares of Cx against from_min and from_max, which
+ * is the same as comparing n against 0 and range.
+ */
+__attribute__((target("sse2")))
+static void scaleBatchSSE2(const WacomScale *scale, const int *in,
+			   int *out, size_t n)
+{
+	size_t i = 0;
+
+	if (scale->direction && scale->shift)
 	{
-		tmp_coord = *x;
+		const __m128i from_min = _mm_set1_epi32(scale->from_min);
+		const __m128i from_max = _mm_set1_epi32(scale->from_max);
+		const __m128i to_min = _mm_set1_epi32(scale->to_min);
+		const __m128i low = _mm_set1_epi32(scale->low);
+		const __m128i high = _mm_set1_epi32(scale->high);
+		const __m128i factor_lo = _mm_set1_epi32((int)(uint32_t)scale->factor);
+		const __m128i factor_hi = _mm_set1_epi32((int)(uint32_t)(scale->factor >> 32));
+		const __m128i shift = _mm_cvtsi32_si128(scale->shift);
+		const __m128i even = _mm_set1_epi64x(0xffffffff);
+		Bool forward = scale->direction > 0;
+
+		for (; i + 4 <= n; i += 4)
+		{
+			__m128i cx = _mm_loadu_si128((const __m128i *)&in[i]);
+			__m128i d, above_low, below_high, p0, p1, q;
 
-		*x = wcmScaleAxis(*y, xmax, xmin, ymax, ymin);
-		*y = wcmScaleAxis(tmp_coord, ymax, ymin, xmax, xmin);
+			if (forward)
+			{
+				d = _mm_sub_epi32(cx, from_min);
+				above_low = _mm_cmpgt_epi32(cx, from_min);
+				below_high = _mm_cmpgt_epi32(from_max, cx);
+			}
+			else
+			{
+				d = _mm_sub_epi32(from_min, cx);
+				above_low = _mm_cmpgt_epi32(from_min, cx);
+				below_high = _mm_cmpgt_epi32(cx, from_max);
+			}
+
+			p0 = _mm_add_epi64(_mm_mul_epu32(d, factor_lo),
+					   _mm_slli_epi64(_mm_mul_epu32(d, factor_hi), 32));
+			d = _mm_srli_epi64(d, 32);
+			p1 = _mm_add_epi64(_mm_mul_epu32(d, factor_lo),
+					   _mm_slli_epi64(_mm_mul_epu32(d, factor_hi), 32));
+			q = _mm_or_si128(_mm_and_si128(_mm_srl_epi64(p0, shift), even),
+					 _mm_slli_epi64(_mm_srl_epi64(p1, shift), 32));
+			q = _mm_add_epi32(q, to_min);
+
+			q = _mm_or_si128(_mm_and_si128(below_high, q),
+					 _mm_andnot_si128(below_high, high));
+			q = _mm_or_si128(_mm_and_si128(above_low, q),
+					 _mm_andnot_si128(above_low, low));
+			_mm_storeu_si128((__m128i *)&out[i], q);
+		}
 	}
 
-	if (common->wcmRotate == ROTATE_CW)
-		*y = ymax - (*y - ymin);
-	else if (common->wcmRotate == ROTATE_CCW)
-		*x = xmax - (*x - xmin);
-	else if (common->wcmRotate == ROTATE_HALF)
+	scaleBatchScalar(scale, in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void scaleBatchAVX2(const WacomScale *scale, const int *in,
+			   int *out, size_t n)
+{
+	size_t i = 0;
+
+	if (scale->direction && scale->shift)
 	{
-		*x = xmax - (*x - xmin);
-		*y = ymax - (*y - ymin);
+		const __m256i from_min = _mm256_set1_epi32(scale->from_min);
+		const __m256i from_max = _mm256_set1_epi32(scale->from_max);
+		const __m256i to_min = _mm256_set1_epi32(scale->to_min);
+		const __m256i low = _mm256_set1_epi32(scale->low);
+		const __m256i high = _mm256_set1_epi32(scale->high);
+		const __m256i factor_lo = _mm256_set1_epi32((int)(uint32_t)scale->factor);
+		const __m256i factor_hi = _mm256_set1_epi32((int)(uint32_t)(scale->factor >> 32));
+		const __m128i shift = _mm_cvtsi32_si128(scale->shift);
+		Bool forward = scale->direction > 0;
+
+		for (; i + 8 <= n; i += 8)
+		{
+			__m256i cx = _mm256_loadu_si256((const __m256i *)&in[i]);
+			__m256i d, above_low, below_high, p0, p1, q;
+
+			if (forward)
+			{
+				d = _mm256_sub_epi32(cx, from_min);
+				above_low = _mm256_cmpgt_epi32(cx, from_min);
+				below_high = _mm256_cmpgt_epi32(from_max, cx);
+			}
+			else
+			{
+				d = _mm256_sub_epi32(from_min, cx);
+				above_low = _mm256_cmpgt_epi32(from_min, cx);
+				below_high = _mm256_cmpgt_epi32(cx, from_max);
+			}
+
+			p0 = _mm256_add_epi64(_mm256_mul_epu32(d, factor_lo),
+					      _mm256_slli_epi64(_mm256_mul_epu32(d, factor_hi), 32));
+			d = _mm256_srli_epi64(d, 32);
+			p1 = _mm256_add_epi64(_mm256_mul_epu32(d, factor_lo),
+					      _mm256_slli_epi64(_mm256_mul_epu32(d, factor_hi), 32));
+			q = _mm256_blend_epi32(_mm256_srl_epi64(p0, shift),
+					       _mm256_slli_epi64(_mm256_srl_epi64(p1, shift), 32),
+					       0xaa);
+			q = _mm256_add_epi32(q, to_min);
+
+			q = _mm256_blendv_epi8(high, q, below_high);
+			q = _mm256_blendv_epi8(low, q, above_low);
+			_mm256_storeu_si256((__m256i *)&out[i], q);
+		}
+	}
+
+	/* AVX2 implies SSE2 */
+	scaleBatchSSE2(scale, in + i, out + i, n - i);
+}
+#endif
+
+enum {
+	SCALE_KERNEL_SCALAR,
+#if WCM_X86_KERNELS
+	SCALE_KERNEL_SSE2,
+	SCALE_KERNEL_AVX2,
+#endif
+	SCALE_KERNEL_COUNT,
+};
+
+static const WacomScaleKernel scaleKernels[SCALE_KERNEL_COUNT] = {
+	[SCALE_KERNEL_SCALAR] = scaleBatchScalar,
+#if WCM_X86_KERNELS
+	[SCALE_KERNEL_SSE2] = scaleBatchSSE2,
+	[SCALE_KERNEL_AVX2] = scaleBatchAVX2,
+#endif
+};
+
+/* The best kernel this CPU can run */
+static int scaleKernelBest(void)
+{
+#if WCM_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SCALE_KERNEL_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return SCALE_KERNEL_SSE2;
+#endif
+	return SCALE_KERNEL_SCALAR;
+}
+
+/**
+ * wcmScaleApply() for n values, in may be the same as out. Gives the same
+ * results as wcmScaleApply() for every value.
+ */
+void wcmScaleApplyBatch(const WacomScale *scale, const int *in, int *out, size_t n)
+{
+	static int kernel = -1;
+
+	if (kernel < 0)
+		kernel = scaleKernelBest();
+
+	scaleKernels[kernel](scale, in, out, n);
+}
+
+/**
+ * Map the airbrush wheel (0..MAX_ABS_WHEEL) to the Art Pen rotation range,
+ * truncating towards zero.
+ */
+static int airbrushRotation(int abswheel)
+{
+	return (abswheel * MAX_ROTATION_RANGE + MIN_ROTATION * MAX_ABS_WHEEL) /
+		MAX_ABS_WHEEL;
+}
+
+/**
+ * Compile the device's area, valuator ranges and the tablet rotation into
+ * priv->transform for wcmRotateAndScaleCoordinates(). Must be called
+ * whenever one of them changes.
+ */
+void wcmUpdateTransform(WacomDevicePtr priv)
+{
+	WacomTransform *t = &priv->transform;
+	int rotate = priv->common->wcmRotate;
+	int xmin = priv->valuatorMinX, xmax = priv->valuatorMaxX;
+	int ymin = priv->valuatorMinY, ymax = priv->valuatorMaxY;
+
+	memset(t, 0, sizeof(*t));
+	t->min[0] = xmin;
+	t->max[0] = xmax;
+	t->min[1] = ymin;
+	t->max[1] = ymax;
+
+	/* scale into the topX/topY area we had when we initialized the
+	 * valuator. Don't try to scale relative axes */
+	t->area[0] = xmax > xmin;
+	if (t->area[0])
+		wcmScaleInit(&t->areaScale[0], xmax, xmin, priv->bottomX, priv->topX);
+	t->area[1] = ymax > ymin;
+	if (t->area[1])
+		wcmScaleInit(&t->areaScale[1], ymax, ymin, priv->bottomY, priv->topY);
+
+	t->swap = rotate == ROTATE_CW || rotate == ROTATE_CCW;
+	if (t->swap)
+	{
+		wcmScaleInit(&t->swapScale[0], xmax, xmin, ymax, ymin);
+		wcmScaleInit(&t->swapScale[1], ymax, ymin, xmax, xmin);
+	}
+
+	t->flip[0] = rotate == ROTATE_CCW || rotate == ROTATE_HALF;
+	t->flip[1] = rotate == ROTATE_CW || rotate == ROTATE_HALF;
+}
+
+/* rotate x and y before post X inout events */
+void wcmRotateAndScaleCoordinates(WacomDevicePtr priv, int* x, int* y)
+{
+	const WacomTransform *t = &priv->transform;
+	int tx = *x, ty = *y;
+
+	if (t->area[0])
+		tx = wcmScaleApply(&t->areaScale[0], tx);
+	if (t->area[1])
+		ty = wcmScaleApply(&t->areaScale[1], ty);
+
+	/* coordinates are now in the axis rage we advertise for the device */
+
+	if (t->swap)
+	{
+		int tmp_coord = tx;
+
+		tx = wcmScaleApply(&t->swapScale[0], ty);
+		ty = wcmScaleApply(&t->swapScale[1], tmp_coord);
 	}
 
+	if (t->flip[0])
+		tx = t->max[0] - (tx - t->min[0]);
+	if (t->flip[1])
+		ty = t->max[1] - (ty - t->min[1]);
+
+	*x = tx;
+	*y = ty;
 
 	DBG(10, priv, "rotate/scaled to %d/%d\n", *x, *y);
 }
@@ -707,41 +1091,28 @@ wcmSendNonPadEvents(WacomDevicePtr priv, const WacomDeviceState *ds,
 {
 	if (!is_absolute(priv))
 	{
-		int val;
+		int *value = axes->value;
 
-		val = 0;
-		wcmAxisGet(axes, WACOM_AXIS_X, &val);
-		wcmAxisSet(axes, WACOM_AXIS_X, val - priv->oldState.x);
-		val = 0;
-		wcmAxisGet(axes, WACOM_AXIS_Y, &val);
-		wcmAxisSet(axes, WACOM_AXIS_Y, val - priv->oldState.y);
-		val = 0;
-		wcmAxisGet(axes, WACOM_AXIS_PRESSURE, &val);
-		wcmAxisSet(axes, WACOM_AXIS_PRESSURE, val - priv->oldState.pressure);
+		axes->mask |= WACOM_AXIS_X | WACOM_AXIS_Y | WACOM_AXIS_PRESSURE;
+		value[wcmAxisIndex(WACOM_AXIS_X)] -= priv->oldState.x;
+		value[wcmAxisIndex(WACOM_AXIS_Y)] -= priv->oldState.y;
+		value[wcmAxisIndex(WACOM_AXIS_PRESSURE)] -= priv->oldState.pressure;
 
 		if (IsCursor(priv))
 		{
-			val = 0;
-			wcmAxisGet(axes, WACOM_AXIS_ROTATION, &val);
-			wcmAxisSet(axes, WACOM_AXIS_ROTATION, val - priv->oldState.rotation);
-			val = 0;
-			wcmAxisGet(axes, WACOM_AXIS_THROTTLE, &val);
-			wcmAxisSet(axes, WACOM_AXIS_THROTTLE, val - priv->oldState.throttle);
+			axes->mask |= WACOM_AXIS_ROTATION | WACOM_AXIS_THROTTLE;
+			value[wcmAxisIndex(WACOM_AXIS_ROTATION)] -= priv->oldState.rotation;
+			value[wcmAxisIndex(WACOM_AXIS_THROTTLE)] -= priv->oldState.throttle;
 		} else
 		{
-			val = 0;
-			wcmAxisGet(axes, WACOM_AXIS_TILT_X, &val);
-			wcmAxisSet(axes, WACOM_AXIS_TILT_X, val - priv->oldState.tilty);
-			val = 0;
-			wcmAxisGet(axes, WACOM_AXIS_TILT_Y, &val);
-			wcmAxisSet(axes, WACOM_AXIS_TILT_Y, val - priv->oldState.tilty);
+			axes->mask |= WACOM_AXIS_TILT_X | WACOM_AXIS_TILT_Y;
+			value[wcmAxisIndex(WACOM_AXIS_TILT_X)] -= priv->oldState.tiltx;
+			value[wcmAxisIndex(WACOM_AXIS_TILT_Y)] -= priv->oldState.tilty;
 		}
-		val = 0;
-		if (wcmAxisGet(axes, WACOM_AXIS_RING, &val))
-			wcmAxisSet(axes, WACOM_AXIS_RING, val - priv->oldState.abswheel);
-		val = 0;
-		if (wcmAxisGet(axes, WACOM_AXIS_RING2, &val))
-			wcmAxisSet(axes, WACOM_AXIS_RING2, val - priv->oldState.abswheel2);
+		if (axes->mask & WACOM_AXIS_RING)
+			value[wcmAxisIndex(WACOM_AXIS_RING)] -= priv->oldState.abswheel;
+		if (axes->mask & WACOM_AXIS_RING2)
+			value[wcmAxisIndex(WACOM_AXIS_RING2)] -= priv->oldState.abswheel2;
 	}
 
 	/* coordinates are ready we can send events */
@@ -869,9 +1240,7 @@ void wcmSendEvents(WacomDevicePtr priv, const WacomDeviceState* ds)
 			/* Normalize abswheel airbrush data to Art Pen rotation range.
 			* We do not normalize Art Pen. They are already at the range.
 			*/
-			int wheel = ds->abswheel * MAX_ROTATION_RANGE/
-					(double)MAX_ABS_WHEEL + MIN_ROTATION;
-			wcmAxisSet(&axes, WACOM_AXIS_WHEEL, wheel);
+			wcmAxisSet(&axes, WACOM_AXIS_WHEEL, airbrushRotation(ds->abswheel));
 		}
 		else if (IsArtPen(ds))
 		{
@@ -1013,18 +1382,23 @@ static WacomToolPtr findTool(const WacomCommonPtr common,
 
 	/* 1: Find the tool (the one with correct serial or in second
 	 * hand, the one with serial set to 0 if no match with the
-	 * specified serial exists) that is used for this event */
+	 * specified serial exists) that is used for this event.
+	 * Lazily hotplugged serial tools are skipped until enabled. */
 	for (tool = common->wcmTool; tool; tool = tool->next)
 	{
 		if (tool->typeid == ds->device_type)
 		{
-			if (tool->serial == ds->serial_num)
+			if (tool->serial == ds->serial_num &&
+			    (tool->enabled || !tool->serial || !common->wcmLazySerials))
 				break;
 			else if (!tool->serial)
 				tooldefault = tool;
 		}
 	}
 
+	if (!tool && ds->serial_num && common->wcmLazySerials)
+		wcmHotplugSerialOnDemand(common, ds->serial_num);
+
 	/* Use default tool (serial == 0) if no specific was found */
 	if (!tool)
 		tool = tooldefault;
@@ -1086,7 +1460,7 @@ static Bool check_arbitrated_control(WacomDevicePtr priv, WacomDeviceStatePtr ds
  *   Handles suppression, transformation, filtering, and event dispatch.
  ****************************************************************************/
 
-void wcmEvent(WacomCommonPtr common, unsigned int channel,
+static void commonEvent(WacomCommonPtr common, unsigned int channel,
 	const WacomDeviceState* pState)
 {
 	WacomDeviceState ds;
@@ -1098,7 +1472,7 @@ void wcmEvent(WacomCommonPtr common, unsigned int channel,
 	DBG(10, common, "channel = %u\n", channel);
 
 	/* sanity check the channel */
-	if (channel >= MAX_CHANNELS)
+	if (channel >= common->wcmChannelCount)
 		return;
 
 	/* we must copy the state because certain types of filtering
@@ -1125,6 +1499,7 @@ void wcmEvent(WacomCommonPtr common, unsigned int channel,
 	{
 		DBG(11, common, "no device matches with id=%d, serial=%u\n",
 		    ds.device_type, ds.serial_num);
+		common->wcmStats[WSTAT_DROP_NO_TOOL]++;
 		return;
 	}
 
@@ -1133,6 +1508,7 @@ void wcmEvent(WacomCommonPtr common, unsigned int channel,
 	 * access errors to the device */
 	if (!tool->enabled) {
 		wcmLogSafe(priv, W_ERROR, "tool not initialized yet. Skipping event. \n");
+		common->wcmStats[WSTAT_DROP_TOOL_DISABLED]++;
 		return;
 	}
 
@@ -1162,6 +1538,14 @@ void wcmEvent(WacomCommonPtr common, unsigned int channel,
 	pChannel->valid.state = ds; /*save last raw sample */
 	if (pChannel->nSamples < common->wcmRawSample) ++pChannel->nSamples;
 
+	if (ds.device_type == TOUCH_ID)
+	{
+		common->wcmTouchChannels |= 1ULL << channel;
+		if (ds.serial_num >= 1 && ds.serial_num <= common->wcmChannelCount)
+			common->wcmContactChannel[ds.serial_num - 1] = channel + 1;
+	} else
+		common->wcmTouchChannels &= ~(1ULL << channel);
+
 	/* arbitrate pointer control */
 	if (check_arbitrated_control(priv, &ds)) {
 		if (WACOM_DRIVER.active != NULL && priv != WACOM_DRIVER.active) {
@@ -1194,6 +1578,17 @@ void wcmEvent(WacomCommonPtr common, unsigned int channel,
 		commonDispatchDevice(priv, pChannel);
 }
 
+void wcmEvent(WacomCommonPtr common, unsigned int channel,
+	const WacomDeviceState* pState)
+{
+	uint64_t start = wcmTimingStart(common);
+
+	WCM_PROBE(event, channel, pState->device_type, pState->serial_num,
+		  pState->x, pState->y, pState->pressure, pState->time);
+	commonEvent(common, channel, pState);
+	wcmTimingEnd(common, WTIME_CORE, start);
+}
+
 
 /**
  * Return the minimum pressure based on the current minimum pressure and the
@@ -1224,6 +1619,31 @@ rebasePressure(const WacomDevicePtr priv, const WacomDeviceState *ds)
 	return min_pressure;
 }
 
+/**
+ * The raw pressure range normalizePressure() maps to 0..maxCurve, after
+ * subtracting offset from the raw pressure. If the range is at least 1,
+ * priv->pressureScale is set up for it.
+ */
+static int
+pressureRange(const WacomDevicePtr priv, int *offset)
+{
+	WacomCommonPtr common = priv->common;
+	int range_left = common->wcmMaxZ;
+
+	*offset = 0;
+	if (common->wcmPressureRecalibration) {
+		*offset = priv->minPressure;
+		range_left -= priv->minPressure;
+	}
+
+	if (range_left >= 1 &&
+	    (priv->pressureScale.from_max != range_left ||
+	     priv->pressureScale.to_max != priv->maxCurve))
+		wcmScaleInit(&priv->pressureScale, priv->maxCurve, 0, range_left, 0);
+
+	return range_left;
+}
+
 /**
  * Instead of reporting the raw pressure, we normalize
  * the pressure from 0 to maxCurve. This is
@@ -1242,22 +1662,14 @@ rebasePressure(const WacomDevicePtr priv, const WacomDeviceState *ds)
 static int
 normalizePressure(const WacomDevicePtr priv, const int raw_pressure)
 {
-	WacomCommonPtr common = priv->common;
-	double pressure;
-	int p = raw_pressure;
-	int range_left = common->wcmMaxZ;
+	int offset;
+	int range_left = pressureRange(priv, &offset);
 
-	if (common->wcmPressureRecalibration) {
-		p -= priv->minPressure;
-		range_left -= priv->minPressure;
-	}
 	/* normalize pressure to 0..maxCurve */
 	if (range_left >= 1)
-		pressure = wcmScaleAxis(p, priv->maxCurve, 0, range_left, 0);
+		return wcmScaleApply(&priv->pressureScale, raw_pressure - offset);
 	else
-		pressure = priv->maxCurve;
-
-	return (int)pressure;
+		return priv->maxCurve;
 }
 
 /*
@@ -1413,7 +1825,7 @@ static void commonDispatchDevice(WacomDevicePtr priv,
 
 			}
 		}
-		filtered.pressure = applyPressureCurve(priv,&filtered);
+		filtered.pressure = applyPressureCurve(priv, filtered.pressure);
 	}
 
 	/* Optionally filter values only while in proximity */
@@ -1437,8 +1849,12 @@ static void commonDispatchDevice(WacomDevicePtr priv,
 
 	/* skip event if we don't have enough movement */
 	suppress = wcmCheckSuppress(common, &priv->oldState, &filtered);
+	WCM_PROBE(suppress, filtered.serial_num, suppress);
 	if (suppress == SUPPRESS_ALL)
+	{
+		common->wcmStats[WSTAT_SUPPRESSED]++;
 		return;
+	}
 
 	/* Store cursor hardware prox for next use */
 	if (IsCursor(priv))
@@ -1585,10 +2001,10 @@ void wcmSoftOutEvent(WacomDevicePtr priv)
  *
  * @return The modified pressure value.
  */
-static int applyPressureCurve(WacomDevicePtr pDev, const WacomDeviceStatePtr pState)
+static int applyPressureCurve(WacomDevicePtr pDev, int pressure)
 {
 	/* clip the pressure */
-	int p = max(0, pState->pressure);
+	int p = max(0, pressure);
 
 	p = min(pDev->maxCurve, p);
 
@@ -1599,6 +2015,93 @@ static int applyPressureCurve(WacomDevicePtr pDev, const WacomDeviceStatePtr pSt
 		return pDev->pPressCurve[p];
 }
 
+/* The tilt clamp of wcmFilterCoord() */
+static inline int clampTilt(int tilt, int tilt_min, int tilt_max)
+{
+	if (tilt > tilt_max)
+		return tilt_max;
+	else if (tilt < tilt_min)
+		return tilt_min;
+	return tilt;
+}
+
+/**
+ * Apply the device's transform chain to n samples at once: area scaling
+ * and rotation as wcmRotateAndScaleCoordinates() does, pressure
+ * normalization and the pressure curve as wcmSendEvents() does and the
+ * tilt clamp of wcmFilterCoord(). The results are the same as
+ * transforming one sample at a time. The pressure is normalized against
+ * the tool's current minimum pressure, the samples are taken to be part
+ * of the stroke that is in proximity.
+ *
+ * x and y are only transformed if both are given.
+ */
+void wcmTransformSamples(WacomDevicePtr priv, const WacomSamples *samples, size_t n)
+{
+	const WacomTransform *t = &priv->transform;
+	WacomCommonPtr common = priv->common;
+	int *x = samples->x, *y = samples->y, *p = samples->pressure;
+
+	if (x && y)
+	{
+		if (t->area[0])
+			wcmScaleApplyBatch(&t->areaScale[0], x, x, n);
+		if (t->area[1])
+			wcmScaleApplyBatch(&t->areaScale[1], y, y, n);
+
+		if (t->swap)
+		{
+			int tmp[64];
+
+			for (size_t i = 0; i < n; i += ARRAY_SIZE(tmp))
+			{
+				size_t len = min(n - i, ARRAY_SIZE(tmp));
+
+				memcpy(tmp, &x[i], len * sizeof(*tmp));
+				wcmScaleApplyBatch(&t->swapScale[0], &y[i], &x[i], len);
+				wcmScaleApplyBatch(&t->swapScale[1], tmp, &y[i], len);
+			}
+		}
+
+		if (t->flip[0])
+			for (size_t i = 0; i < n; i++)
+				x[i] = t->max[0] - (x[i] - t->min[0]);
+		if (t->flip[1])
+			for (size_t i = 0; i < n; i++)
+				y[i] = t->max[1] - (y[i] - t->min[1]);
+	}
+
+	if (p && (IsPen(priv) || IsTouch(priv)) && common->wcmMaxZ)
+	{
+		int offset;
+		int range_left = pressureRange(priv, &offset);
+
+		if (range_left >= 1)
+		{
+			if (offset)
+				for (size_t i = 0; i < n; i++)
+					p[i] -= offset;
+			wcmScaleApplyBatch(&priv->pressureScale, p, p, n);
+		}
+		else
+			for (size_t i = 0; i < n; i++)
+				p[i] = priv->maxCurve;
+
+		for (size_t i = 0; i < n; i++)
+			p[i] = applyPressureCurve(priv, p[i]);
+	}
+
+	if (HANDLE_TILT(common) && IsPen(priv))
+	{
+		int *tiltx = samples->tiltx, *tilty = samples->tilty;
+
+		for (size_t i = 0; tiltx && i < n; i++)
+			tiltx[i] = clampTilt(tiltx[i], common->wcmTiltMinX, common->wcmTiltMaxX);
+		for (size_t i = 0; tilty && i < n; i++)
+			tilty[i] = clampTilt(tilty[i], common->wcmTiltMinY, common->wcmTiltMaxY);
+	}
+}
+
 /*****************************************************************************
  * wcmRotateTablet
  ****************************************************************************/
@@ -1611,6 +2114,12 @@ void wcmRotateTablet(WacomDevicePtr priv, int value)
 	DBG(10, priv, "\n");
 	common->wcmRotate = value;
 
+	/* the rotation is per tablet, every tool needs its transform
+	 * recompiled */
+	wcmUpdateTransform(priv);
+	for (WacomDevicePtr dev = common->wcmDevices; dev; dev = dev->next)
+		wcmUpdateTransform(dev);
+
 	/* Only try updating properties once we're enabled, no point
 	 * otherwise. */
 	tool = priv->tool;
@@ -1618,6 +2127,90 @@ void wcmRotateTablet(WacomDevicePtr priv, int value)
 		wcmUpdateRotationProperty(priv);
 }
 
+/* Per-tablet arena.
+ * The common struct, the backend data and the serial tools from the
+ * config are only ever freed together, when the last device drops the
+ * common. They are carved from one cache-line aligned block so that the
+ * event path, which goes from the common to the backend data and the tools
+ * on every packet, touches neighbouring lines rather than separate heap
+ * objects. Allocations that don't fit go into further chunks.
+ */
+
+/* The first chunk holds the common and, after it, the backend data and
+ * the tools. On x86-64 that is 1344 bytes of common, 4992 of wcmUSBData
+ * (mostly the capabilities and the event queue, the flight recorder is a
+ * separate allocation) and 64 per ToolSerials entry. test_arena_layout in
+ * wcmUSB.c checks the USB backend still fits. */
+#define ARENA_ALIGN 64
+#define ARENA_SIZE 8192
+
+struct WacomArenaChunk {
+	struct WacomArenaChunk *next;
+	size_t size;
+	size_t used;
+};
+
+static size_t wcmArenaRound(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static struct WacomArenaChunk *wcmArenaChunkNew(size_t size)
+{
+	struct WacomArenaChunk *chunk;
+	size_t header = wcmArenaRound(sizeof(*chunk));
+	void *mem;
+
+	if (posix_memalign(&mem, ARENA_ALIGN, header + wcmArenaRound(size)))
+		return NULL;
+
+	chunk = mem;
+	chunk->next = NULL;
+	chunk->size = header + wcmArenaRound(size);
+	chunk->used = header;
+	return chunk;
+}
+
+static void *wcmArenaCarve(struct WacomArenaChunk *chunk, size_t size)
+{
+	void *ptr;
+
+	size = wcmArenaRound(size);
+	if (chunk->size - chunk->used < size)
+		return NULL;
+
+	ptr = (char*)chunk + chunk->used;
+	chunk->used += size;
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+/**
+ * Allocate zeroed, cache-line aligned memory that lives as long as the
+ * common. There is no way to free it before, don't use this for anything
+ * that gets replaced at runtime.
+ */
+void *wcmArenaAlloc(WacomCommonPtr common, size_t size)
+{
+	struct WacomArenaChunk *chunk;
+	void *ptr;
+
+	for (chunk = common->arena; chunk; chunk = chunk->next)
+	{
+		ptr = wcmArenaCarve(chunk, size);
+		if (ptr)
+			return ptr;
+	}
+
+	chunk = wcmArenaChunkNew(max(size, ARENA_SIZE));
+	if (!chunk)
+		return NULL;
+
+	chunk->next = common->arena;
+	common->arena = chunk;
+	return wcmArenaCarve(chunk, size);
+}
+
 /* Common pointer refcounting utilities.
  * Common is shared across all wacom devices off the same port. These
  * functions implement basic refcounting to avoid double-frees and memleaks.
@@ -1630,12 +2223,63 @@ void wcmRotateTablet(WacomDevicePtr priv, int value)
  *
  */
 
+/**
+ * Resize the channel pool of this common to count channels: one per touch
+ * contact, one for stylus/mouse and one for the pad. All channel state is
+ * reset when the size changes, so this must be called before the first
+ * event is processed.
+ *
+ * @param common
+ * @param count Number of channels, clamped to 2..WCM_MAX_CHANNELS
+ * @return FALSE if the pool could not be allocated, the old one is kept
+ */
+Bool wcmSetChannelCount(WacomCommonPtr common, unsigned int count)
+{
+	WacomChannelPtr channels;
+
+	count = max(count, 2U);
+	if (count > WCM_MAX_CHANNELS)
+	{
+		DBG(1, common, "%u channels requested, using %d\n",
+		    count, WCM_MAX_CHANNELS);
+		count = WCM_MAX_CHANNELS;
+	}
+
+	if (common->wcmChannel && count == common->wcmChannelCount)
+		return TRUE;
+
+	/* the contact table is in the same block, after the channels */
+	channels = calloc(1, count * (sizeof(WacomChannel) + 1));
+	if (!channels)
+		return FALSE;
+
+	free(common->wcmChannel);
+	common->wcmChannel = channels;
+	common->wcmChannelCount = count;
+	common->wcmContactChannel = (uint8_t*)(channels + count);
+	common->wcmTouchChannels = 0;
+	common->wcmTouchPending = 0;
+	common->wcmTouchBegin = 0;
+
+	return TRUE;
+}
+
 WacomCommonPtr wcmNewCommon(void)
 {
 	WacomCommonPtr common;
-	common = calloc(1, sizeof(WacomCommonRec));
-	if (!common)
-		return NULL;;
+	struct WacomArenaChunk *arena;
+
+	arena = wcmArenaChunkNew(sizeof(WacomCommonRec) + ARENA_SIZE);
+	if (!arena)
+		return NULL;
+
+	common = wcmArenaCarve(arena, sizeof(WacomCommonRec));
+	common->arena = arena;
+	if (!wcmSetChannelCount(common, MAX_CHANNELS))
+	{
+		free(arena);
+		return NULL;
+	}
 
 	common->is_common_rec = true;
 	common->refcnt = 1;
@@ -1663,6 +2307,102 @@ WacomCommonPtr wcmNewCommon(void)
 }
 
 
+/* Registry of common structs by device node.
+ * Preinit has to find the other devices on the same node, both to merge
+ * their common struct and to refuse duplicates. Walking every input device
+ * for that makes startup quadratic, so each common is hashed by the dev_t
+ * of its node when preinit opens it, and dropped when it is freed. The
+ * inode is compared too, a minor number may be reused by a new node while
+ * a device on the old one is still around.
+ */
+
+#define REGISTRY_BUCKETS 64
+
+static WacomCommonPtr wcmRegistry[REGISTRY_BUCKETS];
+
+static WacomCommonPtr *wcmRegistryBucket(dev_t rdev)
+{
+	return &wcmRegistry[rdev % REGISTRY_BUCKETS];
+}
+
+static void wcmUnregisterCommon(WacomCommonPtr common)
+{
+	WacomCommonPtr *prev;
+
+	if (!common->rdev)
+		return;
+
+	for (prev = wcmRegistryBucket(common->rdev); *prev; prev = &(*prev)->registryNext)
+	{
+		if (*prev == common)
+		{
+			*prev = common->registryNext;
+			break;
+		}
+	}
+
+	common->rdev = 0;
+	common->ino = 0;
+	common->registryNext = NULL;
+}
+
+void wcmRegisterCommon(WacomCommonPtr common, const struct stat *st)
+{
+	WacomCommonPtr *bucket;
+
+	if (!st->st_rdev ||
+	    (common->rdev == st->st_rdev && common->ino == st->st_ino))
+		return;
+
+	wcmUnregisterCommon(common);
+
+	bucket = wcmRegistryBucket(st->st_rdev);
+	common->rdev = st->st_rdev;
+	common->ino = st->st_ino;
+	common->registryNext = *bucket;
+	*bucket = common;
+}
+
+/**
+ * Like wcmForeachDevice(), but only for the devices whose common struct
+ * is registered for the node st describes.
+ */
+int wcmForeachNodeDevice(WacomDevicePtr priv, const struct stat *st,
+			 WacomDeviceCallback func, void *data)
+{
+	WacomCommonPtr common, next_common;
+	int nmatch = 0;
+
+	for (common = *wcmRegistryBucket(st->st_rdev); common; common = next_common)
+	{
+		WacomDevicePtr dev, next;
+
+		next_common = common->registryNext;
+		if (common->rdev != st->st_rdev || common->ino != st->st_ino)
+			continue;
+
+		for (dev = common->wcmDevices; dev; dev = next)
+		{
+			int rc;
+
+			next = dev->next;
+			if (dev == priv)
+				continue;
+
+			rc = func(dev, data);
+			if (rc == -ENODEV)
+				continue;
+			if (rc < 0)
+				return -rc;
+			nmatch += 1; /* zero counts as matched */
+			if (rc == 0)
+				return nmatch;
+		}
+	}
+
+	return nmatch;
+}
+
 void wcmFreeCommon(WacomCommonPtr *ptr)
 {
 	WacomCommonPtr common = *ptr;
@@ -1673,23 +2413,33 @@ void wcmFreeCommon(WacomCommonPtr *ptr)
 	DBG(10, common, "common refcount dec to %d\n", common->refcnt - 1);
 	if (--common->refcnt == 0)
 	{
-		free(common->private);
-		while (common->serials)
+		struct WacomArenaChunk *chunk = common->arena;
+		WacomToolPtr ser;
+
+		wcmUnregisterCommon(common);
+		if (common->wcmDevCls && common->wcmDevCls->Free)
+			common->wcmDevCls->Free(common);
+		if (common->wcmSerialTimer)
+			wcmTimerFree(common->wcmSerialTimer);
+		for (ser = common->serials; ser; ser = ser->next)
 		{
-			WacomToolPtr next;
-
 			DBG(10, common, "Free common serial: %u %s\n",
-					common->serials->serial,
-					common->serials->name);
-
-			free(common->serials->name);
-			next = common->serials->next;
-			free(common->serials);
-			common->serials = next;
+					ser->serial, ser->name);
+			free(ser->name);
 		}
 		free(common->device_path);
+		free(common->wcmSerialBasename);
 		free(common->touch_mask);
-		free(common);
+		free(common->wcmChannel);
+
+		/* the common itself is in one of the chunks */
+		while (chunk)
+		{
+			struct WacomArenaChunk *next = chunk->next;
+
+			free(chunk);
+			chunk = next;
+		}
 	}
 	*ptr = NULL;
 }
@@ -1753,6 +2503,335 @@ TEST_CASE(test_get_scroll_delta)
 	}
 }
 
+TEST_CASE(test_bit_index)
+{
+	for (int v = 0; v <= 0x10000; v++)
+		assert(bitIndex(v) == (int)log2((v << 1) | 0x01));
+
+	for (int i = 0; i < 30; i++)
+		assert(bitIndex(1 << i) == (int)log2(((1 << i) << 1) | 0x01));
+}
+
+TEST_CASE(test_airbrush_rotation)
+{
+	for (int w = -MAX_ABS_WHEEL; w <= 2 * MAX_ABS_WHEEL; w++)
+	{
+		int expected = w * MAX_ROTATION_RANGE / (double)MAX_ABS_WHEEL + MIN_ROTATION;
+
+		assert(airbrushRotation(w) == expected);
+	}
+}
+
+static void checkScale(const WacomScale *scale, int cx)
+{
+	int to_max = scale->to_max, to_min = scale->to_min;
+	int from_max = scale->from_max, from_min = scale->from_min;
+	int64_t from_width = (int64_t)from_max - from_min;
+	int64_t x = from_width ?
+		((int64_t)to_max - to_min) * (cx - from_min) / from_width + to_min : 0;
+
+	/* wcmScaleAxis() truncates the unclamped result to an int first,
+	 * far outside the range that wraps around */
+	if (x != (int)x)
+		return;
+
+	assert(wcmScaleApply(scale, cx) ==
+	       wcmScaleAxis(cx, to_max, to_min, from_max, from_min));
+}
+
+TEST_CASE(test_scale_apply)
+{
+	const int edges[] = {
+		INT_MIN / 2, -65536, -4097, -1, 0, 1, 2, 3, 1023, 2047, 4095,
+		65535, 65536, 1 << 20, INT_MAX / 2,
+	};
+	WacomScale scale;
+	unsigned int seed = 1;
+
+	for (size_t a = 0; a < ARRAY_SIZE(edges); a++)
+	for (size_t b = 0; b < ARRAY_SIZE(edges); b++)
+	for (size_t c = 0; c < ARRAY_SIZE(edges); c++)
+	{
+		int to_min = -edges[(a + b) % ARRAY_SIZE(edges)] / 3;
+
+		wcmScaleInit(&scale, edges[a], to_min, edges[b], edges[c]);
+		for (size_t i = 0; i < ARRAY_SIZE(edges); i++)
+			checkScale(&scale, edges[i]);
+	}
+
+	for (int i = 0; i < 200000; i++)
+	{
+		int to_max = rand_r(&seed) % 70000, to_min = -(rand_r(&seed) % 100);
+		int from_max = rand_r(&seed) % 200000, from_min = rand_r(&seed) % 100;
+
+		wcmScaleInit(&scale, to_max, to_min, from_max, from_min);
+		checkScale(&scale, rand_r(&seed) % 300000 - 50000);
+	}
+
+	/* a whole tablet axis and pressure range, exhaustively */
+	wcmScaleInit(&scale, 65535, 0, 44704, 0);
+	for (int cx = -1000; cx <= 46000; cx++)
+		checkScale(&scale, cx);
+	wcmScaleInit(&scale, 2047, 0, 8191, 40);
+	for (int cx = -1000; cx <= 9000; cx++)
+		checkScale(&scale, cx);
+}
+
+/* wcmRotateAndScaleCoordinates() before it used a compiled transform */
+static void rotateAndScaleReference(WacomDevicePtr priv, int* x, int* y)
+{
+	WacomCommonPtr common = priv->common;
+	int tmp_coord;
+	int xmax = priv->valuatorMaxX, xmin = priv->valuatorMinX;
+	int ymax = priv->valuatorMaxY, ymin = priv->valuatorMinY;
+
+	if (xmax > xmin)
+		*x = wcmScaleAxis(*x, xmax, xmin, priv->bottomX, priv->topX);
+	if (ymax > ymin)
+		*y = wcmScaleAxis(*y, ymax, ymin, priv->bottomY, priv->topY);
+
+	if (common->wcmRotate == ROTATE_CW || common->wcmRotate == ROTATE_CCW)
+	{
+		tmp_coord = *x;
+		*x = wcmScaleAxis(*y, xmax, xmin, ymax, ymin);
+		*y = wcmScaleAxis(tmp_coord, ymax, ymin, xmax, xmin);
+	}
+
+	if (common->wcmRotate == ROTATE_CW)
+		*y = ymax - (*y - ymin);
+	else if (common->wcmRotate == ROTATE_CCW)
+		*x = xmax - (*x - xmin);
+	else if (common->wcmRotate == ROTATE_HALF)
+	{
+		*x = xmax - (*x - xmin);
+		*y = ymax - (*y - ymin);
+	}
+}
+
+TEST_CASE(test_transform)
+{
+	WacomCommonRec common = {0};
+	WacomDeviceRec priv = {0};
+	WacomTool tool = {0};
+	/* valuator x range, y range, then the area in the same order */
+	const int configs[][8] = {
+		{ 0, 44704, 0, 27940,  0, 44704, 0, 27940 },	/* defaults */
+		{ 0, 44704, 0, 27940,  1000, 30000, 2500, 20000 }, /* smaller area */
+		{ 0, 44704, 0, 27940,  -500, 50000, -100, 30000 }, /* larger area */
+		{ 0, 44704, 0, 27940,  40000, 100, 27000, 50 },	/* inverted area */
+		{ 0, 4095, 0, 4095,  0, 4095, 0, 4095 },	/* square touch */
+		{ 0, 0, 0, 0,  0, 44704, 0, 27940 },		/* relative */
+		{ 100, 16383, -50, 9000,  100, 16383, -50, 9000 },
+	};
+	const int rotations[] = { ROTATE_NONE, ROTATE_CW, ROTATE_CCW, ROTATE_HALF };
+	/* beyond every range above */
+	const int lo = -60000, hi = 110000;
+
+	priv.common = &common;
+	priv.tool = &tool;
+	common.wcmDevices = &priv;
+
+	for (size_t c = 0; c < ARRAY_SIZE(configs); c++)
+	{
+		const int *cfg = configs[c];
+
+		priv.valuatorMinX = cfg[0];
+		priv.valuatorMaxX = cfg[1];
+		priv.valuatorMinY = cfg[2];
+		priv.valuatorMaxY = cfg[3];
+		priv.topX = cfg[4];
+		priv.bottomX = cfg[5];
+		priv.topY = cfg[6];
+		priv.bottomY = cfg[7];
+
+		for (size_t r = 0; r < ARRAY_SIZE(rotations); r++)
+		{
+			wcmRotateTablet(&priv, rotations[r]);
+
+			/* each output only depends on one input, sweep both
+			 * across the whole range */
+			for (int v = lo; v <= hi; v++)
+			{
+				int x = v, y = hi + lo - v;
+				int rx = x, ry = y;
+
+				wcmRotateAndScaleCoordinates(&priv, &x, &y);
+				rotateAndScaleReference(&priv, &rx, &ry);
+				assert(x == rx);
+				assert(y == ry);
+			}
+		}
+	}
+}
+
+TEST_CASE(test_scale_batch)
+{
+	const int edges[] = {
+		INT_MIN, INT_MIN / 2, -65536, -4097, -1, 0, 1, 2, 3, 1023, 2047,
+		4095, 65535, 65536, 1 << 20, INT_MAX / 2, INT_MAX,
+	};
+	const int scales[][4] = {
+		{ 65535, 0, 44704, 0 },
+		{ 2047, 0, 8191, 40 },
+		{ 44704, 0, 0, 44704 },		/* inverted */
+		{ 4095, 100, 4095, 100 },
+		{ 8191, 0, 1 << 30, -(1 << 30) }, /* too wide to multiply */
+		{ 100, 100, 5000, 0 },
+		{ 1 << 20, 0, 1 << 20, 0 },	/* factor above 32 bits */
+		{ 65535, -70000, 300000, 10 },
+		{ 65535, 0, 5, 5 },		/* constant */
+		{ 0, 1000, 1000, 0 },		/* constant */
+	};
+	int in[300], out[ARRAY_SIZE(in)], expected[ARRAY_SIZE(in)];
+	int best = scaleKernelBest();
+	unsigned int seed = 1;
+	WacomScale scale;
+
+	for (size_t s = 0; s < ARRAY_SIZE(scales); s++)
+	{
+		const int *sc = scales[s];
+
+		wcmScaleInit(&scale, sc[0], sc[1], sc[2], sc[3]);
+
+		for (size_t i = 0; i < ARRAY_SIZE(in); i++)
+		{
+			if (i < ARRAY_SIZE(edges))
+				in[i] = edges[i];
+			else if (i % 3 == 0)
+				/* around the ends of the range */
+				in[i] = (i % 2 ? sc[2] : sc[3]) + rand_r(&seed) % 5 - 2;
+			else
+				in[i] = rand_r(&seed) % 1200000 - 100000;
+			expected[i] = wcmScaleApply(&scale, in[i]);
+		}
+
+		for (int k = 0; k <= best; k++)
+		{
+			/* every length, so every kernel hits its tail */
+			for (size_t n = 0; n <= 40; n++)
+			{
+				memset(out, 0, sizeof(out));
+				scaleKernels[k](&scale, in + 3, out, n);
+				for (size_t i = 0; i < n; i++)
+					assert(out[i] == expected[i + 3]);
+			}
+
+			memcpy(out, in, sizeof(in));
+			scaleKernels[k](&scale, out, out, ARRAY_SIZE(out));
+			assert(memcmp(out, expected, sizeof(out)) == 0);
+		}
+	}
+
+	/* a whole tablet axis, exhaustively */
+	wcmScaleInit(&scale, 65535, 0, 44704, 0);
+	for (int base = -1000; base <= 46000; base += (int)ARRAY_SIZE(in))
+	{
+		for (size_t i = 0; i < ARRAY_SIZE(in); i++)
+			in[i] = base + (int)i;
+		wcmScaleApplyBatch(&scale, in, out, ARRAY_SIZE(in));
+		for (size_t i = 0; i < ARRAY_SIZE(in); i++)
+			assert(out[i] == wcmScaleApply(&scale, in[i]));
+	}
+}
+
+TEST_CASE(test_transform_samples)
+{
+	WacomCommonRec common = {0};
+	WacomDeviceRec priv = {0};
+	WacomTool tool = {0};
+	const int rotations[] = { ROTATE_NONE, ROTATE_CW, ROTATE_CCW, ROTATE_HALF };
+	int curve[1024];
+	enum { N = 257 };
+	int x[N], y[N], p[N], tx[N], ty[N];
+	int ex[N], ey[N], ep[N], etx[N], ety[N];
+	WacomSamples samples = { x, y, p, tx, ty };
+	unsigned int seed = 1;
+
+	for (size_t i = 0; i < ARRAY_SIZE(curve); i++)
+		curve[i] = (int)(i * i / ARRAY_SIZE(curve));
+
+	priv.common = &common;
+	priv.tool = &tool;
+	priv.flags = STYLUS_ID;
+	priv.valuatorMaxX = 44704;
+	priv.valuatorMaxY = 27940;
+	priv.topX = 1000;
+	priv.bottomX = 40000;
+	priv.topY = 27000;
+	priv.bottomY = 50;
+	priv.maxCurve = ARRAY_SIZE(curve) - 1;
+	priv.minPressure = 30;
+	common.wcmDevices = &priv;
+	common.wcmMaxZ = 8191;
+	common.wcmFlags = TILT_ENABLED_FLAG;
+	common.wcmTiltMinX = -64;
+	common.wcmTiltMaxX = 63;
+	common.wcmTiltMinY = -60;
+	common.wcmTiltMaxY = 60;
+
+	for (int c = 0; c < 2; c++)
+	for (int recal = 0; recal < 2; recal++)
+	for (size_t r = 0; r < ARRAY_SIZE(rotations); r++)
+	{
+		priv.pPressCurve = c ? curve : NULL;
+		common.wcmPressureRecalibration = recal;
+		wcmRotateTablet(&priv, rotations[r]);
+
+		for (int i = 0; i < N; i++)
+		{
+			x[i] = rand_r(&seed) % 60000 - 5000;
+			y[i] = rand_r(&seed) % 40000 - 5000;
+			p[i] = rand_r(&seed) % 9000 - 100;
+			tx[i] = rand_r(&seed) % 200 - 100;
+			ty[i] = rand_r(&seed) % 200 - 100;
+
+			ex[i] = x[i];
+			ey[i] = y[i];
+			wcmRotateAndScaleCoordinates(&priv, &ex[i], &ey[i]);
+			ep[i] = applyPressureCurve(&priv, normalizePressure(&priv, p[i]));
+			etx[i] = clampTilt(tx[i], common.wcmTiltMinX, common.wcmTiltMaxX);
+			ety[i] = clampTilt(ty[i], common.wcmTiltMinY, common.wcmTiltMaxY);
+		}
+
+		wcmTransformSamples(&priv, &samples, N);
+		assert(memcmp(x, ex, sizeof(x)) == 0);
+		assert(memcmp(y, ey, sizeof(y)) == 0);
+		assert(memcmp(p, ep, sizeof(p)) == 0);
+		assert(memcmp(tx, etx, sizeof(tx)) == 0);
+		assert(memcmp(ty, ety, sizeof(ty)) == 0);
+	}
+}
+
+TEST_CASE(test_axis_data)
+{
+	WacomAxisData axes = {0};
+	char dump[256];
+	int value;
+
+	wcmAxisDump(&axes, dump, sizeof(dump));
+	assert(strcmp(dump, "") == 0);
+
+	for (enum WacomAxisType which = WACOM_AXIS_X; which <= _WACOM_AXIS_LAST; which <<= 1)
+	{
+		assert(!wcmAxisGet(&axes, which, &value));
+		wcmAxisSet(&axes, which, (int)wcmAxisIndex(which) * 10);
+	}
+	assert(axes.mask == (_WACOM_AXIS_LAST << 1) - 1);
+	for (unsigned int n = 0; n < WACOM_AXIS_COUNT; n++)
+	{
+		assert(wcmAxisGet(&axes, 1u << n, &value));
+		assert(value == (int)n * 10);
+	}
+
+	/* throttle and wheel are separate axes */
+	wcmAxisSet(&axes, WACOM_AXIS_THROTTLE, -1);
+	assert(wcmAxisGet(&axes, WACOM_AXIS_WHEEL, &value) && value == 90);
+
+	axes.mask = WACOM_AXIS_Y | WACOM_AXIS_THROTTLE | WACOM_AXIS_SCROLL_Y;
+	wcmAxisDump(&axes, dump, sizeof(dump));
+	assert(strcmp(dump, "y: 10, throttle: -1, scroll-y: 130") == 0);
+}
+
 TEST_CASE(test_get_wheel_button)
 {
 	int delta;
@@ -1810,6 +2889,175 @@ TEST_CASE(test_common_ref)
 	assert(!second && !common);
 }
 
+TEST_CASE(test_arena)
+{
+	WacomCommonPtr common = wcmNewCommon();
+	char *small, *big, *next;
+
+	assert(common);
+	assert(((uintptr_t)common % ARENA_ALIGN) == 0);
+
+	/* lands in the same chunk as the common */
+	small = wcmArenaAlloc(common, 3);
+	assert(small && ((uintptr_t)small % ARENA_ALIGN) == 0);
+	assert(small > (char*)common && (size_t)(small - (char*)common) < sizeof(*common) + ARENA_SIZE);
+	next = wcmArenaAlloc(common, 1);
+	assert(next == small + ARENA_ALIGN);
+
+	/* too big for what's left, gets its own chunk */
+	big = wcmArenaAlloc(common, ARENA_SIZE * 2);
+	assert(big && ((uintptr_t)big % ARENA_ALIGN) == 0);
+	assert(big[0] == 0 && big[ARENA_SIZE * 2 - 1] == 0);
+	assert(common->arena->next);
+
+	/* earlier chunks are still used for small ones */
+	assert(wcmArenaAlloc(common, 1) == next + ARENA_ALIGN);
+
+	wcmFreeCommon(&common);
+	assert(!common);
+}
+
+TEST_CASE(test_channel_count)
+{
+	WacomCommonPtr common = wcmNewCommon();
+	WacomChannelPtr channels;
+
+	assert(common->wcmChannelCount == MAX_CHANNELS);
+	assert(PAD_CHANNEL(common) == MAX_CHANNELS - 1);
+
+	/* pen-only */
+	assert(wcmSetChannelCount(common, 3));
+	assert(common->wcmChannelCount == 3);
+	assert(PAD_CHANNEL(common) == 2);
+
+	/* same size keeps the state */
+	channels = common->wcmChannel;
+	common->wcmChannel[1].work.proximity = 1;
+	assert(wcmSetChannelCount(common, 3));
+	assert(common->wcmChannel == channels);
+	assert(common->wcmChannel[1].work.proximity == 1);
+
+	/* a resize resets it */
+	common->wcmTouchChannels = 0x2;
+	assert(wcmSetChannelCount(common, 42));
+	assert(common->wcmChannelCount == 42);
+	assert(common->wcmChannel[1].work.proximity == 0);
+	assert(common->wcmTouchChannels == 0);
+	for (unsigned int i = 0; i < common->wcmChannelCount; i++)
+		assert(common->wcmContactChannel[i] == 0);
+	common->wcmContactChannel[41] = 42;
+	common->wcmChannel[41].work.x = 1;
+
+	/* clamped at both ends */
+	assert(wcmSetChannelCount(common, 0));
+	assert(common->wcmChannelCount == 2);
+	assert(wcmSetChannelCount(common, WCM_MAX_CHANNELS + 10));
+	assert(common->wcmChannelCount == WCM_MAX_CHANNELS);
+
+	wcmFreeCommon(&common);
+}
+
+TEST_CASE(test_action_compile)
+{
+	WacomAction action = {0};
+	unsigned keys[] = {
+		AC_KEY | AC_KEYBTNPRESS | 50,	/* shift down, stays down */
+		AC_KEY | AC_KEYBTNPRESS | 38,	/* 'a' down */
+		AC_KEY | 38,			/* 'a' up */
+		AC_BUTTON | AC_KEYBTNPRESS | 3,	/* button 3 down, stays down */
+		AC_PANSCROLL,
+	};
+	unsigned toolong[WCM_MAX_ACTIONS + 1] = {0};
+	const unsigned *releases;
+
+	assert(wcmActionCompile(&action, keys, ARRAY_SIZE(keys)));
+	assert(wcmActionSize(&action) == ARRAY_SIZE(keys));
+	assert(memcmp(wcmActionData(&action), keys, sizeof(keys)) == 0);
+
+	releases = wcmActionReleases(&action);
+	assert(wcmActionReleaseSize(&action) == 3);
+	assert(releases[0] == (AC_KEY | 50));
+	assert(releases[1] == (AC_BUTTON | 3));
+	assert(releases[2] == AC_PANSCROLL);
+
+	/* too long: rejected, previous program kept */
+	assert(!wcmActionCompile(&action, toolong, ARRAY_SIZE(toolong)));
+	assert(wcmActionSize(&action) == ARRAY_SIZE(keys));
+
+	assert(wcmActionCompile(&action, NULL, 0));
+	assert(wcmActionSize(&action) == 0);
+	assert(wcmActionReleaseSize(&action) == 0);
+
+	wcmActionFree(&action);
+	assert(action.program == NULL);
+}
+
+TEST_CASE(test_find_tool)
+{
+	WacomCommonRec common = {0};
+	WacomTool generic = { .typeid = STYLUS_ID };
+	WacomTool pen = { .typeid = STYLUS_ID, .serial = 0x1234 };
+	WacomDeviceState ds = { .device_type = STYLUS_ID, .serial_num = 0x1234 };
+
+	generic.next = &pen;
+	common.wcmTool = &generic;
+
+	/* tools hotplugged at startup are picked even before enabled */
+	assert(findTool(&common, &ds) == &pen);
+
+	common.wcmLazySerials = TRUE;
+	assert(findTool(&common, &ds) == &generic);
+	pen.enabled = TRUE;
+	assert(findTool(&common, &ds) == &pen);
+
+	ds.serial_num = 0x5678;
+	assert(findTool(&common, &ds) == &generic);
+	ds.device_type = ERASER_ID;
+	assert(findTool(&common, &ds) == NULL);
+}
+
+static int countDevice(WacomDevicePtr priv, void *data)
+{
+	return 1;
+}
+
+TEST_CASE(test_common_registry)
+{
+	WacomDeviceRec dev[3] = {0};
+	WacomCommonPtr common = wcmNewCommon();
+	WacomCommonPtr other = wcmNewCommon();
+	struct stat st = {0}, st2;
+
+	st.st_rdev = 13 << 8 | 80;
+	st.st_ino = 100;
+
+	/* two devices sharing common, one with its own on the same node */
+	dev[0].next = &dev[1];
+	common->wcmDevices = &dev[0];
+	other->wcmDevices = &dev[2];
+
+	assert(wcmForeachNodeDevice(NULL, &st, countDevice, NULL) == 0);
+	wcmRegisterCommon(common, &st);
+	wcmRegisterCommon(other, &st);
+	assert(wcmForeachNodeDevice(NULL, &st, countDevice, NULL) == 3);
+	assert(wcmForeachNodeDevice(&dev[1], &st, countDevice, NULL) == 2);
+
+	/* same bucket, different node */
+	st2 = st;
+	st2.st_rdev += REGISTRY_BUCKETS;
+	assert(wcmForeachNodeDevice(NULL, &st2, countDevice, NULL) == 0);
+
+	/* minor reused by a new node */
+	st2 = st;
+	st2.st_ino++;
+	assert(wcmForeachNodeDevice(NULL, &st2, countDevice, NULL) == 0);
+
+	wcmFreeCommon(&other);
+	assert(wcmForeachNodeDevice(NULL, &st, countDevice, NULL) == 2);
+	wcmFreeCommon(&common);
+	assert(wcmForeachNodeDevice(NULL, &st, countDevice, NULL) == 0);
+}
+
 TEST_CASE(test_rebase_pressure)
 {
 	WacomDeviceRec priv = {0};
@@ -2004,6 +3252,34 @@ TEST_CASE(test_suppress)
 	new.pressure = old.pressure;
 }
 
+TEST_CASE(test_timing_bucket)
+{
+	WacomCommonRec common = {0};
+
+	assert(wcmTimingBucket(0) == 0);
+	assert(wcmTimingBucket(999) == 0);
+	assert(wcmTimingBucket(1000) == 1);
+	assert(wcmTimingBucket(1999) == 1);
+	assert(wcmTimingBucket(2000) == 2);
+	assert(wcmTimingBucket(3999) == 2);
+	assert(wcmTimingBucket(4000) == 3);
+	assert(wcmTimingBucket(16383999) == WTIME_BUCKETS - 2);
+	assert(wcmTimingBucket(16384000) == WTIME_BUCKETS - 1);
+	assert(wcmTimingBucket(UINT64_MAX) == WTIME_BUCKETS - 1);
+
+	/* enabling resets, disabling keeps the data */
+	common.wcmTiming[WTIME_CORE][3] = 10;
+	wcmTimingSetEnabled(&common, TRUE);
+	assert(common.wcmTimingEnabled);
+	assert(common.wcmTiming[WTIME_CORE][3] == 0);
+	common.wcmTiming[WTIME_CORE][3] = 10;
+	wcmTimingSetEnabled(&common, TRUE);
+	assert(common.wcmTiming[WTIME_CORE][3] == 10);
+	wcmTimingSetEnabled(&common, FALSE);
+	assert(!common.wcmTimingEnabled);
+	assert(common.wcmTiming[WTIME_CORE][3] == 10);
+}
+
 
 #endif
 
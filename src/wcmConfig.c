@@ -22,11 +22,15 @@
 #include "xf86Wacom.h"
 #include "wcmFilter.h"
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
 
 #ifdef ENABLE_TESTS
 #include "wacom-test-suite.h"
+#include <ftw.h>
 #endif
 
 /*****************************************************************************
@@ -126,6 +130,12 @@ static void wcmFree(WacomDevicePtr priv)
 	wcmTimerFree(priv->serial_timer);
 	wcmTimerFree(priv->tap_timer);
 	wcmTimerFree(priv->touch_timer);
+	for (size_t i = 0; i < ARRAY_SIZE(priv->key_actions); i++)
+		wcmActionFree(&priv->key_actions[i]);
+	for (size_t i = 0; i < ARRAY_SIZE(priv->strip_actions); i++)
+		wcmActionFree(&priv->strip_actions[i]);
+	for (size_t i = 0; i < ARRAY_SIZE(priv->wheel_actions); i++)
+		wcmActionFree(&priv->wheel_actions[i]);
 	free(priv->tool);
 	wcmFreeCommon(&priv->common);
 	free(priv->name);
@@ -399,11 +409,14 @@ static int matchDevice(WacomDevicePtr privMatch, void *data)
  * the new device's "common" struct and point to the one of the already
  * existing one instead.
  * Then add the new device to the now-shared common struct.
+ * Only devices registered for the node st describes are considered, unless
+ * the node is unknown.
  *
  * Returns 1 on a found match or 0 otherwise.
  * Common_return is set to the common struct in use by this device.
  */
-static Bool wcmMatchDevice(WacomDevicePtr priv, WacomCommonPtr *common_return)
+static Bool wcmMatchDevice(WacomDevicePtr priv, const struct stat *st,
+			   WacomCommonPtr *common_return)
 {
 	WacomCommonPtr common = priv->common;
 
@@ -412,9 +425,13 @@ static Bool wcmMatchDevice(WacomDevicePtr priv, WacomCommonPtr *common_return)
 	if (!common->device_path)
 		return 0;
 
+	if (st->st_rdev)
+		wcmForeachNodeDevice(priv, st, matchDevice, priv);
+	else
+		wcmForeachDevice(priv, matchDevice, priv);
+
 	/* If a match is found, priv->common has been replaced */
-	if (wcmForeachDevice(priv, matchDevice, priv) == 0)
-		*common_return = priv->common;
+	*common_return = priv->common;
 	return 0;
 }
 
@@ -549,24 +566,9 @@ static int wcmIsHotpluggedDevice(WacomDevicePtr priv)
 	return matches;
 }
 
-static Bool wcmIsWacomDevice (char* fname)
+static Bool wcmIsWacomVendor(unsigned int vendor)
 {
-	int fd = -1;
-	struct input_id id;
-
-	SYSCALL(fd = open(fname, O_RDONLY));
-	if (fd < 0)
-		return FALSE;
-
-	if (ioctl(fd, EVIOCGID, &id) < 0)
-	{
-		SYSCALL(close(fd));
-		return FALSE;
-	}
-
-	SYSCALL(close(fd));
-
-	switch(id.vendor)
+	switch(vendor)
 	{
 		case WACOM_VENDOR_ID:
 		case WALTOP_VENDOR_ID:
@@ -579,29 +581,103 @@ static Bool wcmIsWacomDevice (char* fname)
 	return FALSE;
 }
 
+/**
+ * Look through the event devices in sysfs for one of ours. This only reads
+ * the vendor from sysfs and doesn't open any device nodes.
+ *
+ * @return the lowest N of a matching eventN or -1 if there is none
+ */
+static int wcmFindWacomEventNode(const char *sysfs_dir)
+{
+	DIR *dir;
+	struct dirent *entry;
+	int found = -1;
+
+	dir = opendir(sysfs_dir);
+	if (!dir)
+		return -1;
+
+	while ((entry = readdir(dir)))
+	{
+		char path[PATH_MAX];
+		unsigned int vendor;
+		int n;
+		FILE *f;
+
+		if (sscanf(entry->d_name, "event%d", &n) != 1)
+			continue;
+		if (found != -1 && n >= found)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s/device/id/vendor", sysfs_dir, entry->d_name);
+		f = fopen(path, "re");
+		if (!f)
+			continue;
+		if (fscanf(f, "%x", &vendor) == 1 && wcmIsWacomVendor(vendor))
+			found = n;
+		fclose(f);
+	}
+
+	closedir(dir);
+
+	return found;
+}
+
+/* Wait up to timeout ms for something to change in /dev/input. sysfs
+ * doesn't send inotify events for new devices, callers needing it rescanned
+ * pass a short timeout. */
+static void wcmWaitForDevInput(int inotify_fd, int timeout)
+{
+	struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+	char buf[4096];
+
+	if (inotify_fd < 0)
+	{
+		usleep(min(timeout, 100) * 1000);
+		return;
+	}
+
+	if (poll(&pfd, 1, timeout) > 0)
+		while (read(inotify_fd, buf, sizeof(buf)) > 0)
+			; /* drain, we rescan anyway */
+}
+
 /*****************************************************************************
  * wcmEventAutoDevProbe -- Probe for right input device
  ****************************************************************************/
-#define DEV_INPUT_EVENT "/dev/input/event%d"
-#define EVDEV_MINORS    32
+#define SYS_CLASS_INPUT "/sys/class/input"
+#define DEV_INPUT       "/dev/input"
 char *wcmEventAutoDevProbe (WacomDevicePtr priv)
 {
-	/* We are trying to find the right eventX device */
-	int i = 0, wait = 0;
 	const int max_wait = 2000;
+	uint32_t start = wcmTimeInMillis();
+	int wait = 0;
+	Bool waiting = FALSE;
+	int fd, n;
+
+	/* Watch before scanning so we can't miss the node being created */
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd >= 0 && inotify_add_watch(fd, DEV_INPUT, IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0)
+	{
+		close(fd);
+		fd = -1;
+	}
 
-	/* If device is not available after Resume, wait some ms */
-	while (wait <= max_wait)
+	/* The kernel may not have registered the tablet in sysfs yet and udev
+	 * may not have created the node yet, wait for both. */
+	for (;;)
 	{
-		for (i = 0; i < EVDEV_MINORS; i++)
-		{
-			char fname[64];
-			Bool is_wacom;
+		char fname[64];
 
-			sprintf(fname, DEV_INPUT_EVENT, i);
-			is_wacom = wcmIsWacomDevice(fname);
-			if (is_wacom)
+		n = wcmFindWacomEventNode(SYS_CLASS_INPUT);
+		if (n >= 0)
+		{
+			snprintf(fname, sizeof(fname), DEV_INPUT "/event%d", n);
+			if (access(fname, R_OK) == 0)
 			{
+				if (fd >= 0)
+					close(fd);
+
 				wcmLog(priv, W_PROBED, "probed device is %s (waited %d msec)\n", fname, wait);
 				wcmOptSetStr(priv, "Device", fname);
 
@@ -609,12 +685,22 @@ char *wcmEventAutoDevProbe (WacomDevicePtr priv)
 				return wcmOptCheckStr(priv, "Device", NULL);
 			}
 		}
-		wait += 100;
-		wcmLog(priv, W_ERROR, "waiting 100 msec (total %dms) for device to become ready\n", wait);
-		usleep(100*1000);
+
+		wait = wcmTimeInMillis() - start;
+		if (wait >= max_wait)
+			break;
+
+		if (!waiting)
+			wcmLog(priv, W_ERROR, "waiting for a Wacom event device to become ready\n");
+		waiting = TRUE;
+		wcmWaitForDevInput(fd, min(max_wait - wait, 100));
 	}
+
+	if (fd >= 0)
+		close(fd);
+
 	wcmLog(priv, W_ERROR,
-		    "no Wacom event device found (checked %d nodes, waited %d msec)\n", i + 1, wait);
+		    "no Wacom event device found (waited %d msec)\n", wait);
 	wcmLog(priv, W_ERROR, "unable to probe device\n");
 	return NULL;
 }
@@ -943,6 +1029,7 @@ int wcmPreInit(WacomDevicePtr priv)
 	char		*oldname = NULL;
 	int		need_hotplug = 0, is_dependent = 0;
 	int		fd = -1;
+	struct stat	st;
 
 	/* Ignore real devices during test suite runs, or test devices during
 	 * normal operation */
@@ -976,14 +1063,19 @@ int wcmPreInit(WacomDevicePtr priv)
 		goto SetupProc_fail;
 	wcmSetFd(priv, fd);
 
+	if (fstat(fd, &st) == -1)
+		memset(&st, 0, sizeof(st));
+
 	if (!wcmDetectDeviceClass(priv))
 		goto SetupProc_fail;
 
 	/* check if this is the first tool on the port */
-	if (!wcmMatchDevice(priv, &common))
+	if (!wcmMatchDevice(priv, &st, &common))
 		/* initialize supported keys with the first tool on the port */
 		wcmDeviceTypeKeys(priv);
 
+	wcmRegisterCommon(common, &st);
+
 	common->debugLevel = wcmOptGetInt(priv, "CommonDBG", common->debugLevel);
 	oldname = strdup(priv->name);
 
@@ -1140,6 +1232,7 @@ static int wcmInitAxes(WacomDevicePtr priv)
 	 * x/y changes later */
 	priv->valuatorMinY = min;
 	priv->valuatorMaxY = max;
+	wcmUpdateTransform(priv);
 
 	/* third valuator: pressure */
 	if (!IsPad(priv))
@@ -1220,7 +1313,7 @@ static int wcmInitAxes(WacomDevicePtr priv)
 		wcmInitAxis(priv, WACOM_AXIS_RING2, min, max, res);
 	}
 
-	if (IsPen(priv)) {
+	if (IsPen(priv) || IsTouch(priv)) {
 		/* seventh valuator: scroll_x */
 		wcmInitAxis(priv, WACOM_AXIS_SCROLL_X, -1, -1, 0);
 
@@ -1248,7 +1341,7 @@ Bool wcmDevInit(WacomDevicePtr priv)
 	if (IsPad(priv) && TabletHasFeature(priv->common, WCM_DUALRING))
 		nbaxes = priv->naxes = nbaxes + 1; /* ABS wheel 2 */
 
-	if (IsPen(priv))
+	if (IsPen(priv) || IsTouch(priv))
 		nbaxes = priv->naxes = nbaxes + 2; /* Scroll X and Y */
 
 	/* if more than 3 buttons, offset by the four scroll buttons,
@@ -1493,6 +1586,53 @@ TEST_CASE(test_flag_set)
 	}
 }
 
+static void make_sysfs_event(const char *root, const char *name, const char *vendor)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", root, name);
+	mkdir(path, 0700);
+	strcat(path, "/device");
+	mkdir(path, 0700);
+	strcat(path, "/id");
+	mkdir(path, 0700);
+	strcat(path, "/vendor");
+	f = fopen(path, "w");
+	assert(f);
+	fprintf(f, "%s\n", vendor);
+	fclose(f);
+}
+
+static int remove_sysfs_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	return flag == FTW_DP ? rmdir(path) : unlink(path);
+}
+
+TEST_CASE(test_find_event_node)
+{
+	char root[] = "/tmp/wacom-sysfs-XXXXXX";
+
+	assert(mkdtemp(root));
+
+	assert(wcmFindWacomEventNode("/nonexistent") == -1);
+	assert(wcmFindWacomEventNode(root) == -1);
+
+	make_sysfs_event(root, "event3", "046d"); /* not ours */
+	make_sysfs_event(root, "mouse0", "056a"); /* not an event node */
+	assert(wcmFindWacomEventNode(root) == -1);
+
+	/* beyond the old limit of 32 nodes */
+	make_sysfs_event(root, "event40", "056a");
+	assert(wcmFindWacomEventNode(root) == 40);
+
+	/* lowest number wins */
+	make_sysfs_event(root, "event12", "17ef");
+	assert(wcmFindWacomEventNode(root) == 12);
+
+	assert(nftw(root, remove_sysfs_entry, 8, FTW_DEPTH | FTW_PHYS) == 0);
+}
+
 #endif
 
 /* vim: set noexpandtab tabstop=8 shiftwidth=8: */
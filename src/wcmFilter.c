@@ -19,7 +19,6 @@
 
 #include <config.h>
 
-#include <math.h>
 #include "xf86Wacom.h"
 #include "wcmFilter.h"
 
@@ -322,6 +321,124 @@ int wcmFilterCoord(WacomCommonPtr common, WacomChannelPtr pChannel,
 	return 0; /* lookin' good */
 }
 
+/* tan() of the rounding boundaries between two rotation steps in the
+ * first octant, i.e. of (i + 0.5) * 360/MAX_ROTATION_RANGE degrees, in
+ * 0.64 fixed point, rounded down. Generated with 60 digit decimal
+ * arithmetic, double precision tan() is not good enough for the low bits.
+ */
+#define ROTATION_OCTANT (MAX_ROTATION_RANGE / 8)
+static const uint64_t tan_boundary[ROTATION_OCTANT] = {
+	0x007261cbab69ed8eull, 0x01572619afea9be6ull, 0x023bec8bc200cde0ull, 0x0320b68f4f428fadull,
+	0x04058591dc1254c3ull, 0x04ea5b010cbf38eeull, 0x05cf384aaea6f2e7ull, 0x06b41edcc159f496ull,
+	0x079910257fc23552ull, 0x087e0d93694d22adull, 0x096318954b1934b6ull, 0x0a48329a4927a2d1ull,
+	0x0b2d5d11e792b6c0ull, 0x0c12996c13c93bd4ull, 0x0cf7e9192dcf88c7ull, 0x0ddd4d8a1186a326ull,
+	0x0ec2c8301ff9fbdaull, 0x0fa85a7d48b444fbull, 0x108e05e4131be198ull, 0x1173cbd7a7d77116ull,
+	0x1259adcbda3af835ull, 0x133fad3531be2ae5ull, 0x1425cb88f37c5aa2ull, 0x150c0a3d2bbe8e34ull,
+	0x15f26ac8b7904869ull, 0x16d8eea34e5f847dull, 0x17bf97458ba86fe6ull, 0x18a66628f8ad6a4bull,
+	0x198d5cc8163bd58aull, 0x1a747c9e667e40fdull, 0x1b5bc72876dc7c4bull, 0x1c433de3e9ea1f6eull,
+	0x1d2ae24f816416f9ull, 0x1e12b5eb283dc4f8ull, 0x1efaba37fcbe4853ull, 0x1fe2f0b85aae7e12ull,
+	0x20cb5aefe5985172ull, 0x21b3fa639317f16dull, 0x229cd099b53f83eaull, 0x2385df1a050df0abull,
+	0x246f276dacf95fcaull, 0x2558ab1f538e0975ull, 0x26426bbb2621f693ull, 0x272c6acee39e53f3ull,
+	0x2816a9e9e75efbc1ull, 0x29012a9d3428db08ull, 0x29ebee7b7f37db5dull, 0x2ad6f7193b64faf1ull,
+	0x2bc2460ca4653fb8ull, 0x2caddcedca2234a6ull, 0x2d99bd569c2ca2a0ull, 0x2e85e8e2f54a3918ull,
+	0x2f726130a71edd2bull, 0x305f27df85f2589full, 0x314c3e91749324f5ull, 0x3239a6ea705711bbull,
+	0x332762909d3a880eull, 0x3415732c521f307aull, 0x3503da68252ac357ull, 0x35f299f0f846cf1cull,
+	0x36e1b37605c24353ull, 0x37d128a8ed159255ull, 0x38c0fb3dbfca3f5eull, 0x39b12ceb0e86b226ull,
+	0x3aa1bf69f63f2ce1ull, 0x3b92b4762d8cc543ull, 0x3c840dce122b4514ull, 0x3d75cd32b69edad6ull,
+	0x3e67f467f0028714ull, 0x3f5a853464003736ull, 0x404d816196f382fbull, 0x4140eabbfa38062aull,
+	0x4234c312faa454a0ull, 0x43290c390f328b8full, 0x441dc803c7d78782ull, 0x4512f84bdc89cbbeull,
+	0x46089eed3c792c8full, 0x46febdc71d78535cull, 0x47f556bc0b993892ull, 0x48ec6bb1f8fdb518ull,
+	0x49e3fe924ddd526cull, 0x4adc1149f8c1867dull, 0x4bd4a5c97ef98e1dull, 0x4ccdbe050d471f08ull,
+	0x4dc75bf488c530beull, 0x4ec18193a00a21c6ull, 0x4fbc30e1dc86858aull, 0x50b76be2b421edbcull,
+	0x51b3349d9b170915ull, 0x52af8d1e16107869ull, 0x53ac7773cc87c235ull, 0x54a9f5b29b67d47cull,
+	0x55a809f2a7f48c36ull, 0x56a6b65072f8c1aaull, 0x57a5fcecec3c6105ull, 0x58a5dfed86441edaull,
+	0x59a6617c4a5c60b5ull, 0x5aa783c7ecf0fabaull, 0x5ba94903e2336c2bull, 0x5cabb36873114e00ull,
+	0x5daec532d27cb035ull, 0x5eb280a533082c02ull, 0x5fb6e806dcd87b75ull, 0x60bbfda443ed70cdull,
+	0x61c1c3cf1ec432caull, 0x62c83cde7d54adbdull, 0x63cf6b2ee06c3454ull, 0x64d7512251675682ull,
+	0x65dff1207a4d0088ull, 0x66e94d96be4d003aull, 0x67f368f852a41ae0ull, 0x68fe45be57e7ead8ull,
+	0x6a09e667f3bcc908ull, 0x6b164d7a6af813a6ull, 0x6c237d813c31318dull, 0x6d31790e3ac3bf7bull,
+	0x6e4042b9aa456313ull, 0x6f4fdd225a71ce64ull, 0x70604aedc38f8e0bull, 0x71718ec823504bbbull,
+	0x7283ab649a2f3f39ull, 0x7396a37d4950984full, 0x74aa79d370e4bd86ull, 0x75bf312f8f124cd7ull,
+	0x76d4cc617f69ddb0ull, 0x77eb4e409ae69624ull, 0x7902b9abd87eb851ull, 0x7a1b1189ee47607eull,
+	0x7b3458c9732ec0baull, 0x7c4e926101503b8bull, 0x7d69c14f58e5d475ull, 0x7e85e89b83da8333ull,
+	0x7fa30b54fa010cf8ull, 0x80c12c93c5f31e4cull, 0x81e04f78aa9c7813ull, 0x8300772d49761aa8ull,
+	0x8421a6e44975738bull, 0x8543e1d97eb3abdaull, 0x86672b5212d150cdull, 0x878b869cae1aaae2ull,
+	0x88b0f711a17134bcull, 0x89d7801310fec000ull, 0x8aff250d1fb6f472ull, 0x8c27e9761babf49eull,
+	0x8d51d0ceab3b1310ull, 0x8e7cdea1fb16a411ull, 0x8fa91685ed321994ull, 0x90d67c1b4895b9bdull,
+	0x9205130dea1f645bull, 0x9334df14f6360080ull, 0x9465e3f30b755171ull, 0x9598257676581950ull,
+	0x96cba77965e69842ull, 0x98006de2216fa065ull, 0x99367ca33f52a1ceull, 0x9a6dd7bbdce13de1ull,
+	0x9ba68337d75f1ef5ull, 0x9ce0833006270013ull, 0x9e1bdbca75fc0107ull, 0x9f58913aa58e94e9ull,
+	0xa096a7c1c33c8c9cull, 0xa1d623aeec13f3edull, 0xa317095f6c20ae9full, 0xa4595d3f000cfb27ull,
+	0xa59d23c8181d3b17ull, 0xa6e261841c8f9d43ull, 0xa8291b0bb36883acull, 0xa971550707b4bf26ull,
+	0xaabb142e124afcc0ull, 0xac065d48e41604faull, 0xad53352ff1f1b34full, 0xaea1a0cc6224d500ull,
+	0xaff1a5185b82692eull, 0xb143471f563d099aull, 0xb2968bfe6e779358ull, 0xb3eb78e4b89e7954ull,
+	0xb542131397957fc1ull, 0xb69a5fdf14c5f7b4ull, 0xb7f464ae3a19ed0full, 0xb95026fb6df11718ull,
+	0xbaadac54d11cbd20ull, 0xbc0cfa5c9ef0251aull, 0xbd6e16c98f7389f0ull, 0xbed107673bc80295ull,
+	0xc035d21684cb31d9ull, 0xc19c7ccdfc0a09e4ull, 0xc3050d9a4f1264aeull, 0xc46f8a9eb533add2ull,
+	0xc5dbfa155fbf58d4ull, 0xc74a624fecda6274ull, 0xc8bac9b7dcf1a396ull, 0xca2d36cf0ae348dcull,
+	0xcba1b03026f053abull, 0xcd183c8f3489a015ull, 0xce90e2ba0b0c870aull, 0xd00ba998d983d5bcull,
+	0xd188982ead827a79ull, 0xd307b599fd2df44eull, 0xd4890915348f4665ull, 0xd60c99f74641e9afull,
+	0xd7926fb43f98f844ull, 0xd91a91dde053952full, 0xdaa5082435fa6260ull, 0xdc31da563b00acb5ull,
+	0xddc1106279c4d45aull, 0xdf52b257b38c5e21ull, 0xe0e6c8658b99095cull, 0xe27d5add36753d95ull,
+	0xe41672322d972487ull, 0xe5b216fae77acf4cull, 0xe75051f19454da91ull, 0xe8f12bf4df802481ull,
+	0xea94ae08b5ca5147ull, 0xec3ae15710c41047ull, 0xede3cf30c73b5557ull, 0xef8f810e630706d1ull,
+	0xf13e0090fc4cfb8dull, 0xf2ef57831a6c8bc2ull, 0xf4a38fd99ab96d52ull, 0xf65ab3b49d341899ull,
+	0xf814cd60776e8631ull, 0xf9d1e756adcdb9bbull, 0xfb920c3ef35a41b1ull, 0xfd5546f0305399beull,
+	0xff1ba2718fbc348cull,
+};
+
+/**
+ * Whether tan_boundary[i] < a/b. Compares the top 64 bits of the 96 bit
+ * product b * tan_boundary[i] to a * 2^64, the lower bits only matter on
+ * equality.
+ */
+static inline Bool belowBoundary(uint32_t a, uint32_t b, int i)
+{
+	uint64_t t = tan_boundary[i];
+	uint64_t product = (uint64_t)b * (t >> 32) +
+			   (((uint64_t)b * (t & 0xffffffff)) >> 32);
+
+	return product < ((uint64_t)a << 32);
+}
+
+/* Number of tan_boundary[] entries below i/256, where to start looking
+ * for the angle of a ratio between i/256 and (i+1)/256. Never more than
+ * two boundaries apart. */
+static const uint8_t tan_bucket[257] = {
+	0, 1, 2, 3, 4, 6, 7, 8, 9, 10, 11, 12, 13, 15, 16, 17,
+	18, 19, 20, 21, 22, 23, 25, 26, 27, 28, 29, 30, 31, 32, 33, 35,
+	36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 47, 48, 49, 50, 51, 52,
+	53, 54, 55, 56, 57, 58, 60, 61, 62, 63, 64, 65, 66, 67, 68, 69,
+	70, 71, 72, 73, 74, 75, 76, 78, 79, 80, 81, 82, 83, 84, 85, 86,
+	87, 88, 89, 90, 91, 92, 93, 94, 95, 96, 97, 98, 99, 100, 101, 102,
+	103, 104, 105, 106, 107, 108, 109, 110, 111, 112, 112, 113, 114, 115, 116, 117,
+	118, 119, 120, 121, 122, 123, 124, 125, 126, 126, 127, 128, 129, 130, 131, 132,
+	133, 134, 135, 135, 136, 137, 138, 139, 140, 141, 142, 143, 143, 144, 145, 146,
+	147, 148, 148, 149, 150, 151, 152, 153, 153, 154, 155, 156, 157, 158, 158, 159,
+	160, 161, 162, 162, 163, 164, 165, 166, 166, 167, 168, 169, 169, 170, 171, 172,
+	173, 173, 174, 175, 176, 176, 177, 178, 179, 179, 180, 181, 181, 182, 183, 184,
+	184, 185, 186, 186, 187, 188, 189, 189, 190, 191, 191, 192, 193, 193, 194, 195,
+	195, 196, 197, 197, 198, 199, 199, 200, 201, 201, 202, 203, 203, 204, 205, 205,
+	206, 207, 207, 208, 208, 209, 210, 210, 211, 212, 212, 213, 213, 214, 215, 215,
+	216, 216, 217, 218, 218, 219, 219, 220, 220, 221, 222, 222, 223, 223, 224, 224,
+	225,
+};
+
+/**
+ * The angle of (b, a) with 0 <= a <= b, rounded to the nearest rotation
+ * step (0...ROTATION_OCTANT): the number of rounding boundaries below a/b.
+ * No boundary is a rational number so there are no ties to break.
+ */
+static int octantSteps(uint32_t a, uint32_t b)
+{
+	int i = tan_bucket[((uint64_t)a << 8) / b];
+
+	while (i < ROTATION_OCTANT && belowBoundary(a, b, i))
+		i++;
+
+	return i;
+}
+
 /***
  * Convert a point (X/Y) in a left-handed coordinate system to a normalized
  * rotation angle.
@@ -330,9 +447,11 @@ int wcmFilterCoord(WacomCommonPtr common, WacomChannelPtr pChannel,
  * only (to convert tilt to rotation), but it may be used for other devices
  * in the future.
  *
- * Method used: rotation angle is calculated through the atan of x/y
- * then converted to degrees and normalized into the rotation
- * range (MIN_ROTATION/MAX_ROTATION).
+ * Method used: rotation angle is the atan of x/y, looked up in steps of
+ * the rotation range in the first octant and mirrored into the other
+ * ones, then normalized into the rotation range
+ * (MIN_ROTATION/MAX_ROTATION). The result is the same as rounding
+ * atan2() in floating point.
 
  * IMPORTANT: calculation inverts direction, the formula to get the target
  * rotation value in degrees is: 360 - offset - input-angle.
@@ -351,39 +470,43 @@ int wcmFilterCoord(WacomCommonPtr common, WacomChannelPtr pChannel,
  *
  * @return The mapped rotation angle based on the device's tilt state.
  */
-int wcmTilt2R(int x, int y, double offset)
+int wcmTilt2R(int x, int y, int offset)
 {
-	double angle = 0.0;
+	/* rotate in the inverse direction, changing CW to CCW rotation and
+	 * vice versa: the angle is atan2(-x, y) */
+	uint32_t ax = y < 0 ? -(uint32_t)y : (uint32_t)y;
+	uint32_t ay = x < 0 ? -(uint32_t)x : (uint32_t)x;
+	int steps = 0;
 	int rotation;
 
 	if (x || y)
-		/* rotate in the inverse direction, changing CW to CCW
-		 * rotation  and vice versa */
-		angle = ((180.0 * atan2(-x, y)) / M_PI);
+	{
+		/* 0...RANGE/4 in the first quadrant */
+		if (ay <= ax)
+			steps = octantSteps(ay, ax);
+		else
+			steps = 2 * ROTATION_OCTANT - octantSteps(ax, ay);
 
-	/* rotation is now in 0 - 360 deg value range, apply the offset. Use
-	 * 360 to avoid getting into negative range, the normalization code
-	 * below expects 0...360 */
-	angle = 360 + angle - offset;
+		if (y < 0)
+			steps = 4 * ROTATION_OCTANT - steps;
+		if (x > 0)
+			steps = -steps;
+	}
 
-	/* normalize into the rotation range (0...MAX), then offset by MIN_ROTATION
-	   we used 360 as base offset above, so %= MAX_ROTATION_RANGE brings us back.
-	   Note: we can't use xf86ScaleAxis here because of rounding issues.
-	 */
-	rotation = round(angle * (MAX_ROTATION_RANGE / 360.0));
+	/* apply the offset, the range wraps around at 360 degrees */
+	rotation = steps + (360 - offset) * MAX_ROTATION_RANGE / 360;
 	rotation %= MAX_ROTATION_RANGE;
+	if (rotation < 0)
+		rotation += MAX_ROTATION_RANGE;
 
 	/* now scale back from 0...MAX to MIN..(MIN+MAX) */
-	rotation = wcmScaleAxis(rotation,
-				 MIN_ROTATION + MAX_ROTATION_RANGE,
-				 MIN_ROTATION,
-				 MAX_ROTATION_RANGE, 0);
-
-	return rotation;
+	return rotation + MIN_ROTATION;
 }
 
 #ifdef ENABLE_TESTS
 
+#include <limits.h>
+#include <math.h>
 #include "wacom-test-suite.h"
 
 TEST_CASE(test_tilt_to_rotation)
@@ -495,6 +618,52 @@ TEST_CASE(test_tilt_to_rotation)
 		assert(rotation == rotation_table[i][2]);
 	}
 }
+
+TEST_CASE(test_tilt_table)
+{
+	for (int i = 0; i < ROTATION_OCTANT; i++)
+	{
+		double angle = (i + 0.5) * 2 * M_PI / MAX_ROTATION_RANGE;
+
+		double t = tan_boundary[i] / 18446744073709551616.0;
+
+		assert(fabs(t - tan(angle)) < 1e-15);
+	}
+}
+
+/* The floating point version wcmTilt2R() replaced */
+static int tilt2RDouble(int x, int y, double offset)
+{
+	double angle = 0.0;
+	int rotation;
+
+	if (x || y)
+		angle = ((180.0 * atan2(-x, y)) / M_PI);
+
+	angle = 360 + angle - offset;
+	rotation = round(angle * (MAX_ROTATION_RANGE / 360.0));
+	rotation %= MAX_ROTATION_RANGE;
+
+	return rotation + MIN_ROTATION;
+}
+
+TEST_CASE(test_tilt_to_rotation_exact)
+{
+	/* -INT_MIN overflows in the double version */
+	const int big[] = { INT_MIN + 1, -65536, -32767, 32767, 65536, INT_MAX };
+
+	for (int x = -300; x <= 300; x++)
+		for (int y = -300; y <= 300; y++)
+			assert(wcmTilt2R(x, y, INTUOS4_CURSOR_ROTATION_OFFSET) ==
+			       tilt2RDouble(x, y, INTUOS4_CURSOR_ROTATION_OFFSET));
+
+	for (size_t i = 0; i < ARRAY_SIZE(big); i++)
+		for (int v = -1000; v <= 1000; v += 7)
+		{
+			assert(wcmTilt2R(big[i], v, 0) == tilt2RDouble(big[i], v, 0));
+			assert(wcmTilt2R(v, big[i], 0) == tilt2RDouble(v, big[i], 0));
+		}
+}
 #endif
 
 /* vim: set noexpandtab tabstop=8 shiftwidth=8: */
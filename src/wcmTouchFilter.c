@@ -21,7 +21,10 @@
 
 #include "xf86Wacom.h"
 #include "wcmTouchFilter.h"
-#include <math.h>
+
+#ifdef ENABLE_TESTS
+#include "wacom-test-suite.h"
+#endif
 
 /* Defines for 2FC Gesture */
 #define WACOM_HORIZ_ALLOWED           1
@@ -35,37 +38,73 @@
 #define GESTURE_LAG_MODE              8
 #define GESTURE_PREDRAG_MODE         16
 #define GESTURE_DRAG_MODE            32
+
+static uint32_t frontendTimeInMillis(WacomDevicePtr priv)
+{
+	return wcmTimeInMillis();
+}
+
+static const WacomGestureOps frontendGestureOps = {
+	.emitMotion = wcmEmitMotion,
+	.emitButton = wcmEmitButton,
+	.emitKeycode = wcmEmitKeycode,
+	.timeInMillis = frontendTimeInMillis,
+};
+
+static inline const WacomGestureOps *gestureOps(WacomCommonPtr common)
+{
+	return common->wcmGestureOps ? common->wcmGestureOps : &frontendGestureOps;
+}
 #define GESTURE_CANCEL_MODE          64
 #define GESTURE_MULTITOUCH_MODE     128
 
-#define WCM_SCROLL_UP                 5	/* vertical up */
-#define WCM_SCROLL_DOWN               4	/* vertical down */
-#define WCM_SCROLL_LEFT               6	/* horizontal left */
-#define WCM_SCROLL_RIGHT              7	/* horizontal right */
-
 static void wcmSendButtonClick(WacomDevicePtr priv, int button, int state);
 static void wcmFingerScroll(WacomDevicePtr priv);
 static void wcmFingerZoom(WacomDevicePtr priv);
 
+static inline Bool isContact(const WacomChannel *channel, unsigned int num)
+{
+	return channel->valid.state.device_type == TOUCH_ID &&
+		channel->valid.state.serial_num == num + 1;
+}
+
 /**
  * Returns a pointer to the channel associated with the given contact
  * number. The first contact made in a gesture will be number zero,
  * the second number one, and so on.
  *
+ * The channel is looked up in common->wcmContactChannel. A channel may
+ * have been handed to another contact since it was recorded there, the
+ * touch channels are searched in that case.
+ *
  * @param[in] common
  * @param[in] num     Contact number to search for
  * @return            Pointer to the associated channel, or NULL if none found
  */
 static WacomChannelPtr getContactNumber(WacomCommonPtr common, unsigned int num)
 {
-	for (size_t i = 0; i < MAX_CHANNELS; i++)
+	uint64_t touching = common->wcmTouchChannels;
+
+	if (num < common->wcmChannelCount && common->wcmContactChannel[num])
 	{
-		WacomChannelPtr channel = common->wcmChannel+i;
-		WacomDeviceState state  = channel->valid.state;
-		if (state.device_type == TOUCH_ID && state.serial_num == num + 1)
+		WacomChannelPtr channel = &common->wcmChannel[common->wcmContactChannel[num] - 1];
+		if (isContact(channel, num))
 			return channel;
 	}
 
+	while (touching)
+	{
+		unsigned int i = __builtin_ctzll(touching);
+
+		touching &= touching - 1;
+		if (isContact(&common->wcmChannel[i], num))
+		{
+			if (num < common->wcmChannelCount)
+				common->wcmContactChannel[num] = i + 1;
+			return &common->wcmChannel[i];
+		}
+	}
+
 	DBG(10, common, "Channel for contact number %u not found.\n", num);
 	return NULL;
 }
@@ -94,29 +133,30 @@ static void getStateHistory(WacomCommonPtr common, WacomDeviceState states[], un
 }
 
 /**
- * Send a touch event for the provided contact ID. This makes use of
- * the multitouch API available in XI2.2.
+ * Fill in the touch record for the current state of the provided channel.
+ * The coordinates are left untransformed, wcmTouchFrameEnd() transforms
+ * the whole frame at once.
  *
  * @param[in] priv
  * @param[in] channel    Channel to send a touch event for
  * @param[in] no_update  If 'true', TouchUpdate events will not be created.
  * This should be used when entering multitouch mode to ensure TouchBegin
  * events are sent for already-in-prox contacts.
+ * @param[out] touch     The touch record
  */
 static void
-wcmSendTouchEvent(WacomDevicePtr priv, WacomChannelPtr channel, Bool no_update)
+wcmTouchRecordFill(WacomDevicePtr priv, const WacomChannel *channel, Bool no_update,
+		   WacomTouchRecord *touch)
 {
-	WacomDeviceState state = channel->valid.state;
-	WacomDeviceState oldstate = channel->valid.states[1];
-	int type = -1;
+	const WacomDeviceState *state = &channel->valid.state;
+	const WacomDeviceState *oldstate = &channel->valid.states[1];
+	int type;
 
-	wcmRotateAndScaleCoordinates (priv, &state.x, &state.y);
-
-	if (!state.proximity) {
+	if (!state->proximity) {
 		DBG(6, priv->common, "This is a touch end event\n");
 		type = XI_TouchEnd;
 	}
-	else if (!oldstate.proximity || no_update) {
+	else if (!oldstate->proximity || no_update) {
 		DBG(6, priv->common, "This is a touch begin event\n");
 		type = XI_TouchBegin;
 	}
@@ -125,64 +165,174 @@ wcmSendTouchEvent(WacomDevicePtr priv, WacomChannelPtr channel, Bool no_update)
 		type = XI_TouchUpdate;
 	}
 
-	wcmEmitTouch(priv, type, state.serial_num - 1, state.x, state.y);
+	touch->type = type;
+	touch->touchid = state->serial_num - 1;
+	touch->x = state->x;
+	touch->y = state->y;
+}
+
+/**
+ * Send the touch events queued by wcmFingerMultitouch() during the current
+ * frame as one touch frame. Called once the backend has dispatched all
+ * channels of a frame. A contact queued several times is sent once, with
+ * its state at the end of the frame.
+ *
+ * @param[in] common
+ */
+void wcmTouchFrameEnd(WacomCommonPtr common)
+{
+	WacomDevicePtr priv = common->wcmTouchFrameDevice;
+	WacomTouchRecord touches[WCM_MAX_CHANNELS];
+	int x[WCM_MAX_CHANNELS], y[WCM_MAX_CHANNELS];
+	WacomSamples samples = { .x = x, .y = y };
+	uint64_t pending = common->wcmTouchPending;
+	unsigned int ntouches = 0;
+
+	if (!pending)
+		return;
+
+	while (pending) {
+		unsigned int c = __builtin_ctzll(pending);
+		const WacomChannel *channel = &common->wcmChannel[c];
+
+		pending &= pending - 1;
+		/* channel was recycled after the touch was queued */
+		if (channel->valid.state.device_type != TOUCH_ID)
+			continue;
+
+		wcmTouchRecordFill(priv, channel,
+				   !!(common->wcmTouchBegin & (1ULL << c)),
+				   &touches[ntouches++]);
+	}
+
+	common->wcmTouchPending = 0;
+	common->wcmTouchBegin = 0;
+	common->wcmTouchFrameDevice = NULL;
+
+	if (!ntouches)
+		return;
+
+	for (unsigned int i = 0; i < ntouches; i++) {
+		x[i] = touches[i].x;
+		y[i] = touches[i].y;
+	}
+	wcmTransformSamples(priv, &samples, ntouches);
+	for (unsigned int i = 0; i < ntouches; i++) {
+		touches[i].x = x[i];
+		touches[i].y = y[i];
+	}
+
+	wcmEmitTouchFrame(priv, touches, ntouches);
 }
 
 /**
- * Send multitouch events. If entering multitouch mode (indicated by
- * GESTURE_LAG_MODE), then touch events are sent for all in-prox
- * contacts. Otherwise, only the specified contact has a touch event
- * generated.
+ * Queue multitouch events for the current frame. If entering multitouch
+ * mode (indicated by GESTURE_LAG_MODE), then touch events are queued for
+ * all in-prox contacts. Otherwise, only the specified contact has a touch
+ * event queued. The events are sent by wcmTouchFrameEnd().
  *
  * @param[in] priv
  * @param[in] contact_id  ID of the contact to send event for (at minimum)
  */
 static void
 wcmFingerMultitouch(WacomDevicePtr priv, unsigned int contact_id) {
-	Bool lag_mode = priv->common->wcmGestureMode == GESTURE_LAG_MODE;
+	WacomCommonPtr common = priv->common;
+	Bool lag_mode = common->wcmGestureMode == GESTURE_LAG_MODE;
 	Bool prox = FALSE;
+	uint64_t touching = common->wcmTouchChannels;
+
+	while (touching) {
+		unsigned int c = __builtin_ctzll(touching);
+		const WacomDeviceState *state = &common->wcmChannel[c].valid.state;
 
-	for (size_t i = 0; i < MAX_CHANNELS; i++) {
-		WacomChannelPtr channel = priv->common->wcmChannel+i;
-		WacomDeviceState state  = channel->valid.state;
-		if (state.device_type != TOUCH_ID)
+		touching &= touching - 1;
+		if (state->device_type != TOUCH_ID)
 			continue;
 
-		if (lag_mode || state.serial_num == contact_id + 1) {
-			wcmSendTouchEvent(priv, channel, lag_mode);
+		if (lag_mode || state->serial_num == contact_id + 1) {
+			common->wcmTouchPending |= 1ULL << c;
+			if (lag_mode)
+				common->wcmTouchBegin |= 1ULL << c;
 		}
 
-		prox |= state.proximity;
+		prox |= state->proximity;
 	}
+	common->wcmTouchFrameDevice = priv;
 
 	if (!prox)
-		priv->common->wcmGestureMode = GESTURE_NONE_MODE;
+		common->wcmGestureMode = GESTURE_NONE_MODE;
 	else if (lag_mode)
-		priv->common->wcmGestureMode = GESTURE_MULTITOUCH_MODE;
+		common->wcmGestureMode = GESTURE_MULTITOUCH_MODE;
 }
 
-static double touchDistance(WacomDeviceState ds0, WacomDeviceState ds1)
+/* Integer square root, rounded down */
+static uint32_t isqrt64(uint64_t n)
 {
-	int xDelta = ds0.x - ds1.x;
-	int yDelta = ds0.y - ds1.y;
-	double distance = sqrt((double)(xDelta*xDelta + yDelta*yDelta));
-	return distance;
+	uint64_t root = 0;
+	uint64_t bit = 1ULL << 62;
+
+	while (bit > n)
+		bit >>= 2;
+
+	while (bit) {
+		if (n >= root + bit) {
+			n -= root + bit;
+			root = (root >> 1) + bit;
+		} else
+			root >>= 1;
+		bit >>= 2;
+	}
+
+	return root;
 }
 
+/* Squared distance between two contacts */
+static inline int64_t touchDistance2(const WacomDeviceState *ds0,
+				     const WacomDeviceState *ds1)
+{
+	int64_t dx = ds0->x - ds1->x;
+	int64_t dy = ds0->y - ds1->y;
+
+	return dx * dx + dy * dy;
+}
+
+/**
+ * Check whether the distance between the fingers changed by more than
+ * max_spread since the gesture started, without taking the root of the
+ * current distance.
+ *
+ * @param dist2       Squared current distance
+ * @param start       Distance at gesture start, see wcmSetGestureStart()
+ * @param max_spread  Allowed change of the distance
+ */
+static Bool spreadExceeds(int64_t dist2, int start, int max_spread)
+{
+	int64_t hi = (int64_t)start + max_spread;
+	int64_t lo = (int64_t)start - max_spread;
+
+	return dist2 > hi * hi || (lo > 0 && dist2 < lo * lo);
+}
+
+/* Record the state of one finger at the start of a gesture */
+static void wcmSetGestureStart(WacomCommonPtr common, unsigned int finger,
+			       const WacomDeviceState *ds)
+{
+	common->wcmGestureState[finger] = *ds;
+	common->wcmGestureParameters.wcmGestureSpread =
+		isqrt64(touchDistance2(&common->wcmGestureState[0],
+				       &common->wcmGestureState[1]));
+}
+
+/* Both fingers moved by less than a right angle apart */
 static Bool vectorsSameDirection(WacomCommonPtr common, WacomDeviceState ds00,
 		WacomDeviceState ds01, WacomDeviceState ds10, WacomDeviceState ds11)
 {
-	float dx0 = ds01.x - ds00.x;
-	float dy0 = ds01.y - ds00.y;
-	float m0 = sqrt(dx0*dx0 + dy0*dy0);
-	float dx1 = ds11.x - ds10.x;
-	float dy1 = ds11.y - ds10.y;
-	float m1 = sqrt(dx1*dx1 + dy1*dy1);
+	int64_t dx0 = ds01.x - ds00.x;
+	int64_t dy0 = ds01.y - ds00.y;
+	int64_t dx1 = ds11.x - ds10.x;
+	int64_t dy1 = ds11.y - ds10.y;
 
-	float dot = (dx0/m0 * dx1/m1) + (dy0/m0 * dy1/m1);
-	float angle = acos(dot);
-
-	return angle < (3.141592f / 2);
+	return dx0 * dx1 + dy0 * dy1 > 0;
 }
 
 static Bool pointsInLine(WacomCommonPtr common, WacomDeviceState ds0,
@@ -232,7 +382,7 @@ static void wcmSendButtonClick(WacomDevicePtr priv, int button, int state)
 	WacomAxisData axes = {0};
 
 	/* send button event in state */
-	wcmEmitButton(priv, mode, button, state, &axes);
+	gestureOps(priv->common)->emitButton(priv, mode, button, state, &axes);
 
 	/* We have changed the button state (from down to up) for the device
 	 * so we need to update the record */
@@ -259,7 +409,7 @@ static void wcmFingerTapToClick(WacomDevicePtr priv)
 
 	/* process second finger tap if matched */
 	if ((ds[0].sample < ds[1].sample) &&
-	    ((wcmTimeInMillis() -
+	    ((gestureOps(common)->timeInMillis(priv) -
 	    dsLast[1].sample) <= common->wcmGestureParameters.wcmTapTime) &&
 	    !ds[1].proximity && dsLast[1].proximity)
 	{
@@ -474,7 +624,7 @@ void wcmGestureFilter(WacomDevicePtr priv, unsigned int touch_id)
 	 */
 	else if (dsLast[0].proximity && common->wcmGestureMode != GESTURE_DRAG_MODE)
 	{
-		CARD32 ms = wcmTimeInMillis();
+		CARD32 ms = gestureOps(common)->timeInMillis(priv);
 
 		if ((ms - ds[0].sample) < WACOM_GESTURE_LAG_TIME)
 		{
@@ -494,7 +644,7 @@ void wcmGestureFilter(WacomDevicePtr priv, unsigned int touch_id)
 	if  (ds[1].proximity && !dsLast[1].proximity)
 	{
 		/* keep the initial states for gesture mode */
-		common->wcmGestureState[1] = ds[1];
+		wcmSetGestureStart(common, 1, &ds[1]);
 
 		/* reset the initial count for a new getsure */
 		common->wcmGestureParameters.wcmGestureUsed  = 0;
@@ -503,7 +653,7 @@ void wcmGestureFilter(WacomDevicePtr priv, unsigned int touch_id)
 	if (ds[0].proximity && !dsLast[0].proximity)
 	{
 		/* keep the initial states for gesture mode */
-		common->wcmGestureState[0] = ds[0];
+		wcmSetGestureStart(common, 0, &ds[0]);
 
 		/* reset the initial count for a new getsure */
 		common->wcmGestureParameters.wcmGestureUsed  = 0;
@@ -578,47 +728,90 @@ ret:
 	}
 }
 
-static void wcmSendScrollEvent(WacomDevicePtr priv, int dist,
-			 int buttonUp, int buttonDn)
+/**
+ * Position of the fingers along the tablet axis that scrolls in the given
+ * screen direction, oriented like the screen axis. The two fingers are
+ * summed, i.e. this is twice their midpoint. If one finger left, twice
+ * the position of the other one is used.
+ */
+static int scrollPosition(WacomCommonPtr common, const WacomDeviceState *ds0,
+			  const WacomDeviceState *ds1, Bool prox0, Bool prox1,
+			  Bool vertical)
+{
+	Bool use_y = vertical;
+	int sign = 1;
+	int p0, p1;
+
+	switch (common->wcmRotate) {
+	case ROTATE_CW:
+		use_y = !vertical;
+		sign = vertical ? -1 : 1;
+		break;
+	case ROTATE_CCW:
+		use_y = !vertical;
+		sign = vertical ? 1 : -1;
+		break;
+	case ROTATE_HALF:
+		sign = -1;
+		break;
+	default:
+		break;
+	}
+
+	p0 = use_y ? ds0->y : ds0->x;
+	p1 = use_y ? ds1->y : ds1->x;
+
+	if (!prox1)
+		return sign * 2 * p0;
+	if (!prox0)
+		return sign * 2 * p1;
+	return sign * (p0 + p1);
+}
+
+/**
+ * Convert the distance scrolled since the gesture started into scroll
+ * valuator units, one PANSCROLL_INCREMENT per wcmScrollDistance, and
+ * return the part not sent yet. Fingers moving up or left give a positive
+ * value, i.e. the content follows the fingers.
+ *
+ * @param dist  Scrolled distance as difference of scrollPosition()
+ */
+static int scrollDelta(WacomGesturesParameters *params, int dist)
 {
-	int button = (dist > 0) ? buttonUp : buttonDn;
-	WacomCommonPtr common = priv->common;
-	unsigned int count = (unsigned int)((1.0 * abs(dist)/
-		common->wcmGestureParameters.wcmScrollDistance));
-	WacomDeviceState ds[2] = {};
+	int total, delta;
 
-	getStateHistory(common, ds, ARRAY_SIZE(ds), 0);
+	if (!params->wcmScrollDistance)
+		return 0;
 
-	/* user might have changed from up to down or vice versa */
-	if (count < common->wcmGestureParameters.wcmGestureUsed)
-	{
-		common->wcmGestureState[0] = ds[0];
-		common->wcmGestureState[1] = ds[1];
-		common->wcmGestureParameters.wcmGestureUsed  = 0;
+	total = (int64_t)dist * PANSCROLL_INCREMENT /
+		(2 * (int64_t)params->wcmScrollDistance);
+	delta = total - params->wcmScrollSent;
+	params->wcmScrollSent = total;
+
+	return delta;
+}
+
+static void wcmSendScrollEvent(WacomDevicePtr priv, int dist, Bool vertical)
+{
+	int delta = scrollDelta(&priv->common->wcmGestureParameters, dist);
+	WacomAxisData axes = {0};
+
+	if (!delta)
 		return;
-	}
 
-	count -= common->wcmGestureParameters.wcmGestureUsed;
-	common->wcmGestureParameters.wcmGestureUsed += count;
-	while (count--)
-	{
-		wcmSendButtonClick(priv, button, 1);
-		wcmSendButtonClick(priv, button, 0);
-		DBG(10, priv, "loop count = %u \n", count);
-	}
+	DBG(10, priv, "%s scroll by %d\n", vertical ? "vertical" : "horizontal", delta);
+	wcmAxisSet(&axes, vertical ? WACOM_AXIS_SCROLL_Y : WACOM_AXIS_SCROLL_X, delta);
+	gestureOps(priv->common)->emitMotion(priv, FALSE, &axes);
 }
 
 static void wcmFingerScroll(WacomDevicePtr priv)
 {
 	WacomCommonPtr common = priv->common;
+	WacomGesturesParameters *params = &common->wcmGestureParameters;
 	WacomDeviceState ds[2] = {};
 	WacomDeviceState *start = common->wcmGestureState;
-	int midPoint_new = 0;
-	int midPoint_old = 0;
-	int dist = 0;
-	WacomFilterState filterd;  /* borrow this struct */
-	int max_spread = common->wcmGestureParameters.wcmZoomDistance;
-	int spread;
+	Bool vertical;
+	int dist;
 
 	if (!common->wcmGesture)
 		return;
@@ -627,24 +820,22 @@ static void wcmFingerScroll(WacomDevicePtr priv)
 
 	DBG(10, priv, "\n");
 
-	spread = fabs(touchDistance(ds[0], ds[1]) - touchDistance(start[0], start[1]));
-
 	if (common->wcmGestureMode != GESTURE_SCROLL_MODE)
 	{
-		if (spread < max_spread)
+		/* two fingers stay close to each other all the time and
+		 * move in vertical or horizontal direction together
+		 */
+		if (!spreadExceeds(touchDistance2(&ds[0], &ds[1]),
+				   params->wcmGestureSpread, params->wcmZoomDistance)
+		    && pointsInLine(common, ds[0], start[0])
+		    && pointsInLine(common, ds[1], start[1])
+		    && params->wcmScrollDirection
+		    && vectorsSameDirection(common, ds[0], start[0], ds[1], start[1]))
 		{
-			/* two fingers stay close to each other all the time and
-			 * move in vertical or horizontal direction together
-			 */
-			if (pointsInLine(common, ds[0], start[0])
-			    && pointsInLine(common, ds[1], start[1])
-			    && common->wcmGestureParameters.wcmScrollDirection
-			    && vectorsSameDirection(common, ds[0], start[0], ds[1], start[1]))
-			{
-				/* left button might be down. Send it up first */
-				wcmSendButtonClick(priv, 1, 0);
-				common->wcmGestureMode = GESTURE_SCROLL_MODE;
-			}
+			/* left button might be down. Send it up first */
+			wcmSendButtonClick(priv, 1, 0);
+			common->wcmGestureMode = GESTURE_SCROLL_MODE;
+			params->wcmScrollSent = 0;
 		}
 	}
 
@@ -652,77 +843,27 @@ static void wcmFingerScroll(WacomDevicePtr priv)
 	if (common->wcmGestureMode != GESTURE_SCROLL_MODE)
 		return;
 
-	/* initialize the points so we can rotate them */
-	filterd.x[0] = ds[0].x;
-	filterd.y[0] = ds[0].y;
-	filterd.x[1] = ds[1].x;
-	filterd.y[1] = ds[1].y;
-	filterd.x[2] = common->wcmGestureState[0].x;
-	filterd.y[2] = common->wcmGestureState[0].y;
-	filterd.x[3] = common->wcmGestureState[1].x;
-	filterd.y[3] = common->wcmGestureState[1].y;
-
-	/* scrolling has directions so rotation has to be considered first */
-	for (unsigned int i = 0; i < 6; i++) {
-		wcmRotateAndScaleCoordinates(priv, &filterd.x[i], &filterd.y[i]);
-	}
-
-	/* check vertical direction */
-	if (common->wcmGestureParameters.wcmScrollDirection == WACOM_VERT_ALLOWED)
-	{
-		midPoint_old = (((double)filterd.y[2] + (double)filterd.y[3]) / 2.);
-		midPoint_new = (((double)filterd.y[0] + (double)filterd.y[1]) / 2.);
-
-		/* allow one finger scroll */
-		if (!ds[0].proximity)
-		{
-			midPoint_old = filterd.y[3];
-			midPoint_new = filterd.y[1];
-		}
-
-		if (!ds[1].proximity)
-		{
-			midPoint_old = filterd.y[2];
-			midPoint_new = filterd.y[0];
-		}
-
-		dist = midPoint_old - midPoint_new;
-		wcmSendScrollEvent(priv, dist, WCM_SCROLL_UP, WCM_SCROLL_DOWN);
-	}
-
-	if (common->wcmGestureParameters.wcmScrollDirection == WACOM_HORIZ_ALLOWED)
-	{
-		midPoint_old = (((double)filterd.x[2] + (double)filterd.x[3]) / 2.);
-		midPoint_new = (((double)filterd.x[0] + (double)filterd.x[1]) / 2.);
-
-		/* allow one finger scroll */
-		if (!ds[0].proximity)
-		{
-			midPoint_old = filterd.x[3];
-			midPoint_new = filterd.x[1];
-		}
-
-		if (!ds[1].proximity)
-		{
-			midPoint_old = filterd.x[2];
-			midPoint_new = filterd.x[0];
-		}
+	if (params->wcmScrollDirection != WACOM_VERT_ALLOWED &&
+	    params->wcmScrollDirection != WACOM_HORIZ_ALLOWED)
+		return;
 
-		dist = midPoint_old - midPoint_new;
-		wcmSendScrollEvent(priv, dist, WCM_SCROLL_RIGHT, WCM_SCROLL_LEFT);
-	}
+	vertical = params->wcmScrollDirection == WACOM_VERT_ALLOWED;
+	dist = scrollPosition(common, &start[0], &start[1],
+			      ds[0].proximity, ds[1].proximity, vertical) -
+	       scrollPosition(common, &ds[0], &ds[1],
+			      ds[0].proximity, ds[1].proximity, vertical);
+	wcmSendScrollEvent(priv, dist, vertical);
 }
 
 static void wcmFingerZoom(WacomDevicePtr priv)
 {
 	WacomCommonPtr common = priv->common;
+	WacomGesturesParameters *params = &common->wcmGestureParameters;
 	WacomDeviceState ds[2] = {};
-	WacomDeviceState *start = common->wcmGestureState;
 	unsigned int count, button;
-	int dist = touchDistance(common->wcmGestureState[0],
-			common->wcmGestureState[1]);
-	int max_spread = common->wcmGestureParameters.wcmZoomDistance;
-	int spread;
+	int max_spread = params->wcmZoomDistance;
+	int64_t dist2;
+	int dist;
 
 	if (!common->wcmGesture)
 		return;
@@ -731,12 +872,12 @@ static void wcmFingerZoom(WacomDevicePtr priv)
 
 	DBG(10, priv, "\n");
 
-	spread = fabs(touchDistance(ds[0], ds[1]) - touchDistance(start[0], start[1]));
+	dist2 = touchDistance2(&ds[0], &ds[1]);
 
 	if (common->wcmGestureMode != GESTURE_ZOOM_MODE)
 	{
 		/* two fingers moved apart from each other */
-		if (spread > max_spread)
+		if (spreadExceeds(dist2, params->wcmGestureSpread, max_spread))
 		{
 			/* left button might be down, send it up first */
 			wcmSendButtonClick(priv, 1, 0);
@@ -747,16 +888,16 @@ static void wcmFingerZoom(WacomDevicePtr priv)
 	if (common->wcmGestureMode != GESTURE_ZOOM_MODE)
 		return;
 
-	dist = touchDistance(ds[0], ds[1]) - dist;
-	count = (unsigned int)((1.0 * abs(dist)/common->wcmGestureParameters.wcmZoomDistance));
+	dist = (int)isqrt64(dist2) - params->wcmGestureSpread;
+	count = abs(dist) / params->wcmZoomDistance;
 
 	/* user might have changed from left to right or vice versa */
-	if (count < common->wcmGestureParameters.wcmGestureUsed)
+	if (count < params->wcmGestureUsed)
 	{
 		/* reset the initial states for the new getsure */
-		common->wcmGestureState[0] = ds[0];
-		common->wcmGestureState[1] = ds[1];
-		common->wcmGestureParameters.wcmGestureUsed  = 0;
+		wcmSetGestureStart(common, 0, &ds[0]);
+		wcmSetGestureStart(common, 1, &ds[1]);
+		params->wcmGestureUsed  = 0;
 		return;
 	}
 
@@ -769,14 +910,14 @@ static void wcmFingerZoom(WacomDevicePtr priv)
 	 */
 	button = (dist > 0) ? 4 : 5;
 
-	count -= common->wcmGestureParameters.wcmGestureUsed;
-	common->wcmGestureParameters.wcmGestureUsed += count;
+	count -= params->wcmGestureUsed;
+	params->wcmGestureUsed += count;
 	while (count--)
 	{
-		wcmEmitKeycode (priv, 37 /*XK_Control_L*/, 1);
+		gestureOps(common)->emitKeycode(priv, 37 /*XK_Control_L*/, 1);
 		wcmSendButtonClick (priv, button, 1);
 		wcmSendButtonClick (priv, button, 0);
-		wcmEmitKeycode (priv, 37 /*XK_Control_L*/, 0);
+		gestureOps(common)->emitKeycode(priv, 37 /*XK_Control_L*/, 0);
 	}
 }
 
@@ -785,4 +926,303 @@ Bool wcmTouchNeedSendEvents(WacomCommonPtr common)
 	return !(common->wcmGestureMode & ~GESTURE_DRAG_MODE);
 }
 
+#ifdef ENABLE_TESTS
+
+#include <math.h>
+
+TEST_CASE(test_contact_table)
+{
+	WacomCommonPtr common = wcmNewCommon();
+	WacomChannelPtr channel;
+
+	/* no contacts at all */
+	assert(getContactNumber(common, 0) == NULL);
+
+	channel = &common->wcmChannel[3];
+	channel->valid.state.device_type = TOUCH_ID;
+	channel->valid.state.serial_num = 1;
+	common->wcmTouchChannels |= 1ULL << 3;
+	common->wcmContactChannel[0] = 3 + 1;
+	assert(getContactNumber(common, 0) == channel);
+	assert(getContactNumber(common, 1) == NULL);
+
+	/* the table is stale, contact 0 moved to channel 5 */
+	memset(channel, 0, sizeof(*channel));
+	channel = &common->wcmChannel[5];
+	channel->valid.state.device_type = TOUCH_ID;
+	channel->valid.state.serial_num = 1;
+	common->wcmTouchChannels |= 1ULL << 5;
+	assert(getContactNumber(common, 0) == channel);
+	assert(common->wcmContactChannel[0] == 5 + 1);
+
+	/* the channel was recycled for a pen */
+	channel->valid.state.device_type = STYLUS_ID;
+	assert(getContactNumber(common, 0) == NULL);
+
+	assert(getContactNumber(common, MAX_CHANNELS + 2) == NULL);
+
+	wcmFreeCommon(&common);
+}
+
+TEST_CASE(test_touch_frame_queue)
+{
+	WacomDeviceRec priv = {0};
+	WacomCommonPtr common = wcmNewCommon();
+
+	priv.common = common;
+	for (int i = 0; i < 2; i++) {
+		WacomDeviceState *state = &common->wcmChannel[i].valid.state;
+
+		state->device_type = TOUCH_ID;
+		state->serial_num = i + 1;
+		state->proximity = 1;
+		common->wcmTouchChannels |= 1ULL << i;
+	}
+
+	/* entering multitouch queues a TouchBegin for every contact once */
+	common->wcmGestureMode = GESTURE_LAG_MODE;
+	wcmFingerMultitouch(&priv, 0);
+	assert(common->wcmGestureMode == GESTURE_MULTITOUCH_MODE);
+	wcmFingerMultitouch(&priv, 1);
+	assert(common->wcmTouchPending == 0x3);
+	assert(common->wcmTouchBegin == 0x3);
+	assert(common->wcmTouchFrameDevice == &priv);
+
+	/* a queued channel that no longer holds a touch is not sent */
+	common->wcmChannel[0].valid.state.device_type = STYLUS_ID;
+	common->wcmChannel[1].valid.state.device_type = STYLUS_ID;
+	wcmTouchFrameEnd(common);
+	assert(common->wcmTouchPending == 0);
+	assert(common->wcmTouchBegin == 0);
+	assert(common->wcmTouchFrameDevice == NULL);
+	assert(common->wcmStats[WSTAT_EMIT_TOUCH_FRAME] == 0);
+
+	/* afterwards only the contact that changed is queued */
+	common->wcmChannel[0].valid.state.device_type = TOUCH_ID;
+	common->wcmChannel[1].valid.state.device_type = TOUCH_ID;
+	wcmFingerMultitouch(&priv, 1);
+	assert(common->wcmTouchPending == 0x2);
+	assert(common->wcmTouchBegin == 0);
+	common->wcmTouchPending = 0;
+
+	wcmFreeCommon(&common);
+}
+
+TEST_CASE(test_isqrt)
+{
+	assert(isqrt64(0) == 0);
+	assert(isqrt64(1) == 1);
+	assert(isqrt64(3) == 1);
+	assert(isqrt64(4) == 2);
+	assert(isqrt64(99) == 9);
+	assert(isqrt64(100) == 10);
+	assert(isqrt64(0xfffffffe00000001ULL) == 0xffffffff);
+	assert(isqrt64(UINT64_MAX) == 0xffffffff);
+
+	for (uint64_t n = 1; n < 1ULL << 40; n = n * 3 + 7) {
+		uint64_t r = isqrt64(n);
+		assert(r * r <= n && (r + 1) * (r + 1) > n);
+	}
+}
+
+TEST_CASE(test_spread)
+{
+	/* |sqrt(dist2) - start| > max_spread */
+	for (int start = 0; start < 300; start += 7) {
+		for (int64_t dist2 = 0; dist2 < 400 * 400; dist2 += 97) {
+			double d = sqrt((double)dist2);
+			Bool expected = fabs(d - start) > 50;
+
+			/* ignore exact ties, the double is not exact there */
+			if (fabs(fabs(d - start) - 50) < 1e-6)
+				continue;
+			assert(spreadExceeds(dist2, start, 50) == expected);
+		}
+	}
+}
+
+TEST_CASE(test_scroll_position)
+{
+	WacomCommonRec common = {0};
+	WacomDeviceState a = { .x = 100, .y = 1000 };
+	WacomDeviceState b = { .x = 300, .y = 3000 };
+
+	common.wcmRotate = ROTATE_NONE;
+	assert(scrollPosition(&common, &a, &b, TRUE, TRUE, TRUE) == 4000);
+	assert(scrollPosition(&common, &a, &b, TRUE, TRUE, FALSE) == 400);
+	assert(scrollPosition(&common, &a, &b, TRUE, FALSE, TRUE) == 2000);
+	assert(scrollPosition(&common, &a, &b, FALSE, TRUE, TRUE) == 6000);
+
+	common.wcmRotate = ROTATE_HALF;
+	assert(scrollPosition(&common, &a, &b, TRUE, TRUE, TRUE) == -4000);
+	assert(scrollPosition(&common, &a, &b, TRUE, TRUE, FALSE) == -400);
+
+	/* the screen y axis is the tablet x axis, see
+	 * wcmRotateAndScaleCoordinates() */
+	common.wcmRotate = ROTATE_CW;
+	assert(scrollPosition(&common, &a, &b, TRUE, TRUE, TRUE) == -400);
+	assert(scrollPosition(&common, &a, &b, TRUE, TRUE, FALSE) == 4000);
+
+	common.wcmRotate = ROTATE_CCW;
+	assert(scrollPosition(&common, &a, &b, TRUE, TRUE, TRUE) == 400);
+	assert(scrollPosition(&common, &a, &b, TRUE, TRUE, FALSE) == -4000);
+}
+
+/* What the gesture code sent, recorded instead of calling the frontend */
+typedef struct {
+	WacomGestureOps ops;	/* must be first, see gestureEvents() */
+	int scroll[2];		/* summed horizontal and vertical scroll */
+	int nscroll;		/* scroll events */
+	int zoom[2];		/* ctrl + button 4 and ctrl + button 5 clicks */
+	int releases;		/* button 1 releases */
+	int other;		/* anything else */
+	Bool ctrl;		/* ctrl is down */
+	uint32_t now;		/* the time the gesture code sees */
+} GestureEvents;
+
+static GestureEvents *gestureEvents(WacomDevicePtr priv)
+{
+	return (GestureEvents *)priv->common->wcmGestureOps;
+}
+
+static void recordMotion(WacomDevicePtr priv, bool is_absolute,
+			 const WacomAxisData *axes)
+{
+	GestureEvents *events = gestureEvents(priv);
+	int value;
+
+	if (wcmAxisGet(axes, WACOM_AXIS_SCROLL_X, &value))
+		events->scroll[0] += value;
+	if (wcmAxisGet(axes, WACOM_AXIS_SCROLL_Y, &value))
+		events->scroll[1] += value;
+	events->nscroll++;
+}
+
+static void recordButton(WacomDevicePtr priv, bool is_absolute, int button,
+			 bool is_press, const WacomAxisData *axes)
+{
+	GestureEvents *events = gestureEvents(priv);
+
+	if (button == 1 && !is_press)
+		events->releases++;
+	else if (events->ctrl && (button == 4 || button == 5)) {
+		if (is_press)
+			events->zoom[button - 4]++;
+	} else
+		events->other++;
+}
+
+static void recordKeycode(WacomDevicePtr priv, int keycode, int state)
+{
+	GestureEvents *events = gestureEvents(priv);
+
+	if (keycode == 37 /*XK_Control_L*/)
+		events->ctrl = state;
+	else
+		events->other++;
+}
+
+static uint32_t recordedTime(WacomDevicePtr priv)
+{
+	return gestureEvents(priv)->now;
+}
+
+static const WacomGestureOps recordGestureOps = {
+	.emitMotion = recordMotion,
+	.emitButton = recordButton,
+	.emitKeycode = recordKeycode,
+	.timeInMillis = recordedTime,
+};
+
+/* Push one finger's state into its channel the way commonEvent() does and
+ * run the gesture filter on it */
+static void replayTouch(WacomDevicePtr priv, unsigned int finger,
+			int x, int y, Bool proximity)
+{
+	WacomCommonPtr common = priv->common;
+	WacomChannelPtr channel = &common->wcmChannel[finger];
+	WacomDeviceState ds = {
+		.device_type = TOUCH_ID,
+		.serial_num = finger + 1,
+		.x = x,
+		.y = y,
+		.proximity = proximity,
+	};
+
+	memmove(channel->valid.states + 1, channel->valid.states,
+		sizeof(WacomDeviceState) * (MAX_SAMPLES - 1));
+	channel->valid.state = ds;
+	common->wcmTouchChannels |= 1ULL << finger;
+	common->wcmContactChannel[finger] = finger + 1;
+
+	wcmGestureFilter(priv, finger);
+}
+
+/* Replay a recorded two-finger pan and pinch through wcmGestureFilter()
+ * and check what it sends */
+TEST_CASE(test_gesture_replay)
+{
+	WacomDeviceRec priv = {0};
+	WacomCommonPtr common = wcmNewCommon();
+	WacomGesturesParameters *params = &common->wcmGestureParameters;
+	GestureEvents events = { .ops = recordGestureOps };
+	int frame;
+
+	priv.common = common;
+	priv.flags = TOUCH_ID | ABSOLUTE_FLAG;
+	common->wcmGesture = TRUE;
+	params->wcmScrollDistance = 90;
+	params->wcmZoomDistance = 150;
+	events.now = 100000;
+	common->wcmGestureOps = &events.ops;
+
+	/* pan: both fingers move up by 7 units per frame with a little jitter */
+	for (frame = 0; frame <= 100; frame++) {
+		replayTouch(&priv, 0, 1000 + frame % 2, 2000 - 7 * frame, TRUE);
+		replayTouch(&priv, 1, 1400, 2010 - 7 * frame - (frame % 3 == 2), TRUE);
+		if (frame == 0)
+			assert(params->wcmGestureSpread == 400);
+	}
+	assert(common->wcmGestureMode == GESTURE_SCROLL_MODE);
+	assert(params->wcmScrollDirection == WACOM_VERT_ALLOWED);
+
+	/* 700 units up, one step per 90 units, no rounding drift */
+	assert(events.scroll[0] == 0);
+	assert(events.scroll[1] == (int)(2LL * 700 * PANSCROLL_INCREMENT / (2 * 90)));
+	assert(events.nscroll > 0 && events.nscroll <= 2 * 100);
+	assert(events.releases == 1);
+	assert(events.zoom[0] == 0 && events.zoom[1] == 0);
+	assert(events.other == 0);
+
+	replayTouch(&priv, 0, 1000, 1300, FALSE);
+	replayTouch(&priv, 1, 1400, 1310, FALSE);
+	assert(common->wcmGestureMode == GESTURE_NONE_MODE);
+	assert(params->wcmScrollDirection == 0);
+
+	/* pinch: the second finger moves away along x */
+	events = (GestureEvents){ .ops = recordGestureOps, .now = events.now };
+	for (frame = 0; frame <= 100; frame++) {
+		replayTouch(&priv, 0, 1000, 2000, TRUE);
+		replayTouch(&priv, 1, 1400 + 4 * frame, 2010 + frame, TRUE);
+
+		/* 400 -> 550 apart after 37 frames, 700 after 74 */
+		if (frame == 36)
+			assert(common->wcmGestureMode != GESTURE_ZOOM_MODE);
+		if (frame == 37)
+			assert(common->wcmGestureMode == GESTURE_ZOOM_MODE);
+		if (frame == 73)
+			assert(events.zoom[0] == 1);
+	}
+	assert(events.zoom[0] == 2);
+	assert(events.zoom[1] == 0);
+	assert(!events.ctrl);
+	assert(events.releases == 1);
+	assert(events.nscroll == 0);
+	assert(events.other == 0);
+
+	wcmFreeCommon(&common);
+}
+
+#endif
+
 /* vim: set noexpandtab tabstop=8 shiftwidth=8: */
@@ -24,8 +24,19 @@
 
 /****************************************************************************/
 
+/* What the gesture code sends its events through and takes the time from.
+ * It uses the frontend unless common->wcmGestureOps is set. */
+struct _WacomGestureOps {
+	void (*emitMotion)(WacomDevicePtr priv, bool is_absolute, const WacomAxisData *axes);
+	void (*emitButton)(WacomDevicePtr priv, bool is_absolute, int button, bool is_press,
+			   const WacomAxisData *axes);
+	void (*emitKeycode)(WacomDevicePtr priv, int keycode, int state);
+	uint32_t (*timeInMillis)(WacomDevicePtr priv);
+};
+
 void wcmGestureFilter(WacomDevicePtr priv, unsigned int touch_id);
 Bool wcmTouchNeedSendEvents(WacomCommonPtr common);
+void wcmTouchFrameEnd(WacomCommonPtr common);
 
 /****************************************************************************/
 #endif /* __XF86_WCMTOUCHFILTER_H */
@@ -20,32 +20,78 @@
 #include <config.h>
 
 #include "xf86Wacom.h"
+#include "wcmTouchFilter.h"
 
 #if ENABLE_TESTS
 #include "wacom-test-suite.h"
+#include <sys/sysmacros.h>
 #endif
 
 #include <math.h>
 #include <asm/types.h>
 #include <linux/input.h>
 #include <sys/utsname.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #define MAX_USB_EVENTS 128
 
+/* Raw events kept for usbDumpRecorder, must be a power of two */
+#define RECORDER_EVENTS 1024
+/* Minimum time between two dumps, in ms */
+#define RECORDER_DUMP_INTERVAL 10000
+
+/* The raw input flight recorder. The ring is filled on the input thread,
+ * usbDumpRecorder() copies it into the snapshot and the timer formats and
+ * writes the snapshot out on the main thread. */
+typedef struct {
+	struct input_event ring[RECORDER_EVENTS]; /* the last frames */
+	unsigned int head;		/* events recorded so far */
+	uint32_t lastDump;		/* time of the last dump */
+	Bool pending;			/* snapshot not written yet */
+	const char *reason;		/* static string */
+	unsigned int nsnapshot;
+	struct input_event snapshot[RECORDER_EVENTS + MAX_USB_EVENTS];
+	WacomTimerPtr timer;
+	WacomCommonPtr common;
+	char *dir;			/* the FlightRecorder option */
+} wcmRecorder;
+
+/* Capabilities of an event node. These never change while the node exists,
+ * so they are queried once and shared by all tools hotplugged off it.
+ */
+typedef struct {
+	struct input_id id;
+	unsigned long ev[NBITS(EV_MAX)];
+	unsigned long keys[NBITS(KEY_MAX)];
+	unsigned long props[NBITS(INPUT_PROP_MAX)];
+	unsigned long abs[NBITS(ABS_MAX)];
+	unsigned long sw[NBITS(SW_MAX)];
+	unsigned long absvalid[NBITS(ABS_MAX)]; /* absinfo[] entries filled in */
+	struct input_absinfo absinfo[ABS_CNT];
+	const struct WacomModelDesc *model;
+} wcmUSBCaps;
+
 typedef struct {
 	unsigned int wcmLastToolSerial;
 	int wcmDeviceType;
 	Bool wcmPenTouch;
 	Bool wcmUseMT;
 	int wcmMTChannel;
+	int wcmMTSlotPending;        /* slot + 1 last selected in a dropped frame, 0 if none */
 	unsigned int wcmEventCnt;
 	struct input_event wcmEvents[MAX_USB_EVENTS];
 	uint32_t wcmEventFlags;      /* event types received in this frame */
+	Bool wcmFrameDropped;        /* the frame was dropped and counted already */
 	int nbuttons;                /* total number of buttons */
 	int npadkeys;                /* number of pad keys in the above array */
 	int padkey_code[WCM_MAX_BUTTONS];/* hardware codes for buttons */
 	int lastChannel;
 	Bool grabDevice;
+	wcmRecorder *recorder;       /* NULL until the options are parsed */
+	Bool haveCaps;               /* caps has been probed */
+	struct _wcmUSBCapsCache *capsCache; /* our reference on the shared copy */
+	wcmUSBCaps caps;
 } wcmUSBData;
 
 static Bool usbDetect(WacomDevicePtr priv);
@@ -65,7 +111,12 @@ static void usbParseSynEvent(WacomDevicePtr priv,
 static void usbParseMscEvent(WacomDevicePtr priv,
 			     const struct input_event *event);
 static void usbDispatchEvents(WacomDevicePtr priv);
+static enum WacomStatistic usbClassifyFrame(WacomDevicePtr priv);
+static void usbDropFrame(wcmUSBData *private);
 static int usbChooseChannel(WacomCommonPtr common, int device_type, unsigned int serial);
+static int usbDumpRecorder(WacomDevicePtr priv, const char *reason);
+static void usbFree(WacomCommonPtr common);
+static void usbCapsCacheUnref(struct _wcmUSBCapsCache *cache);
 
 static WacomHWClass gWacomUSBDevice =
 {
@@ -73,6 +124,8 @@ static WacomHWClass gWacomUSBDevice =
 	.ProbeKeys = usbProbeKeys,
 	.ParseOptions = usbParseOptions,
 	.Init = usbWcmInit,
+	.DumpRecorder = usbDumpRecorder,
+	.Free = usbFree,
 };
 WacomHWClass *WacomGetClassUSB(void) { return &gWacomUSBDevice; }
 
@@ -138,7 +191,7 @@ static Bool usbParseOptions(WacomDevicePtr priv)
 	wcmUSBData *usbdata;
 
 	if (!common->private &&
-	    !(common->private = calloc(1, sizeof(wcmUSBData))))
+	    !(common->private = wcmArenaAlloc(common, sizeof(wcmUSBData))))
 	{
 		wcmLog(priv, W_ERROR, "unable to alloc event queue.\n");
 		return FALSE;
@@ -147,9 +200,126 @@ static Bool usbParseOptions(WacomDevicePtr priv)
 	usbdata = common->private;
 	usbdata->grabDevice = wcmOptCheckBool(priv, "GrabDevice", FALSE);
 
+	/* only kept if there is somewhere to write it to */
+	if (!usbdata->recorder)
+	{
+		char *dir = wcmOptCheckStr(priv, "FlightRecorder", NULL);
+
+		if (dir && (usbdata->recorder = calloc(1, sizeof(*usbdata->recorder))))
+		{
+			usbdata->recorder->timer = wcmTimerNew();
+			usbdata->recorder->common = common;
+			usbdata->recorder->dir = dir;
+		}
+		else
+			free(dir);
+	}
+
 	return TRUE;
 }
 
+static void usbFree(WacomCommonPtr common)
+{
+	wcmUSBData *usbdata = common->private;
+
+	if (!usbdata)
+		return;
+
+	if (usbdata->capsCache)
+	{
+		usbCapsCacheUnref(usbdata->capsCache);
+		usbdata->capsCache = NULL;
+	}
+
+	if (usbdata->recorder)
+	{
+		wcmTimerFree(usbdata->recorder->timer);
+		free(usbdata->recorder->dir);
+		free(usbdata->recorder);
+		usbdata->recorder = NULL;
+	}
+}
+
+#ifdef EVIOCSMASK
+/**
+ * Fill in the mask of event codes of the given type the kernel should send
+ * us. A code is cleared when usbFilterEvent() would discard it for every
+ * tool that can send it on this interface, anything that depends on the
+ * tool type of the frame is left to usbFilterEvent().
+ *
+ * BTN_TOOL_DOUBLETAP/TRIPLETAP on generic non-MT devices are not masked
+ * since usbInitToolType() still looks at them before they are filtered.
+ *
+ * @param private The USB data of the tablet
+ * @param type EV_KEY or EV_ABS
+ * @param mask The mask to fill in, one bit per code
+ * @param nlongs Number of longs in mask
+ */
+static void usbEventMask(const wcmUSBData *private, int type,
+			 unsigned long *mask, size_t nlongs)
+{
+	static const int mt_keys[] = {
+		BTN_TOUCH, BTN_TOOL_FINGER, BTN_TOOL_DOUBLETAP, BTN_TOOL_TRIPLETAP,
+	};
+	static const int st_abs[] = {
+		ABS_X, ABS_Y, ABS_PRESSURE,
+	};
+
+	memset(mask, 0xff, nlongs * sizeof(*mask));
+
+	if (!private->wcmUseMT)
+		return;
+
+	if (type == EV_KEY)
+	{
+		for (size_t i = 0; i < ARRAY_SIZE(mt_keys); i++)
+			CLEARBIT(mask, mt_keys[i]);
+	}
+	else if (type == EV_ABS && !private->wcmPenTouch)
+	{
+		/* single-touch duplicates of the MT data, unless a pen
+		 * shares the interface and needs them */
+		for (size_t i = 0; i < ARRAY_SIZE(st_abs); i++)
+			CLEARBIT(mask, st_abs[i]);
+	}
+}
+#endif
+
+/**
+ * Ask the kernel not to queue the events usbFilterEvent() drops anyway.
+ * EVIOCSMASK is available since Linux 4.4, on older kernels the events are
+ * read and filtered in userspace like before. The mask is per file
+ * descriptor, so this is done every time the device is started.
+ */
+static void usbSetEventMask(WacomDevicePtr priv)
+{
+#ifdef EVIOCSMASK
+	wcmUSBData *usbdata = priv->common->private;
+	static const int types[] = { EV_KEY, EV_ABS };
+	unsigned long keys[NBITS(KEY_CNT)];
+	unsigned long abs[NBITS(ABS_CNT)];
+	int err = 0;
+
+	usbEventMask(usbdata, EV_KEY, keys, ARRAY_SIZE(keys));
+	usbEventMask(usbdata, EV_ABS, abs, ARRAY_SIZE(abs));
+
+	for (size_t i = 0; i < ARRAY_SIZE(types) && err == 0; i++)
+	{
+		struct input_mask mask = {
+			.type = types[i],
+			.codes_size = types[i] == EV_KEY ? sizeof(keys) : sizeof(abs),
+			.codes_ptr = (uintptr_t)(types[i] == EV_KEY ? keys : abs),
+		};
+
+		SYSCALL(err = ioctl(wcmGetFd(priv), EVIOCSMASK, &mask));
+	}
+
+	if (err < 0)
+		DBG(1, priv, "EVIOCSMASK failed (%s), filtering in userspace\n",
+		    strerror(errno));
+#endif
+}
+
 /*****************************************************************************
  * usbStart --
  ****************************************************************************/
@@ -172,6 +342,9 @@ usbStart(WacomDevicePtr priv)
 				    "Wacom X driver can't grab event device (%s)\n",
 				    strerror(errno));
 	}
+
+	usbSetEventMask(priv);
+
 	return Success;
 }
 
@@ -409,8 +582,338 @@ size_t wcmListModels(const char **names, size_t len)
 	return ARRAY_SIZE(WacomModelDesc);
 }
 
+/* Keyed by st_rdev. Minor numbers get reused after an unplug, the inode
+ * and ctime tell the new node apart from the one that was cached.
+ * Every common that probed or looked up a node holds a reference on its
+ * entry, the entry goes away with the last device on that node.
+ */
+typedef struct _wcmUSBCapsCache {
+	struct _wcmUSBCapsCache *next;
+	unsigned int refcnt;
+	dev_t rdev;
+	ino_t ino;
+	struct timespec ctime;
+	wcmUSBCaps caps;
+} wcmUSBCapsCache;
+
+static wcmUSBCapsCache *capsCache;
+
+static wcmUSBCapsCache *usbCapsCacheFind(const struct stat *st)
+{
+	for (wcmUSBCapsCache *c = capsCache; c; c = c->next)
+		if (c->rdev == st->st_rdev)
+			return c;
+	return NULL;
+}
+
+/**
+ * Copy the cached capabilities of the node into caps.
+ *
+ * @return the entry with a reference taken or NULL if the node isn't cached
+ */
+static wcmUSBCapsCache *usbCapsCacheLookup(const struct stat *st, wcmUSBCaps *caps)
+{
+	wcmUSBCapsCache *c = usbCapsCacheFind(st);
+
+	if (!c || c->ino != st->st_ino ||
+	    c->ctime.tv_sec != st->st_ctim.tv_sec ||
+	    c->ctime.tv_nsec != st->st_ctim.tv_nsec)
+		return NULL;
+
+	*caps = c->caps;
+	c->refcnt++;
+	return c;
+}
+
+/**
+ * Cache the capabilities of the node, replacing those of a node that had
+ * the same st_rdev before.
+ *
+ * @return the entry with a reference taken or NULL on allocation failure
+ */
+static wcmUSBCapsCache *usbCapsCacheStore(const struct stat *st, const wcmUSBCaps *caps)
+{
+	wcmUSBCapsCache *c = usbCapsCacheFind(st);
+
+	if (!c)
+	{
+		if (!(c = calloc(1, sizeof(*c))))
+			return NULL;
+		c->rdev = st->st_rdev;
+		c->next = capsCache;
+		capsCache = c;
+	}
+
+	c->ino = st->st_ino;
+	c->ctime = st->st_ctim;
+	c->caps = *caps;
+	c->refcnt++;
+	return c;
+}
+
+static void usbCapsCacheUnref(wcmUSBCapsCache *cache)
+{
+	wcmUSBCapsCache **c;
+
+	if (--cache->refcnt)
+		return;
+
+	for (c = &capsCache; *c; c = &(*c)->next)
+	{
+		if (*c == cache)
+		{
+			*c = cache->next;
+			break;
+		}
+	}
+	free(cache);
+}
+
+/* On-disk copy of the capabilities, see the CapabilityCache option.
+ * The file name carries the device id and the kernel release. The key bits
+ * are compared on load, so a firmware or driver change that doesn't bump
+ * the version still gets a fresh probe. So are the X and Y ranges, udev
+ * hwdb EVDEV_ABS_* entries change those through EVIOCSABS without touching
+ * anything else.
+ */
+#define CAPS_FILE_MAGIC 0x57434d43 /* WCMC */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t size;		/* sizeof(wcmUSBCaps), changes with the layout */
+	wcmUSBCaps caps;	/* model is not stored */
+} wcmUSBCapsFile;
+
+static const struct WacomModelDesc *usbFindModel(const struct input_id *id)
+{
+	const struct WacomModelDesc *model = NULL;
+
+	for (size_t i = 0; i < ARRAY_SIZE(WacomModelDesc); i++)
+	{
+		if (id->vendor == WacomModelDesc[i].vendor_id &&
+		    id->product == WacomModelDesc[i].model_id)
+			model = &WacomModelDesc[i];
+	}
+
+	return model;
+}
+
+static Bool usbCapsFilePath(const char *dir, const struct input_id *id,
+			    char *path, size_t len)
+{
+	struct utsname name;
+	int n;
+
+	if (uname(&name) < 0)
+		return FALSE;
+
+	n = snprintf(path, len, "%s/%04x-%04x-%04x-%04x-%s.caps", dir,
+		     (unsigned int)id->bustype, (unsigned int)id->vendor,
+		     (unsigned int)id->product, (unsigned int)id->version,
+		     name.release);
+	return n > 0 && (size_t)n < len;
+}
+
+/* Compare the range of an axis, the current value is irrelevant */
+static Bool usbCapsAbsEqual(const wcmUSBCaps *a, const wcmUSBCaps *b, int code)
+{
+	const struct input_absinfo *x = &a->absinfo[code];
+	const struct input_absinfo *y = &b->absinfo[code];
+
+	if (ISBITSET(a->absvalid, code) != ISBITSET(b->absvalid, code))
+		return FALSE;
+
+	return !ISBITSET(a->absvalid, code) ||
+		(x->minimum == y->minimum && x->maximum == y->maximum &&
+		 x->fuzz == y->fuzz && x->flat == y->flat &&
+		 x->resolution == y->resolution);
+}
+
+/**
+ * Load the capabilities stored at path. caps->id, caps->keys and the
+ * absinfo of ABS_X and ABS_Y must have been queried from the device, the
+ * rest is filled in if the file matches them.
+ */
+static Bool usbCapsFileLoad(const char *path, wcmUSBCaps *caps)
+{
+	wcmUSBCapsFile file;
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return FALSE;
+	len = read(fd, &file, sizeof(file));
+	close(fd);
+
+	if (len != sizeof(file) || file.magic != CAPS_FILE_MAGIC ||
+	    file.size != sizeof(wcmUSBCaps) ||
+	    memcmp(&file.caps.id, &caps->id, sizeof(caps->id)) != 0 ||
+	    memcmp(file.caps.keys, caps->keys, sizeof(caps->keys)) != 0 ||
+	    !usbCapsAbsEqual(&file.caps, caps, ABS_X) ||
+	    !usbCapsAbsEqual(&file.caps, caps, ABS_Y))
+		return FALSE;
+
+	*caps = file.caps;
+	caps->model = usbFindModel(&caps->id);
+	return TRUE;
+}
+
+static void usbCapsFileStore(const char *path, const wcmUSBCaps *caps)
+{
+	wcmUSBCapsFile file = {
+		.magic = CAPS_FILE_MAGIC,
+		.size = sizeof(wcmUSBCaps),
+		.caps = *caps,
+	};
+	char tmp[PATH_MAX];
+	int fd, n;
+	Bool ok;
+
+	file.caps.model = NULL;
+
+	/* written aside and renamed, a concurrent load never sees half a file */
+	n = snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	if (n < 0 || (size_t)n >= sizeof(tmp))
+		return;
+
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	ok = write(fd, &file, sizeof(file)) == sizeof(file);
+	close(fd);
+
+	if (!ok || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+static Bool usbQueryCaps(WacomDevicePtr priv, wcmUSBCaps *caps,
+			 const char *cachedir)
+{
+	int fd = wcmGetFd(priv);
+	char path[PATH_MAX];
+	Bool have_path;
+
+	memset(caps, 0, sizeof(*caps));
+
+	if (ioctl(fd, EVIOCGID, &caps->id) < 0)
+	{
+		wcmLog(priv, W_ERROR, "unable to ioctl Device ID.\n");
+		return FALSE;
+	}
+
+	if (ioctl(fd, EVIOCGBIT(0 /*EV*/, sizeof(caps->ev)), caps->ev) < 0)
+	{
+		wcmLog(priv, W_ERROR, "unable to ioctl event bits.\n");
+		return FALSE;
+	}
+
+	if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(caps->keys)), caps->keys) < 0)
+	{
+		wcmLog(priv, W_ERROR, "unable to ioctl USB key bits.\n");
+		return FALSE;
+	}
+
+	/* X and Y are always asked for, pad-only interfaces fail those */
+	for (int code = ABS_X; code <= ABS_Y; code++)
+	{
+		if (ioctl(fd, EVIOCGABS(code), &caps->absinfo[code]) == 0)
+			caps->absvalid[LONG(code)] |= BIT(code);
+	}
+
+	have_path = cachedir &&
+		usbCapsFilePath(cachedir, &caps->id, path, sizeof(path));
+	if (have_path && usbCapsFileLoad(path, caps))
+	{
+		DBG(3, priv, "using capabilities from %s\n", path);
+		return TRUE;
+	}
+
+	if (ioctl(fd, EVIOCGPROP(sizeof(caps->props)), caps->props) < 0)
+	{
+		wcmLog(priv, W_ERROR, "unable to ioctl input properties.\n");
+		return FALSE;
+	}
+
+	if (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(caps->abs)), caps->abs) < 0)
+	{
+		wcmLog(priv, W_ERROR, "unable to ioctl abs bits.\n");
+		return FALSE;
+	}
+
+	if (ioctl(fd, EVIOCGBIT(EV_SW, sizeof(caps->sw)), caps->sw) < 0)
+	{
+		wcmLog(priv, W_ERROR, "unable to ioctl sw bits.\n");
+		memset(caps->sw, 0, sizeof(caps->sw));
+	}
+
+	for (int code = ABS_Y + 1; code < ABS_CNT; code++)
+	{
+		if (ISBITSET(caps->abs, code) &&
+		    ioctl(fd, EVIOCGABS(code), &caps->absinfo[code]) == 0)
+			caps->absvalid[LONG(code)] |= BIT(code);
+	}
+
+	caps->model = usbFindModel(&caps->id);
+
+	if (have_path)
+		usbCapsFileStore(path, caps);
+
+	return TRUE;
+}
+
+/* Return the capabilities of priv's event node. Tools sharing a common
+ * struct probe it once, other tools on the same node use the cache.
+ */
+static const wcmUSBCaps *usbGetCaps(WacomDevicePtr priv)
+{
+	WacomCommonPtr common = priv->common;
+	wcmUSBData *usbdata;
+	struct stat st;
+	Bool have_stat, ok;
+	char *cachedir;
+
+	if (!common->private &&
+	    !(common->private = wcmArenaAlloc(common, sizeof(wcmUSBData))))
+	{
+		wcmLog(priv, W_ERROR, "unable to alloc event queue.\n");
+		return NULL;
+	}
+
+	usbdata = common->private;
+	if (usbdata->haveCaps)
+		return &usbdata->caps;
+
+	have_stat = fstat(wcmGetFd(priv), &st) == 0 && st.st_rdev;
+	if (have_stat && (usbdata->capsCache = usbCapsCacheLookup(&st, &usbdata->caps)))
+		DBG(3, priv, "using cached capabilities\n");
+	else
+	{
+		cachedir = wcmOptCheckStr(priv, "CapabilityCache", NULL);
+		ok = usbQueryCaps(priv, &usbdata->caps, cachedir);
+		free(cachedir);
+		if (!ok)
+			return NULL;
+		if (have_stat)
+			usbdata->capsCache = usbCapsCacheStore(&st, &usbdata->caps);
+	}
+
+	usbdata->haveCaps = TRUE;
+	return &usbdata->caps;
+}
+
+static Bool usbGetAbs(const wcmUSBCaps *caps, int code, struct input_absinfo *absinfo)
+{
+	if (!ISBITSET(caps->absvalid, code))
+		return FALSE;
+
+	*absinfo = caps->absinfo[code];
+	return TRUE;
+}
+
 static Bool usbWcmInit(WacomDevicePtr priv)
 {
+	const wcmUSBCaps *caps;
 	struct input_id sID;
 	WacomCommonPtr common = priv->common;
 	wcmUSBData *usbdata;
@@ -418,29 +921,17 @@ static Bool usbWcmInit(WacomDevicePtr priv)
 	DBG(1, priv, "initializing USB tablet\n");
 
 	/* fetch vendor, product, and model name */
-	if (ioctl(wcmGetFd(priv), EVIOCGID, &sID) == -1) {
-		wcmLog(priv, W_ERROR, "failed to ioctl ID .\n");
+	if (!(caps = usbGetCaps(priv)))
 		return !Success;
-	}
-
-	if (!common->private &&
-	    !(common->private = calloc(1, sizeof(wcmUSBData))))
-	{
-		wcmLog(priv, W_ERROR, "unable to alloc event queue.\n");
-		return !Success;
-	}
+	sID = caps->id;
 
 	usbdata = common->private;
 
-	for (size_t i = 0; i < ARRAY_SIZE(WacomModelDesc); i++)
+	if (caps->model)
 	{
-		if (sID.vendor == WacomModelDesc[i].vendor_id &&
-		    sID.product == WacomModelDesc [i].model_id)
-		{
-			common->wcmModel = WacomModelDesc [i].model;
-			common->wcmResolX = WacomModelDesc [i].xRes;
-			common->wcmResolY = WacomModelDesc [i].yRes;
-		}
+		common->wcmModel = caps->model->model;
+		common->wcmResolX = caps->model->xRes;
+		common->wcmResolY = caps->model->yRes;
 	}
 
 	if (!common->wcmModel)
@@ -540,7 +1031,7 @@ static void usbWcmInitPadState(WacomDevicePtr priv)
 {
 	WacomCommonPtr common = priv->common;
 	WacomDeviceState *ds;
-	int channel = PAD_CHANNEL;
+	int channel = PAD_CHANNEL(common);
 
 	DBG(6, common, "Initializing PAD channel %d\n", channel);
 
@@ -552,11 +1043,33 @@ static void usbWcmInitPadState(WacomDevicePtr priv)
 	ds->serial_num = channel;
 }
 
+/* Size the channel pool for the tools and contacts this device has,
+ * plus the pad channel. */
+static Bool usbSetChannelCount(WacomDevicePtr priv, unsigned int count)
+{
+	WacomCommonPtr common = priv->common;
+	wcmUSBData *private = common->private;
+
+	if (count + 1 == common->wcmChannelCount)
+		return TRUE;
+
+	if (!wcmSetChannelCount(common, count + 1))
+	{
+		wcmLog(priv, W_ERROR, "unable to allocate %u channels.\n", count + 1);
+		return FALSE;
+	}
+
+	DBG(1, priv, "using %u channels\n", common->wcmChannelCount);
+	private->wcmMTChannel = 0;
+	private->lastChannel = 0;
+	return TRUE;
+}
+
 int usbInitialize(WacomDevicePtr priv)
 {
+	const wcmUSBCaps *caps;
 	struct input_absinfo absinfo;
-	unsigned long ev[NBITS(EV_MAX)] = {0};
-	unsigned long abs[NBITS(ABS_MAX)] = {0};
+	const unsigned long *ev, *abs;
 	unsigned long sw[NBITS(SW_MAX)] = {0};
 	WacomCommonPtr common =	priv->common;
 	wcmUSBData* private = common->private;
@@ -570,11 +1083,10 @@ int usbInitialize(WacomDevicePtr priv)
 	     && ISBITSET(common->wcmKeys, BTN_FORWARD))
 		is_touch = 1;
 
-	if (ioctl(wcmGetFd(priv), EVIOCGBIT(0 /*EV*/, sizeof(ev)), ev) < 0)
-	{
-		wcmLog(priv, W_ERROR, "unable to ioctl event bits.\n");
+	if (!(caps = usbGetCaps(priv)))
 		return !Success;
-	}
+	ev = caps->ev;
+	abs = caps->abs;
 
 	if (!ISBITSET(ev,EV_ABS))
 	{
@@ -587,15 +1099,8 @@ int usbInitialize(WacomDevicePtr priv)
 		return !Success;
 	}
 
-	/* absolute values */
-        if (ioctl(wcmGetFd(priv), EVIOCGBIT(EV_ABS, sizeof(abs)), abs) < 0)
-	{
-		wcmLog(priv, W_ERROR, "unable to ioctl max values.\n");
-		return !Success;
-	}
-
 	/* max x */
-	if (ioctl(wcmGetFd(priv), EVIOCGABS(ABS_X), &absinfo) < 0)
+	if (!usbGetAbs(caps, ABS_X, &absinfo))
 	{
 		/* may be a PAD only interface */
 		if (ISBITSET(common->wcmKeys, BTN_FORWARD) ||
@@ -626,7 +1131,7 @@ int usbInitialize(WacomDevicePtr priv)
 	}
 
 	/* max y */
-	if (ioctl(wcmGetFd(priv), EVIOCGABS(ABS_Y), &absinfo) < 0)
+	if (!usbGetAbs(caps, ABS_Y, &absinfo))
 	{
 		wcmLog(priv, W_ERROR, "unable to ioctl ymax value.\n");
 		return !Success;
@@ -652,8 +1157,7 @@ int usbInitialize(WacomDevicePtr priv)
 
 	/* max finger strip X for tablets with Expresskeys
 	 * or physical X for touch devices in hundredths of a mm */
-	if (ISBITSET(abs, ABS_RX) &&
-			!ioctl(wcmGetFd(priv), EVIOCGABS(ABS_RX), &absinfo))
+	if (usbGetAbs(caps, ABS_RX, &absinfo))
 	{
 		if (is_touch)
 			common->wcmTouchResolX =
@@ -666,16 +1170,14 @@ int usbInitialize(WacomDevicePtr priv)
 	/* max touchring value for standalone pad tools */
 	common->wcmMinRing = 0;
 	common->wcmMaxRing = 71;
-	if (!ISBITSET(ev,EV_MSC) && ISBITSET(abs, ABS_WHEEL) &&
-			!ioctl(wcmGetFd(priv), EVIOCGABS(ABS_WHEEL), &absinfo))
+	if (!ISBITSET(ev,EV_MSC) && usbGetAbs(caps, ABS_WHEEL, &absinfo))
 	{
 		common->wcmMinRing = absinfo.minimum;
 		common->wcmMaxRing = absinfo.maximum;
 	}
 
 	/* X tilt range */
-	if (ISBITSET(abs, ABS_TILT_X) &&
-			!ioctl(wcmGetFd(priv), EVIOCGABS(ABS_TILT_X), &absinfo))
+	if (usbGetAbs(caps, ABS_TILT_X, &absinfo))
 	{
 		/* If resolution is specified */
 		if (absinfo.resolution > 0)
@@ -710,8 +1212,7 @@ int usbInitialize(WacomDevicePtr priv)
 	}
 
 	/* Y tilt range */
-	if (ISBITSET(abs, ABS_TILT_Y) &&
-			!ioctl(wcmGetFd(priv), EVIOCGABS(ABS_TILT_Y), &absinfo))
+	if (usbGetAbs(caps, ABS_TILT_Y, &absinfo))
 	{
 		/* If resolution is specified */
 		if (absinfo.resolution > 0)
@@ -747,8 +1248,7 @@ int usbInitialize(WacomDevicePtr priv)
 
 	/* max finger strip Y for tablets with Expresskeys
 	 * or physical Y for touch devices in hundredths of a mm */
-	if (ISBITSET(abs, ABS_RY) &&
-			!ioctl(wcmGetFd(priv), EVIOCGABS(ABS_RY), &absinfo))
+	if (usbGetAbs(caps, ABS_RY, &absinfo))
 	{
 		if (is_touch)
 			common->wcmTouchResolY =
@@ -759,20 +1259,18 @@ int usbInitialize(WacomDevicePtr priv)
 	}
 
 	/* max z cannot be configured */
-	if (ISBITSET(abs, ABS_PRESSURE) &&
-			!ioctl(wcmGetFd(priv), EVIOCGABS(ABS_PRESSURE), &absinfo))
+	if (usbGetAbs(caps, ABS_PRESSURE, &absinfo))
 		common->wcmMaxZ = absinfo.maximum;
 
 	/* max distance */
-	if (ISBITSET(abs, ABS_DISTANCE) &&
-			!ioctl(wcmGetFd(priv), EVIOCGABS(ABS_DISTANCE), &absinfo))
+	if (usbGetAbs(caps, ABS_DISTANCE, &absinfo))
 		common->wcmMaxDist = absinfo.maximum;
 
 	if (ISBITSET(abs, ABS_MT_SLOT))
 	{
 		private->wcmUseMT = 1;
 
-		if (!ioctl(wcmGetFd(priv), EVIOCGABS(ABS_MT_SLOT), &absinfo))
+		if (usbGetAbs(caps, ABS_MT_SLOT, &absinfo))
 			common->wcmMaxContacts = absinfo.maximum + 1;
 
 		/* pen and MT on the same logical port */
@@ -784,17 +1282,10 @@ int usbInitialize(WacomDevicePtr priv)
 	if (common->vendor_id != WACOM_VENDOR_ID || !ISBITSET(abs, ABS_MISC))
 		common->wcmProtocolLevel = WCM_PROTOCOL_GENERIC;
 
-	if (ioctl(wcmGetFd(priv), EVIOCGBIT(EV_SW, sizeof(sw)), sw) < 0)
-	{
-		wcmLog(priv, W_ERROR, "unable to ioctl sw bits.\n");
-		return 0;
-	}
-	else if (ISBITSET(sw, SW_MUTE_DEVICE))
+	if (ISBITSET(caps->sw, SW_MUTE_DEVICE))
 	{
 		common->wcmHasHWTouchSwitch = TRUE;
 
-		memset(sw, 0, sizeof(sw));
-
 		if (ioctl(wcmGetFd(priv), EVIOCGSW(sizeof(sw)), sw) < 0)
 			wcmLog(priv, W_ERROR, "unable to ioctl sw state.\n");
 
@@ -805,6 +1296,13 @@ int usbInitialize(WacomDevicePtr priv)
 	}
 
 pad_init:
+	/* One channel per touch contact plus one for stylus/mouse. Pen-only
+	 * tablets get two, dual-tracking tablets have two tools in
+	 * proximity at once. */
+	if (!usbSetChannelCount(priv, common->wcmMaxContacts > 0 ?
+				common->wcmMaxContacts + 1 : 2))
+		return !Success;
+
 	usbWcmInitPadState(priv);
 
 	return Success;
@@ -880,7 +1378,7 @@ static unsigned int protocol5Serial(int device_type, unsigned int serial) {
  * Find an appropriate channel to track the specified tool's state in.
  * If the tool is already in proximity, the channel currently being used
  * to store its state will be returned. Otherwise, an arbitrary available
- * channel will be cleaned and returned. Up to MAX_CHANNEL tools can be
+ * channel will be cleaned and returned. Up to wcmChannelCount tools can be
  * tracked concurrently by driver.
  *
  * @param[in] common
@@ -895,12 +1393,12 @@ static int usbChooseChannel(WacomCommonPtr common, int device_type, unsigned int
 
 	/* force events from PAD device to PAD_CHANNEL */
 	if (serial == DEFAULT_TOOL_SERIAL)
-		channel = PAD_CHANNEL;
+		channel = PAD_CHANNEL(common);
 
 	/* find existing channel */
 	if (channel < 0)
 	{
-		for (i=0; i<MAX_CHANNELS; i++)
+		for (i=0; i<(int)common->wcmChannelCount; i++)
 		{
 			if (common->wcmChannel[i].work.proximity &&
 			    common->wcmChannel[i].work.device_type == device_type &&
@@ -915,9 +1413,9 @@ static int usbChooseChannel(WacomCommonPtr common, int device_type, unsigned int
 	/* find and clean an empty channel */
 	if (channel < 0)
 	{
-		for (i=0; i<MAX_CHANNELS; i++)
+		for (i=0; i<(int)common->wcmChannelCount; i++)
 		{
-			if (i == PAD_CHANNEL)
+			if (i == (int)PAD_CHANNEL(common))
 				continue;
 
 			if (!common->wcmChannel[i].work.proximity &&
@@ -936,9 +1434,9 @@ static int usbChooseChannel(WacomCommonPtr common, int device_type, unsigned int
 		/* This should never happen in normal use.
 		 * Let's start over again. Force prox-out for all channels.
 		 */
-		for (i=0; i<MAX_CHANNELS; i++)
+		for (i=0; i<(int)common->wcmChannelCount; i++)
 		{
-			if (i == PAD_CHANNEL)
+			if (i == (int)PAD_CHANNEL(common))
 				continue;
 
 			if (common->wcmChannel[i].work.proximity &&
@@ -966,6 +1464,155 @@ usbResetEventCounter(wcmUSBData *private)
 	private->wcmEventFlags = 0;
 }
 
+/* Append the queued frame to the flight recorder ring */
+static inline void
+usbRecordFrame(wcmUSBData *private)
+{
+	wcmRecorder *recorder = private->recorder;
+	unsigned int start, n;
+
+	if (!recorder)
+		return;
+
+	start = recorder->head % RECORDER_EVENTS;
+	n = min(private->wcmEventCnt, RECORDER_EVENTS - start);
+	memcpy(&recorder->ring[start], private->wcmEvents,
+	       n * sizeof(struct input_event));
+	memcpy(recorder->ring, private->wcmEvents + n,
+	       (private->wcmEventCnt - n) * sizeof(struct input_event));
+	recorder->head += private->wcmEventCnt;
+}
+
+/* One event in the format of wacom-record */
+#define RECORDER_LINE_MAX 128
+
+/**
+ * Format the snapshot in the format used by wacom-record and write it to
+ * a file in the FlightRecorder directory with a single write(). Runs from the recorder
+ * timer on the main thread.
+ */
+static uint32_t usbWriteRecorder(WacomTimerPtr timer, uint32_t millis, void *data)
+{
+	wcmRecorder *recorder = data;
+	WacomCommonPtr common = recorder->common;
+	size_t size = PATH_MAX + 256 + recorder->nsnapshot * RECORDER_LINE_MAX;
+	char path[PATH_MAX];
+	char *buf = malloc(size);
+	size_t len = 0;
+	int fd, rc = 0;
+
+	recorder->pending = FALSE;
+	snprintf(path, sizeof(path), "%s/wacom-recorder-%04x-%04x-%u.yml",
+		 recorder->dir, (unsigned int)common->vendor_id,
+		 (unsigned int)common->tablet_id, millis);
+
+	if (!buf)
+	{
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	len = snprintf(buf, size,
+		       "wacom-record:\n"
+		       "  version: %s\n"
+		       "  flight-recorder:\n"
+		       "    reason: \"%s\"\n"
+		       "    device: \"%s\"\n"
+		       "  events:\n",
+		       PACKAGE_VERSION, recorder->reason, common->device_path);
+	for (unsigned int i = 0; i < recorder->nsnapshot && len < size; i++)
+	{
+		const struct input_event *ev = &recorder->snapshot[i];
+
+		len += snprintf(buf + len, size - len,
+				"    - { source: 0, event: evdev, data: [%6ld, %6ld, %3d, %3d, %10d] }\n",
+				(long)ev->input_event_sec, (long)ev->input_event_usec,
+				ev->type, ev->code, ev->value);
+	}
+	if (len >= size)
+	{
+		rc = -EOVERFLOW;
+		goto out;
+	}
+
+	fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+	if (fd < 0)
+	{
+		rc = -errno;
+		goto out;
+	}
+	if (write(fd, buf, len) != (ssize_t)len)
+		rc = -EIO;
+	close(fd);
+
+out:
+	free(buf);
+	if (rc == 0)
+		wcmLogCommon(common, W_WARNING, "flight recorder (%s) written to %s\n",
+			     recorder->reason, path);
+	else
+		wcmLogCommon(common, W_ERROR, "failed to write flight recorder to %s: %s\n",
+			     path, strerror(-rc));
+
+	return 0;
+}
+
+/**
+ * Copy the flight recorder into its snapshot, the recorder timer writes
+ * it to a file later. The recorder contains the last complete frames plus
+ * the frame currently being queued, if any. At most one dump is taken
+ * every RECORDER_DUMP_INTERVAL.
+ *
+ * Must be called on the input thread or with the input lock held. reason
+ * must be a static string.
+ *
+ * @return 0 on success or a negative errno
+ */
+static int usbDumpRecorder(WacomDevicePtr priv, const char *reason)
+{
+	WacomCommonPtr common = priv->common;
+	wcmUSBData* private = common->private;
+	wcmRecorder *recorder = private ? private->recorder : NULL;
+	uint32_t now = wcmTimeInMillis();
+	unsigned int count, n = 0;
+
+	if (!recorder)
+		return -ENOTSUP;
+
+	if (recorder->pending ||
+	    (recorder->lastDump && now - recorder->lastDump < RECORDER_DUMP_INTERVAL))
+		return -EBUSY;
+
+	count = min(recorder->head, RECORDER_EVENTS);
+	for (unsigned int i = recorder->head - count; i != recorder->head; i++)
+		recorder->snapshot[n++] = recorder->ring[i % RECORDER_EVENTS];
+
+	/* a frame that ends in SYN_REPORT has been recorded already */
+	if (private->wcmEventCnt &&
+	    private->wcmEvents[private->wcmEventCnt - 1].type != EV_SYN)
+	{
+		memcpy(&recorder->snapshot[n], private->wcmEvents,
+		       private->wcmEventCnt * sizeof(struct input_event));
+		n += private->wcmEventCnt;
+	}
+
+	recorder->nsnapshot = n;
+	recorder->reason = reason;
+	recorder->lastDump = now;
+	recorder->pending = TRUE;
+	wcmTimerSet(recorder->timer, 1, usbWriteRecorder, recorder);
+
+	return 0;
+}
+
+/* Dump the flight recorder because something went wrong */
+static void usbDumpRecorderOnAnomaly(WacomDevicePtr priv, const char *reason)
+{
+	if (usbDumpRecorder(priv, reason) == 0)
+		wcmLogSafe(priv, W_ERROR, "%s: %s, dumping the flight recorder\n",
+			   priv->name, reason);
+}
+
 static void usbParseEvent(WacomDevicePtr priv,
 	const struct input_event* event)
 {
@@ -976,6 +1623,8 @@ static void usbParseEvent(WacomDevicePtr priv,
 
 	wcmNotifyEvdev(priv, event);
 
+	common->wcmStats[WSTAT_EVENTS]++;
+
 	/* store events until we receive a SYN_REPORT */
 
 	/* space left? bail if not. */
@@ -983,7 +1632,11 @@ static void usbParseEvent(WacomDevicePtr priv,
 	{
 		wcmLogSafe(priv, W_ERROR, "%s: usbParse: Exceeded event queue (%u) \n",
 		       priv->name, private->wcmEventCnt);
+		if (!private->wcmFrameDropped)
+			common->wcmStats[WSTAT_DROP_QUEUE_OVERFLOW]++;
+		usbDumpRecorderOnAnomaly(priv, "event queue overflow");
 		usbResetEventCounter(private);
+		private->wcmFrameDropped = TRUE;
 		return;
 	}
 
@@ -1029,10 +1682,16 @@ static void usbParseMscEvent(WacomDevicePtr priv,
 		 * In both cases, we drop the whole frame.
 		 */
 		if (private->wcmLastToolSerial)
+		{
 			wcmLogSafe(priv, W_ERROR,
 				      "%s: usbParse: Ignoring packet for serial=0. It should be %ud \n",
 				      priv->name, private->wcmLastToolSerial);
+			usbDumpRecorderOnAnomaly(priv, "serial 0");
+		}
+		if (!private->wcmFrameDropped)
+			common->wcmStats[WSTAT_DROP_SERIAL_ZERO]++;
 		usbResetEventCounter(private);
+		private->wcmFrameDropped = TRUE;
 	}
 }
 
@@ -1048,10 +1707,24 @@ static void usbParseSynEvent(WacomDevicePtr priv,
 	WacomCommonPtr common = priv->common;
 	wcmUSBData* private = common->private;
 	const uint32_t significant_event_types = ~(1 << EV_SYN | 1 << EV_MSC);
+	enum WacomStatistic drop;
+	uint64_t start;
 
 	if (event->code != SYN_REPORT)
 		return;
 
+	common->wcmStats[WSTAT_FRAMES]++;
+	usbRecordFrame(private);
+
+	/* the rest of a frame that overflowed the queue or had a serial of
+	 * 0, already counted */
+	if (private->wcmFrameDropped)
+	{
+		private->wcmFrameDropped = FALSE;
+		usbResetEventCounter(private);
+		return;
+	}
+
 	/* ignore events without information */
 	if ((private->wcmEventCnt < 2) && private->wcmLastToolSerial)
 	{
@@ -1069,10 +1742,29 @@ static void usbParseSynEvent(WacomDevicePtr priv,
 		goto skipEvent;
 	}
 
-	/* dispatch all queued events */
-	usbDispatchEvents(priv);
+	/* dispatch all queued events, unless they would be thrown away */
+	start = wcmTimingStart(common);
+	WCM_PROBE(frame_start, private->wcmEventCnt);
+	drop = usbClassifyFrame(priv);
+	if (drop == WSTAT_COUNT)
+	{
+		usbDispatchEvents(priv);
+		wcmTouchFrameEnd(common);
+	}
+	else
+	{
+		DBG(6, common, "dropping frame of %u events (%d)\n",
+		    private->wcmEventCnt, drop);
+		common->wcmStats[drop]++;
+		usbDropFrame(private);
+	}
+	WCM_PROBE(frame_end, private->wcmEventCnt, drop == WSTAT_COUNT);
+	wcmTimingEnd(common, WTIME_PARSE, start);
+	usbResetEventCounter(private);
+	return;
 
 skipEvent:
+	common->wcmStats[WSTAT_DROP_EMPTY_FRAME]++;
 	usbResetEventCounter(private);
 }
 
@@ -1821,6 +2513,66 @@ static Bool usbIsTabletToolInProx(int device_type, int proximity)
 	return (is_tablet_tool && proximity);
 }
 
+/**
+ * Decide whether the queued frame would be thrown away after decoding,
+ * from its tool type and the arbitration state alone. This runs before a
+ * channel is chosen or any channel state is changed. Sets
+ * private->wcmDeviceType for the frame.
+ *
+ * Touch frames while touch is disabled are not dropped here. The multitouch
+ * state is incremental, so they are decoded and only not sent, see
+ * usbDispatchEvents().
+ *
+ * @return The WSTAT_DROP_* reason to drop the frame for, or WSTAT_COUNT
+ *         if it has to be dispatched
+ */
+static enum WacomStatistic usbClassifyFrame(WacomDevicePtr priv)
+{
+	WacomCommonPtr common = priv->common;
+	wcmUSBData* private = common->private;
+	const WacomDeviceState *dslast = &common->wcmChannel[private->lastChannel].valid.state;
+
+	private->wcmDeviceType = usbInitToolType(priv, wcmGetFd(priv),
+	                                         private->wcmEvents,
+	                                         private->wcmEventCnt,
+	                                         dslast->device_type);
+
+	if (private->wcmDeviceType != TOUCH_ID)
+		return WSTAT_COUNT;
+
+	/* the touch switch must be seen even while touch is off */
+	if (private->wcmEventFlags & (1 << EV_SW))
+		return WSTAT_COUNT;
+
+	/* We get both tablet tool and touch data from the kernel when
+	 * both tools are in/down. So, if we were (hence the need of dslast)
+	 * processing tablet tool events, we should ignore touch events.
+	 */
+	if (private->wcmPenTouch &&
+	    usbIsTabletToolInProx(dslast->device_type, dslast->proximity))
+		return WSTAT_DROP_PEN_OVER_TOUCH;
+
+	return WSTAT_COUNT;
+}
+
+/**
+ * Throw away the queued frame. The kernel only sends ABS_MT_SLOT when the
+ * slot changes, the last one is kept for the next frame that is decoded.
+ */
+static void usbDropFrame(wcmUSBData *private)
+{
+	for (unsigned int i = 0; i < private->wcmEventCnt; i++)
+	{
+		const struct input_event *event = &private->wcmEvents[i];
+
+		if (event->type == EV_ABS && event->code == ABS_MT_SLOT &&
+		    event->value >= 0)
+			private->wcmMTSlotPending = event->value + 1;
+	}
+
+	private->wcmEventCnt = 0;
+}
+
 static void usbDispatchEvents(WacomDevicePtr priv)
 {
 	int c;
@@ -1829,37 +2581,31 @@ static void usbDispatchEvents(WacomDevicePtr priv)
 	WacomCommonPtr common = priv->common;
 	int channel;
 	wcmUSBData* private = common->private;
-	WacomDeviceState dslast = common->wcmChannel[private->lastChannel].valid.state;
+	WacomDeviceState dslast;
+	Bool touch_muted, touch_held = FALSE, touch_sent = FALSE;
 
 	DBG(6, common, "%u events received\n", private->wcmEventCnt);
 
-	private->wcmDeviceType = usbInitToolType(priv, wcmGetFd(priv),
-	                                         private->wcmEvents,
-	                                         private->wcmEventCnt,
-	                                         dslast.device_type);
-
-	if (private->wcmPenTouch)
+	/* the slot selected while touch frames were dropped */
+	if (private->wcmMTSlotPending && private->wcmDeviceType == TOUCH_ID)
 	{
-		/* We get both tablet tool and touch data from the kernel when
-		 * both tools are in/down. So, if we were (hence the need of dslast)
-		 * processing tablet tool events, we should ignore touch events.
-		 *
-		 * MT events will be posted to the userland when XInput 2.1
-		 * is ready.
-		 */
-		if ((private->wcmDeviceType == TOUCH_ID) &&
-				usbIsTabletToolInProx(dslast.device_type, dslast.proximity))
-		{
-			private->wcmEventCnt = 0;
-			return;
-		}
+		struct input_event slot = {
+			.type = EV_ABS,
+			.code = ABS_MT_SLOT,
+			.value = private->wcmMTSlotPending - 1,
+		};
+
+		private->wcmMTSlotPending = 0;
+		usbParseAbsMTEvent(common, &slot);
 	}
 
 	private->wcmLastToolSerial = protocol5Serial(private->wcmDeviceType, private->wcmLastToolSerial);
 	channel = usbChooseChannel(common, private->wcmDeviceType, private->wcmLastToolSerial);
+	WCM_PROBE(channel, channel, private->wcmDeviceType, private->wcmLastToolSerial);
 
 	/* couldn't decide channel? invalid data */
 	if (channel == -1) {
+		common->wcmStats[WSTAT_DROP_NO_CHANNEL]++;
 		private->wcmEventCnt = 0;
 		return;
 	}
@@ -1868,9 +2614,12 @@ static void usbDispatchEvents(WacomDevicePtr priv)
 	dslast = common->wcmChannel[channel].valid.state;
 
 	if (ds->device_type && ds->device_type != private->wcmDeviceType)
+	{
 		wcmLogSafe(priv, W_ERROR,
 				      "usbDispatchEvents: Device Type mismatch - %d -> %d. This is a BUG.\n",
 				      ds->device_type, private->wcmDeviceType);
+		usbDumpRecorderOnAnomaly(priv, "device type mismatch");
+	}
 	/* no device type? */
 	if (!ds->device_type && private->wcmDeviceType) {
 		ds->device_type = private->wcmDeviceType;
@@ -1891,7 +2640,10 @@ static void usbDispatchEvents(WacomDevicePtr priv)
 
 		/* Check for events to be ignored and skip them up front. */
 		if (usbFilterEvent(common, event))
+		{
+			common->wcmStats[WSTAT_DROP_FILTERED]++;
 			continue;
+		}
 
 		if (common->wcmHasHWTouchSwitch)
 		{
@@ -1933,7 +2685,7 @@ static void usbDispatchEvents(WacomDevicePtr priv)
 		{
 			/* Button events can be from puck or expresskeys */
 			int btn_channel = (ds->device_type == CURSOR_ID) ?
-					   channel : PAD_CHANNEL;
+					   channel : (int)PAD_CHANNEL(common);
 
 			usbParseKeyEvent(common, event, channel);
 			usbParseBTNEvent(common, event, btn_channel);
@@ -1977,7 +2729,10 @@ static void usbDispatchEvents(WacomDevicePtr priv)
 
 	private->lastChannel = channel;
 
-	for (c = 0; c < MAX_CHANNELS; c++) {
+	/* The touch switch is left to the kernel, contacts lifted after it
+	 * went off must still be sent. Only count these frames. */
+	touch_muted = common->wcmHasHWTouchSwitch && !common->wcmHWTouchSwitchState;
+	for (c = 0; c < (int)common->wcmChannelCount; c++) {
 		ds = &common->wcmChannel[c].work;
 
 		/* walk through all channels */
@@ -1986,9 +2741,19 @@ static void usbDispatchEvents(WacomDevicePtr priv)
 			common->wcmChannel[c].dirty = FALSE;
 			/* don't send touch event when touch isn't enabled */
 			if (ds->device_type != TOUCH_ID || common->wcmTouch)
+			{
 				wcmEvent(common, c, ds);
+				touch_sent |= ds->device_type == TOUCH_ID;
+			}
+			else
+				touch_held = TRUE;
 		}
 	}
+
+	if (touch_held)
+		common->wcmStats[WSTAT_DROP_TOUCH_DISABLED]++;
+	else if (touch_sent && touch_muted)
+		common->wcmStats[WSTAT_TOUCH_MUTED]++;
 }
 
 /* Quirks to unify the tool and tablet types for GENERIC protocol tablet PCs
@@ -2002,7 +2767,7 @@ static void usbDispatchEvents(WacomDevicePtr priv)
  *   touchscreens so correct defaults, such as absolute mode, are used.
  */
 static void usbGenericTouchscreenQuirks(unsigned long *keys,
-					unsigned long *abs,
+					const unsigned long *abs,
 					WacomCommonPtr common)
 {
 	/* USB Tablet PC single finger touch devices do not emit
@@ -2030,53 +2795,33 @@ static void usbGenericTouchscreenQuirks(unsigned long *keys,
  */
 static int usbProbeKeys(WacomDevicePtr priv)
 {
-	struct input_id wacom_id;
+	const wcmUSBCaps *caps;
 	WacomCommonPtr  common = priv->common;
-	unsigned long abs[NBITS(ABS_MAX)] = {0};
-
-	if (ioctl(wcmGetFd(priv), EVIOCGBIT(EV_KEY, (sizeof(unsigned long)
-						* NBITS(KEY_MAX))), common->wcmKeys) < 0)
-	{
-		wcmLog(priv, W_ERROR,
-			    "usbProbeKeys unable to ioctl USB key bits.\n");
-		return 0;
-	}
 
-	if (ioctl(wcmGetFd(priv), EVIOCGPROP(sizeof(common->wcmInputProps)), common->wcmInputProps) < 0)
+	if (!(caps = usbGetCaps(priv)))
 	{
 		wcmLog(priv, W_ERROR,
-			    "usbProbeKeys unable to ioctl input properties.\n");
+			    "usbProbeKeys unable to probe device capabilities.\n");
 		return 0;
 	}
 
-	if (ioctl(wcmGetFd(priv), EVIOCGID, &wacom_id) < 0)
-	{
-		wcmLog(priv, W_ERROR,
-			"usbProbeKeys unable to ioctl Device ID.\n");
-		return 0;
-	}
-
-        if (ioctl(wcmGetFd(priv), EVIOCGBIT(EV_ABS, sizeof(abs)), abs) < 0)
-	{
-		wcmLog(priv, W_ERROR,
-			    "usbProbeKeys unable to ioctl abs bits.\n");
-		return 0;
-	}
+	memcpy(common->wcmKeys, caps->keys, sizeof(common->wcmKeys));
+	memcpy(common->wcmInputProps, caps->props, sizeof(common->wcmInputProps));
 
 	/* The wcmKeys stored above have different meaning for generic
 	 * protocol.  Detect that and change default protocol 4 to
 	 * generic.
 	 */
-	if (!ISBITSET(abs, ABS_MISC))
+	if (!ISBITSET(caps->abs, ABS_MISC))
 	{
 		common->wcmProtocolLevel = WCM_PROTOCOL_GENERIC;
-		usbGenericTouchscreenQuirks(common->wcmKeys, abs, common);
+		usbGenericTouchscreenQuirks(common->wcmKeys, caps->abs, common);
 	}
 
-	common->vendor_id = wacom_id.vendor;
-	common->tablet_id = wacom_id.product;
+	common->vendor_id = caps->id.vendor;
+	common->tablet_id = caps->id.product;
 
-	return wacom_id.product;
+	return caps->id.product;
 }
 
 
@@ -2096,6 +2841,286 @@ TEST_CASE(test_mod_buttons)
 	assert(mod_buttons(&common, 0, sizeof(int) * 8, 1) == 0);
 }
 
+TEST_CASE(test_arena_layout)
+{
+	WacomCommonPtr common = wcmNewCommon();
+	struct WacomArenaChunk *first = common->arena;
+	char *private;
+
+	/* the backend data and 16 serial tools go into the first chunk */
+	private = wcmArenaAlloc(common, sizeof(wcmUSBData));
+	assert(private);
+	for (int i = 0; i < 16; i++)
+		assert(wcmArenaAlloc(common, sizeof(WacomTool)));
+	assert(common->arena == first);
+
+	wcmFreeCommon(&common);
+}
+
+TEST_CASE(test_record_frame)
+{
+	wcmUSBData *private = calloc(1, sizeof(*private));
+	wcmRecorder *recorder = calloc(1, sizeof(*recorder));
+	unsigned int frame, i;
+
+	private->recorder = recorder;
+
+	/* frames of 100 events wrap around the ring at some point */
+	for (frame = 0; frame < 30; frame++)
+	{
+		private->wcmEventCnt = 100;
+		for (i = 0; i < private->wcmEventCnt; i++)
+			private->wcmEvents[i].value = frame * 100 + i;
+		usbRecordFrame(private);
+	}
+
+	assert(recorder->head == 3000);
+	for (i = recorder->head - RECORDER_EVENTS; i < recorder->head; i++)
+		assert(recorder->ring[i % RECORDER_EVENTS].value == (int)i);
+
+	free(recorder);
+	free(private);
+}
+
+TEST_CASE(test_drop_frame)
+{
+	wcmUSBData *private = calloc(1, sizeof(*private));
+	struct input_event frame[] = {
+		{ .type = EV_ABS, .code = ABS_MT_SLOT, .value = 3 },
+		{ .type = EV_ABS, .code = ABS_MT_POSITION_X, .value = 100 },
+		{ .type = EV_ABS, .code = ABS_MT_SLOT, .value = 5 },
+		{ .type = EV_ABS, .code = ABS_MT_TRACKING_ID, .value = -1 },
+		{ .type = EV_SYN, .code = SYN_REPORT, .value = 0 },
+	};
+
+	memcpy(private->wcmEvents, frame, sizeof(frame));
+	private->wcmEventCnt = ARRAY_SIZE(frame);
+	usbDropFrame(private);
+	assert(private->wcmEventCnt == 0);
+	assert(private->wcmMTSlotPending == 5 + 1);
+
+	/* a frame without a slot change keeps the pending slot */
+	memcpy(private->wcmEvents, &frame[1], sizeof(frame[1]));
+	private->wcmEventCnt = 1;
+	usbDropFrame(private);
+	assert(private->wcmMTSlotPending == 5 + 1);
+
+	free(private);
+}
+
+TEST_CASE(test_drop_stats_once)
+{
+	WacomCommonRec common = {0};
+	WacomDeviceRec priv = {0};
+	wcmUSBData *private = calloc(1, sizeof(*private));
+	struct input_event serial = { .type = EV_MSC, .code = MSC_SERIAL, .value = 0 };
+	struct input_event x = { .type = EV_ABS, .code = ABS_X, .value = 10 };
+	struct input_event syn = { .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+
+	priv.common = &common;
+	common.private = private;
+
+	/* a serial of 0 drops the rest of the frame too, counted once */
+	private->wcmEvents[private->wcmEventCnt++] = serial;
+	usbParseMscEvent(&priv, &serial);
+	assert(common.wcmStats[WSTAT_DROP_SERIAL_ZERO] == 1);
+	private->wcmEvents[private->wcmEventCnt++] = x;
+	usbParseMscEvent(&priv, &serial);
+	assert(common.wcmStats[WSTAT_DROP_SERIAL_ZERO] == 1);
+	usbParseSynEvent(&priv, &syn);
+	assert(common.wcmStats[WSTAT_DROP_EMPTY_FRAME] == 0);
+	assert(!private->wcmFrameDropped);
+	assert(private->wcmEventCnt == 0);
+
+	/* an empty frame after that is counted as one */
+	private->wcmEvents[private->wcmEventCnt++] = syn;
+	usbParseSynEvent(&priv, &syn);
+	assert(common.wcmStats[WSTAT_DROP_EMPTY_FRAME] == 1);
+	assert(common.wcmStats[WSTAT_FRAMES] == 2);
+
+	free(private);
+}
+
+#ifdef EVIOCSMASK
+TEST_CASE(test_event_mask)
+{
+	WacomCommonRec common = {0};
+	wcmUSBData *private = calloc(1, sizeof(*private));
+	unsigned long keys[NBITS(KEY_CNT)];
+	unsigned long abs[NBITS(ABS_CNT)];
+	const int types[] = { TOUCH_ID, STYLUS_ID, PAD_ID };
+
+	common.private = private;
+
+	/* no MT, everything is delivered */
+	usbEventMask(private, EV_KEY, keys, ARRAY_SIZE(keys));
+	usbEventMask(private, EV_ABS, abs, ARRAY_SIZE(abs));
+	for (int code = 0; code < KEY_MAX; code++)
+		assert(ISBITSET(keys, code));
+	for (int code = 0; code < ABS_MAX; code++)
+		assert(ISBITSET(abs, code));
+
+	for (int pentouch = 0; pentouch <= 1; pentouch++)
+	{
+		private->wcmUseMT = TRUE;
+		private->wcmPenTouch = pentouch;
+		usbEventMask(private, EV_KEY, keys, ARRAY_SIZE(keys));
+		usbEventMask(private, EV_ABS, abs, ARRAY_SIZE(abs));
+
+		assert(!ISBITSET(keys, BTN_TOOL_DOUBLETAP));
+		assert(ISBITSET(keys, BTN_TOOL_PEN));
+		assert(ISBITSET(abs, ABS_MT_POSITION_X));
+		assert(ISBITSET(abs, ABS_MT_SLOT));
+		assert(!!ISBITSET(abs, ABS_X) == pentouch);
+
+		/* whatever the kernel holds back must be something
+		 * usbFilterEvent() drops for any tool on the interface,
+		 * ABS_X/Y only come along with MT data without a pen */
+		for (size_t t = 0; t < ARRAY_SIZE(types); t++)
+		{
+			Bool impossible = types[t] != TOUCH_ID && !pentouch;
+
+			private->wcmDeviceType = types[t];
+			for (int code = 0; code < KEY_MAX; code++)
+			{
+				struct input_event ev = { .type = EV_KEY, .code = code };
+				if (!ISBITSET(keys, code))
+					assert(usbFilterEvent(&common, &ev));
+			}
+			for (int code = 0; code < ABS_MAX; code++)
+			{
+				struct input_event ev = { .type = EV_ABS, .code = code };
+				if (!ISBITSET(abs, code) && !impossible)
+					assert(usbFilterEvent(&common, &ev));
+			}
+		}
+	}
+
+	free(private);
+}
+#endif
+
+TEST_CASE(test_caps_cache)
+{
+	struct stat st = {0}, other;
+	wcmUSBCaps caps = {0}, cached;
+	struct input_absinfo absinfo;
+	wcmUSBCapsCache *c1, *c2, *c3;
+
+	st.st_rdev = makedev(13, 80);
+	st.st_ino = 1000;
+	st.st_ctim.tv_sec = 5;
+	caps.id.product = 0x358;
+	caps.absinfo[ABS_X].maximum = 44800;
+	caps.absvalid[LONG(ABS_X)] |= BIT(ABS_X);
+
+	assert(!usbCapsCacheLookup(&st, &cached));
+	c1 = usbCapsCacheStore(&st, &caps);
+	assert(c1 && c1->refcnt == 1);
+	c2 = usbCapsCacheLookup(&st, &cached);
+	assert(c2 == c1 && c1->refcnt == 2);
+	assert(cached.id.product == 0x358);
+	assert(usbGetAbs(&cached, ABS_X, &absinfo));
+	assert(absinfo.maximum == 44800);
+	assert(!usbGetAbs(&cached, ABS_Y, &absinfo));
+
+	/* another node */
+	other = st;
+	other.st_rdev = makedev(13, 81);
+	assert(!usbCapsCacheLookup(&other, &cached));
+
+	/* same minor on a replugged device */
+	other = st;
+	other.st_ino = 1001;
+	assert(!usbCapsCacheLookup(&other, &cached));
+	other = st;
+	other.st_ctim.tv_nsec = 1;
+	assert(!usbCapsCacheLookup(&other, &cached));
+
+	caps.id.product = 0x359;
+	c3 = usbCapsCacheStore(&other, &caps);
+	assert(c3 == c1 && c1->refcnt == 3);
+	assert(!usbCapsCacheLookup(&st, &cached));
+	assert(usbCapsCacheLookup(&other, &cached) == c1);
+	assert(cached.id.product == 0x359);
+	assert(capsCache == c1 && !capsCache->next);
+
+	/* the entry goes with the last reference */
+	for (int i = 0; i < 3; i++)
+	{
+		usbCapsCacheUnref(c1);
+		assert(capsCache == c1);
+	}
+	usbCapsCacheUnref(c1);
+	assert(!capsCache);
+
+	/* unlinking from the middle of the list */
+	c1 = usbCapsCacheStore(&st, &caps);
+	other.st_rdev = makedev(13, 81);
+	c2 = usbCapsCacheStore(&other, &caps);
+	other.st_rdev = makedev(13, 82);
+	c3 = usbCapsCacheStore(&other, &caps);
+	assert(capsCache == c3 && c3->next == c2 && c2->next == c1);
+	usbCapsCacheUnref(c2);
+	assert(capsCache == c3 && c3->next == c1);
+	usbCapsCacheUnref(c3);
+	usbCapsCacheUnref(c1);
+	assert(!capsCache);
+}
+
+TEST_CASE(test_caps_file)
+{
+	char dir[] = "/tmp/wacom-caps-XXXXXX";
+	char path[PATH_MAX];
+	wcmUSBCaps caps = {0}, loaded = {0};
+	struct input_absinfo absinfo;
+
+	assert(mkdtemp(dir));
+
+	caps.id.bustype = BUS_USB;
+	caps.id.vendor = WACOM_VENDOR_ID;
+	caps.id.product = 0x358;
+	SETBIT(caps.keys, BTN_TOOL_PEN);
+	caps.absinfo[ABS_PRESSURE].maximum = 8191;
+	caps.absvalid[LONG(ABS_PRESSURE)] |= BIT(ABS_PRESSURE);
+
+	assert(usbCapsFilePath(dir, &caps.id, path, sizeof(path)));
+	assert(strstr(path, "/0003-056a-0358-0000-"));
+
+	loaded.id = caps.id;
+	memcpy(loaded.keys, caps.keys, sizeof(caps.keys));
+	assert(!usbCapsFileLoad(path, &loaded));
+
+	usbCapsFileStore(path, &caps);
+	assert(usbCapsFileLoad(path, &loaded));
+	assert(usbGetAbs(&loaded, ABS_PRESSURE, &absinfo));
+	assert(absinfo.maximum == 8191);
+	assert(loaded.model == usbFindModel(&caps.id));
+
+	/* same id, different key bits */
+	SETBIT(loaded.keys, BTN_TOOL_RUBBER);
+	assert(!usbCapsFileLoad(path, &loaded));
+	CLEARBIT(loaded.keys, BTN_TOOL_RUBBER);
+
+	/* a hwdb entry changed the X range, only the range counts */
+	caps.absinfo[ABS_X].maximum = 44704;
+	caps.absvalid[LONG(ABS_X)] |= BIT(ABS_X);
+	usbCapsFileStore(path, &caps);
+	memset(&loaded, 0, sizeof(loaded));
+	loaded.id = caps.id;
+	memcpy(loaded.keys, caps.keys, sizeof(caps.keys));
+	assert(!usbCapsFileLoad(path, &loaded));
+	loaded.absinfo[ABS_X].maximum = 44704;
+	loaded.absinfo[ABS_X].value = 1234;
+	loaded.absvalid[LONG(ABS_X)] |= BIT(ABS_X);
+	assert(usbCapsFileLoad(path, &loaded));
+	loaded.absinfo[ABS_X].maximum = 44000;
+	assert(!usbCapsFileLoad(path, &loaded));
+
+	assert(unlink(path) == 0);
+	assert(rmdir(dir) == 0);
+}
+
 
 #endif
 
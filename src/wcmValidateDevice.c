@@ -60,15 +60,15 @@ static int checkSource(WacomDevicePtr other, void *data)
  * before or not: don't add the tool by hal/udev if user has defined at least
  * one tool for the device in xorg.conf. One device can have multiple tools
  * with the same type to individualize tools with serial number or areas */
-static Bool wcmCheckSource(WacomDevicePtr priv, dev_t min_maj)
+static Bool wcmCheckSource(WacomDevicePtr priv, const struct stat *st)
 {
 	int nmatch;
 	struct checkData check = {
-		.min_maj = min_maj,
+		.min_maj = st->st_rdev,
 		.source = wcmOptCheckStr(priv, "_source", ""),
 	};
 
-	nmatch = wcmForeachDevice(priv, checkSource, &check);
+	nmatch = wcmForeachNodeDevice(priv, st, checkSource, &check);
 	if (nmatch > 0)
 		wcmLog(priv, W_WARNING,
 			    "device file already in use. Ignoring.\n");
@@ -107,7 +107,7 @@ int wcmIsDuplicate(const char* device, WacomDevicePtr priv)
 	if (st.st_rdev)
 	{
 		/* device matches with another added port */
-		if (wcmCheckSource(priv, st.st_rdev))
+		if (wcmCheckSource(priv, &st))
 		{
 			isInUse = 3;
 			goto ret;
@@ -229,6 +229,7 @@ wcmAddHotpluggedDevice(WacomDevicePtr priv, const char *basename, const char *ty
 	if (rc == -1)
 		return;
 
+	WCM_PROBE(hotplug, name, type, ser ? ser->serial : UINT_MAX);
 	wcmQueueHotplug(priv, name, type, ser ? ser->serial : UINT_MAX);
 
 	free(name);
@@ -264,7 +265,25 @@ static void wcmTryHotplugSerialType(WacomDevicePtr priv, WacomToolPtr ser, const
 }
 
 /**
- * Hotplug all serial numbers configured on this device.
+ * Hotplug the devices for one serial number configured on this device.
+ *
+ * @param priv The parent device
+ * @param ser The tool pointer
+ * @param basename The kernel device name
+ */
+static void wcmHotplugSerial(WacomDevicePtr priv, WacomToolPtr ser,
+			     const char *basename)
+{
+	wcmLog(priv, W_INFO, "hotplugging serial %u.\n", ser->serial);
+	wcmTryHotplugSerialType(priv, ser, basename, STYLUS_ID, "stylus");
+	wcmTryHotplugSerialType(priv, ser, basename, ERASER_ID, "eraser");
+	wcmTryHotplugSerialType(priv, ser, basename, CURSOR_ID, "cursor");
+	ser->queued = TRUE;
+}
+
+/**
+ * Hotplug all serial numbers configured on this device. With
+ * LazyToolSerials, only remember the name for wcmHotplugSerialOnDemand().
  *
  * @param priv The parent device
  * @param basename The kernel device name
@@ -272,17 +291,70 @@ static void wcmTryHotplugSerialType(WacomDevicePtr priv, WacomToolPtr ser, const
 static void wcmHotplugSerials(WacomDevicePtr priv, const char *basename)
 {
 	WacomCommonPtr  common = priv->common;
-	WacomToolPtr    ser = common->serials;
+	WacomToolPtr    ser;
 
-	while (ser)
+	if (common->wcmLazySerials && common->serials)
 	{
-		wcmLog(priv, W_INFO, "hotplugging serial %u.\n", ser->serial);
-		wcmTryHotplugSerialType(priv, ser, basename, STYLUS_ID, "stylus");
-		wcmTryHotplugSerialType(priv, ser, basename, ERASER_ID, "eraser");
-		wcmTryHotplugSerialType(priv, ser, basename, CURSOR_ID, "cursor");
+		free(common->wcmSerialBasename);
+		common->wcmSerialBasename = strdup(basename);
+		if (!common->wcmSerialTimer)
+			common->wcmSerialTimer = wcmTimerNew();
+		wcmLog(priv, W_INFO, "serial tools will be added on first use.\n");
+		return;
+	}
+
+	for (ser = common->serials; ser; ser = ser->next)
+		wcmHotplugSerial(priv, ser, basename);
+}
 
-		ser = ser->next;
+/* Timer callback, runs on the main thread with the input lock held */
+static uint32_t wcmHotplugWantedSerials(WacomTimerPtr timer, uint32_t millis, void *arg)
+{
+	WacomCommonPtr common = arg;
+	WacomDevicePtr parent;
+	WacomToolPtr ser;
+
+	for (parent = common->wcmDevices; parent; parent = parent->next)
+		if (parent->isParent)
+			break;
+
+	if (!parent)
+		return 0;
+
+	for (ser = common->serials; ser; ser = ser->next)
+	{
+		if (ser->wanted && !ser->queued)
+			wcmHotplugSerial(parent, ser, common->wcmSerialBasename);
+		ser->wanted = FALSE;
 	}
+
+	return 0;
+}
+
+/**
+ * Hotplug the devices for a serial number listed in ToolSerials the first
+ * time it comes into proximity. Events for it go to the generic tool
+ * until its devices are enabled.
+ *
+ * Called from the input thread, so this only marks the serial and leaves
+ * the hotplugging to a timer on the main thread.
+ *
+ * @param common The common struct the serial was seen on
+ * @param serial The tool serial number
+ */
+void wcmHotplugSerialOnDemand(WacomCommonPtr common, unsigned int serial)
+{
+	WacomToolPtr ser;
+
+	for (ser = common->serials; ser; ser = ser->next)
+		if (ser->serial == serial)
+			break;
+
+	if (!ser || ser->queued || ser->wanted || !common->wcmSerialTimer)
+		return;
+
+	ser->wanted = TRUE;
+	wcmTimerSet(common->wcmSerialTimer, 1, wcmHotplugWantedSerials, common);
 }
 
 void wcmHotplugOthers(WacomDevicePtr priv, const char *basename)
@@ -373,6 +445,8 @@ int wcmParseSerials (WacomDevicePtr priv)
 		return 0; /*Parse has been already done*/
 	}
 
+	common->wcmLazySerials = wcmOptGetBool(priv, "LazyToolSerials", FALSE);
+
 	s = wcmOptGetStr(priv, "ToolSerials", NULL);
 	if (s) /*Dont parse again, if the commons have values already*/
 	{
@@ -382,7 +456,7 @@ int wcmParseSerials (WacomDevicePtr priv)
 			int serial, nmatch;
 			char type[strlen(tok) + 1];
 			char name[strlen(tok) + 1];
-			WacomToolPtr ser = calloc(1, sizeof(WacomTool));
+			WacomToolPtr ser = wcmArenaAlloc(common, sizeof(WacomTool));
 
 			if (ser == NULL)
 				return 1;
@@ -392,7 +466,6 @@ int wcmParseSerials (WacomDevicePtr priv)
 			if (nmatch < 1)
 			{
 				wcmLog(priv, W_ERROR, "%s is invalid serial string.\n", tok);
-				free(ser);
 				return 1;
 			}
 
@@ -440,6 +513,12 @@ int wcmParseSerials (WacomDevicePtr priv)
 	return 0;
 }
 
+/* The options that apply to the whole tablet */
+static const char * const shared_option_keys[] = {
+	"Rotate", "RawSample", "Suppress", "PanScrollThreshold",
+	"Threshold", "TapTime", "MaxZ", NULL
+};
+
 /**
  * Parse the pre-init options for this device. Most useful for options
  * needed to properly init a device (baud rate for example).
@@ -461,6 +540,18 @@ Bool wcmPreInitParseOptions(WacomDevicePtr priv, Bool is_primary,
 	int		i;
 	WacomToolPtr    tool = NULL;
 	int		tpc_button_is_on;
+	WacomSharedOptions *shared = &common->wcmSharedOptions;
+
+	/* A dependent carries a copy of the parent's options. It only parses
+	 * the tablet-wide ones again if a section matching just the dependent
+	 * changed one of them, that value then applies to the whole tablet. */
+	if (is_primary)
+	{
+		shared->valid = FALSE;
+		shared->hash = wcmOptHash(priv, shared_option_keys);
+	}
+	else if (is_dependent && shared->valid)
+		priv->sharedOptions = wcmOptHash(priv, shared_option_keys) == shared->hash;
 
 	/* Optional configuration */
 	s = wcmOptGetStr(priv, "Mode", NULL);
@@ -495,7 +586,7 @@ Bool wcmPreInitParseOptions(WacomDevicePtr priv, Bool is_primary,
 		set_absolute(priv, TRUE);
 	}
 
-	s = wcmOptGetStr(priv, "Rotate", NULL);
+	s = priv->sharedOptions ? NULL : wcmOptGetStr(priv, "Rotate", NULL);
 
 	if (s)
 	{
@@ -520,24 +611,27 @@ Bool wcmPreInitParseOptions(WacomDevicePtr priv, Bool is_primary,
 		free(s);
 	}
 
-	common->wcmRawSample = wcmOptGetInt(priv, "RawSample",
-			common->wcmRawSample);
-	if (common->wcmRawSample < 1 || common->wcmRawSample > MAX_SAMPLES)
+	if (!priv->sharedOptions)
 	{
-		wcmLog(priv, W_ERROR,
-			    "RawSample setting '%d' out of range [1..%d]. Using default.\n",
-			    common->wcmRawSample, MAX_SAMPLES);
-		common->wcmRawSample = DEFAULT_SAMPLES;
-	}
+		common->wcmRawSample = wcmOptGetInt(priv, "RawSample",
+				common->wcmRawSample);
+		if (common->wcmRawSample < 1 || common->wcmRawSample > MAX_SAMPLES)
+		{
+			wcmLog(priv, W_ERROR,
+				    "RawSample setting '%d' out of range [1..%d]. Using default.\n",
+				    common->wcmRawSample, MAX_SAMPLES);
+			common->wcmRawSample = DEFAULT_SAMPLES;
+		}
 
-	common->wcmSuppress = wcmOptGetInt(priv, "Suppress",
-			common->wcmSuppress);
-	if (common->wcmSuppress != 0) /* 0 disables suppression */
-	{
-		if (common->wcmSuppress > MAX_SUPPRESS)
-			common->wcmSuppress = MAX_SUPPRESS;
-		if (common->wcmSuppress < DEFAULT_SUPPRESS)
-			common->wcmSuppress = DEFAULT_SUPPRESS;
+		common->wcmSuppress = wcmOptGetInt(priv, "Suppress",
+				common->wcmSuppress);
+		if (common->wcmSuppress != 0) /* 0 disables suppression */
+		{
+			if (common->wcmSuppress > MAX_SUPPRESS)
+				common->wcmSuppress = MAX_SUPPRESS;
+			if (common->wcmSuppress < DEFAULT_SUPPRESS)
+				common->wcmSuppress = DEFAULT_SUPPRESS;
+		}
 	}
 
 	/* pressure curve takes control points x1,y1,x2,y2
@@ -587,8 +681,9 @@ Bool wcmPreInitParseOptions(WacomDevicePtr priv, Bool is_primary,
 	tool = priv->tool;
 	tool->serial = priv->serial;
 
-	common->wcmPanscrollThreshold = wcmOptGetInt(priv, "PanScrollThreshold",
-			common->wcmPanscrollThreshold);
+	if (!priv->sharedOptions)
+		common->wcmPanscrollThreshold = wcmOptGetInt(priv, "PanScrollThreshold",
+				common->wcmPanscrollThreshold);
 
 	/* The first device doesn't need to add any tools/areas as it
 	 * will be the first anyway. So if different, add tool
@@ -617,8 +712,9 @@ Bool wcmPreInitParseOptions(WacomDevicePtr priv, Bool is_primary,
 		}
 	}
 
-	common->wcmThreshold = wcmOptGetInt(priv, "Threshold",
-			common->wcmThreshold);
+	if (!priv->sharedOptions)
+		common->wcmThreshold = wcmOptGetInt(priv, "Threshold",
+				common->wcmThreshold);
 
 	if (wcmOptGetBool(priv, "ButtonsOnly", 0))
 		priv->flags |= BUTTONS_ONLY_FLAG;
@@ -672,9 +768,10 @@ Bool wcmPreInitParseOptions(WacomDevicePtr priv, Bool is_primary,
 			wcmLog(priv, W_WARNING,
 				    "Touch gesture option can only be set by a touch tool.\n");
 
-		common->wcmGestureParameters.wcmTapTime =
-			wcmOptGetInt(priv, "TapTime",
-			common->wcmGestureParameters.wcmTapTime);
+		if (!priv->sharedOptions)
+			common->wcmGestureParameters.wcmTapTime =
+				wcmOptGetInt(priv, "TapTime",
+				common->wcmGestureParameters.wcmTapTime);
 	}
 
 	if (IsStylus(priv) || IsEraser(priv)) {
@@ -731,8 +828,18 @@ Bool wcmPostInitParseOptions(WacomDevicePtr priv, Bool is_primary,
 {
 	WacomCommonPtr  common = priv->common;
 
-	common->wcmMaxZ = wcmOptGetInt(priv, "MaxZ",
-					   common->wcmMaxZ);
+	/* every device's init resets it to the hardware maximum */
+	if (priv->sharedOptions)
+		common->wcmMaxZ = common->wcmSharedOptions.maxZ;
+	else
+		common->wcmMaxZ = wcmOptGetInt(priv, "MaxZ",
+						   common->wcmMaxZ);
+
+	if (is_primary)
+	{
+		common->wcmSharedOptions.maxZ = common->wcmMaxZ;
+		common->wcmSharedOptions.valid = TRUE;
+	}
 
 	/* 2FG touch device */
 	if (TabletHasFeature(common, WCM_2FGT) && IsTouch(priv))
@@ -163,6 +163,43 @@ bool wcmOptCheckBool(WacomDevicePtr priv, const char *key, bool default_value)
 	return !!xf86CheckBoolOption(pInfo->options, key, default_value);
 }
 
+/* FNV-1a of the value, seeded with the key index */
+static uint64_t wcmOptHashValue(int key, const char *value)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL ^ (uint64_t)key;
+
+	while (value && *value)
+	{
+		hash ^= (unsigned char)*value++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* One walk of the option list, the entries are summed since their order
+ * differs between a device and its dependents */
+uint64_t wcmOptHash(WacomDevicePtr priv, const char * const *keys)
+{
+	InputInfoPtr pInfo = priv->frontend;
+	uint64_t hash = 0;
+	pointer o;
+
+	for (o = xf86FirstOption(pInfo->options); o; o = xf86NextOption(o))
+	{
+		const char *name = xf86OptionName(o);
+
+		for (int i = 0; keys[i]; i++)
+		{
+			if (xf86NameCmp(name, keys[i]) == 0)
+			{
+				hash += wcmOptHashValue(i, xf86OptionValue(o));
+				break;
+			}
+		}
+	}
+	return hash;
+}
+
 /* Change the option to the new value */
 void wcmOptSetStr(WacomDevicePtr priv, const char *key, const char *value)
 {
@@ -237,10 +274,8 @@ void wcmTimerSet(WacomTimerPtr timer, uint32_t millis, WacomTimerCallback func,
  */
 static InputOption *wcmOptionDupConvert(WacomDevicePtr priv, const char* name, const char *type, int serial)
 {
-	WacomCommonPtr common = priv->common;
 	InputInfoPtr pInfo = priv->frontend;
 	pointer original = pInfo->options;
-	WacomToolPtr ser = common->serials;
 	InputOption *iopts = NULL;
 	pointer options, o;
 
@@ -249,7 +284,7 @@ static InputOption *wcmOptionDupConvert(WacomDevicePtr priv, const char* name, c
 	options = xf86ReplaceStrOption(options, "Name", name);
 
 	if (serial > -1)
-		options = xf86ReplaceIntOption(options, "Serial", ser->serial);
+		options = xf86ReplaceIntOption(options, "Serial", serial);
 
 	o = options;
 	while(o)
@@ -364,105 +399,188 @@ void wcmQueueHotplug(WacomDevicePtr priv, const char* name, const char *type, un
  ****************************************************************************/
 void wcmEmitKeycode(WacomDevicePtr priv, int keycode, int state)
 {
+	uint64_t start = wcmTimingStart(priv->common);
 	InputInfoPtr pInfo = priv->frontend;
 	DeviceIntPtr keydev = pInfo->dev;
 
+	WCM_PROBE(emit_key, keycode, state);
+	priv->common->wcmStats[WSTAT_EMIT_KEY]++;
 	xf86PostKeyboardEvent (keydev, keycode, state);
-}
-
-static inline int
-valuatorNumber(enum WacomAxisType which)
-{
-	int pos;
-
-	switch (which){
-	case WACOM_AXIS_X: pos = 0; break;
-	case WACOM_AXIS_Y: pos = 1; break;
-	case WACOM_AXIS_PRESSURE: pos = 2; break;
-	case WACOM_AXIS_TILT_X: pos = 3; break;
-	case WACOM_AXIS_TILT_Y: pos = 4; break;
-	case WACOM_AXIS_STRIP_X: pos = 3; break;
-	case WACOM_AXIS_STRIP_Y: pos = 4; break;
-	case WACOM_AXIS_ROTATION: pos = 3; break;
-	case WACOM_AXIS_THROTTLE: pos = 4; break;
-	case WACOM_AXIS_WHEEL: pos = 5; break;
-	case WACOM_AXIS_RING: pos = 5; break;
-	case WACOM_AXIS_RING2: pos = 6; break;
-	case WACOM_AXIS_SCROLL_X: pos = 6; break;
-	case WACOM_AXIS_SCROLL_Y: pos = 7; break;
-		break;
-	default:
-		abort();
-	}
+	wcmTimingEnd(priv->common, WTIME_EMIT, start);
+}
+
+/* The valuator of each axis, these need to match wcmInitAxis */
+static const int valuatorNumbers[WACOM_AXIS_COUNT] = {
+	[0] = 0,	/* x */
+	[1] = 1,	/* y */
+	[2] = 2,	/* pressure */
+	[3] = 3,	/* tilt-x */
+	[4] = 4,	/* tilt-y */
+	[5] = 3,	/* strip-x */
+	[6] = 4,	/* strip-y */
+	[7] = 3,	/* rotation */
+	[8] = 4,	/* throttle */
+	[9] = 5,	/* wheel */
+	[10] = 5,	/* ring */
+	[11] = 6,	/* ring2 */
+	[12] = 6,	/* scroll-x */
+	[13] = 7,	/* scroll-y */
+};
 
-	return pos;
-}
+/* The axes of each valuator, the inverse of valuatorNumbers */
+static const uint32_t valuatorAxes[] = {
+	WACOM_AXIS_X,
+	WACOM_AXIS_Y,
+	WACOM_AXIS_PRESSURE,
+	WACOM_AXIS_TILT_X | WACOM_AXIS_STRIP_X | WACOM_AXIS_ROTATION,
+	WACOM_AXIS_TILT_Y | WACOM_AXIS_STRIP_Y | WACOM_AXIS_THROTTLE,
+	WACOM_AXIS_WHEEL | WACOM_AXIS_RING,
+	WACOM_AXIS_RING2 | WACOM_AXIS_SCROLL_X,
+	WACOM_AXIS_SCROLL_Y,
+};
 
+/* Convert axes into mask from scratch */
 static inline void
 convertAxes(const WacomAxisData *axes, ValuatorMask *mask)
 {
+	uint32_t bits = axes->mask;
+
+	/* Highest axis first, where two axes share a valuator the lower one
+	 * wins */
+	while (bits)
+	{
+		unsigned int n = 31 - __builtin_clz(bits);
 
+		bits &= ~(1u << n);
+		valuator_mask_set(mask, valuatorNumbers[n], axes->value[n]);
+	}
+}
 
-	for (enum WacomAxisType which = _WACOM_AXIS_LAST; which > 0; which >>= 1)
+/**
+ * Bring priv->valuator_mask up to date for axes. Only the valuators of
+ * axes that changed since the last event are touched, for the same axes
+ * (e.g. the button events of a motion) the mask is reused as-is. The
+ * result is the same as convertAxes() into a zeroed mask.
+ */
+static void
+updateValuatorMask(WacomDevicePtr priv, const WacomAxisData *axes)
+{
+	WacomAxisData *posted = &priv->valuator_axes;
+	ValuatorMask *mask = priv->valuator_mask;
+	uint32_t changed = axes->mask ^ posted->mask;
+	uint32_t both = axes->mask & posted->mask;
+	uint32_t valuators = 0;
+
+	while (both)
 	{
-		int value;
-		Bool has_value = wcmAxisGet(axes, which, &value);
-		int pos;
+		unsigned int n = __builtin_ctz(both);
 
-		if (!has_value)
-			continue;
+		both &= both - 1;
+		if (axes->value[n] != posted->value[n])
+			changed |= 1u << n;
+	}
+
+	if (!changed)
+		return;
+
+	while (changed)
+	{
+		unsigned int n = __builtin_ctz(changed);
+
+		changed &= changed - 1;
+		valuators |= 1u << valuatorNumbers[n];
+	}
+
+	/* a valuator shared by several axes takes the lowest one set */
+	while (valuators)
+	{
+		unsigned int v = __builtin_ctz(valuators);
+		uint32_t from = axes->mask & valuatorAxes[v];
 
-		/* Positions need to match wcmInitAxis */
-		pos = valuatorNumber(which);
-		valuator_mask_set(mask, pos, value);
+		valuators &= valuators - 1;
+		if (from)
+			valuator_mask_set(mask, v, axes->value[__builtin_ctz(from)]);
+		else
+			valuator_mask_unset(mask, v);
 	}
+
+	*posted = *axes;
 }
 
 void wcmEmitProximity(WacomDevicePtr priv, bool is_proximity_in,
 		      const WacomAxisData *axes)
 {
+	uint64_t start = wcmTimingStart(priv->common);
 	InputInfoPtr pInfo = priv->frontend;
 
 	ValuatorMask *mask = priv->valuator_mask;
-	valuator_mask_zero(mask);
-	convertAxes(axes, mask);
 
+	updateValuatorMask(priv, axes);
+
+	WCM_PROBE(emit_proximity, is_proximity_in,
+		  axes->value[wcmAxisIndex(WACOM_AXIS_X)],
+		  axes->value[wcmAxisIndex(WACOM_AXIS_Y)]);
+	priv->common->wcmStats[WSTAT_EMIT_PROXIMITY]++;
 	xf86PostProximityEventM(pInfo->dev, is_proximity_in, mask);
+	wcmTimingEnd(priv->common, WTIME_EMIT, start);
 }
 
 void wcmEmitMotion(WacomDevicePtr priv, bool is_absolute, const WacomAxisData *axes)
 {
+	uint64_t start = wcmTimingStart(priv->common);
 	InputInfoPtr pInfo = priv->frontend;
 
 	ValuatorMask *mask = priv->valuator_mask;
-	valuator_mask_zero(mask);
-	convertAxes(axes, mask);
 
+	updateValuatorMask(priv, axes);
+
+	WCM_PROBE(emit_motion, axes->mask,
+		  axes->value[wcmAxisIndex(WACOM_AXIS_X)],
+		  axes->value[wcmAxisIndex(WACOM_AXIS_Y)],
+		  axes->value[wcmAxisIndex(WACOM_AXIS_PRESSURE)]);
+	priv->common->wcmStats[WSTAT_EMIT_MOTION]++;
 	xf86PostMotionEventM(pInfo->dev, is_absolute, mask);
+	wcmTimingEnd(priv->common, WTIME_EMIT, start);
 }
 
 void wcmEmitButton(WacomDevicePtr priv, bool is_absolute, int button, bool is_press, const WacomAxisData *axes)
 {
+	uint64_t start = wcmTimingStart(priv->common);
 	InputInfoPtr pInfo = priv->frontend;
 
 	ValuatorMask *mask = priv->valuator_mask;
-	valuator_mask_zero(mask);
-	convertAxes(axes, mask);
 
+	updateValuatorMask(priv, axes);
 
+	WCM_PROBE(emit_button, button, is_press,
+		  axes->value[wcmAxisIndex(WACOM_AXIS_X)],
+		  axes->value[wcmAxisIndex(WACOM_AXIS_Y)]);
+	priv->common->wcmStats[WSTAT_EMIT_BUTTON]++;
 	xf86PostButtonEventM(pInfo->dev, is_absolute, button, is_press, mask);
+	wcmTimingEnd(priv->common, WTIME_EMIT, start);
 }
 
-void wcmEmitTouch(WacomDevicePtr priv, int type, unsigned int touchid, int x, int y)
+void wcmEmitTouchFrame(WacomDevicePtr priv, const WacomTouchRecord *touches,
+		       unsigned int ntouches)
 {
+	uint64_t start = wcmTimingStart(priv->common);
 	InputInfoPtr pInfo = priv->frontend;
 	/* FIXME: this should be part of this interface here */
 	ValuatorMask *mask = priv->common->touch_mask;
 
-	valuator_mask_set(mask, 0, x);
-	valuator_mask_set(mask, 1, y);
+	WCM_PROBE(emit_touch_frame, ntouches);
+	priv->common->wcmStats[WSTAT_EMIT_TOUCH_FRAME]++;
+	for (unsigned int i = 0; i < ntouches; i++) {
+		const WacomTouchRecord *t = &touches[i];
 
-	xf86PostTouchEvent(pInfo->dev, touchid, type, 0, mask);
+		valuator_mask_set(mask, 0, t->x);
+		valuator_mask_set(mask, 1, t->y);
+
+		WCM_PROBE(emit_touch, t->type, t->touchid, t->x, t->y);
+		priv->common->wcmStats[WSTAT_EMIT_TOUCH]++;
+		xf86PostTouchEvent(pInfo->dev, t->touchid, t->type, 0, mask);
+	}
+	wcmTimingEnd(priv->common, WTIME_EMIT, start);
 }
 
 void wcmNotifyEvdev(WacomDevicePtr priv, const struct input_event *event)
@@ -1109,6 +1227,29 @@ valuator_mask_set(ValuatorMask *mask, int valuator, int data)
 	valuator_mask_set_double(mask, valuator, data);
 }
 
+/**
+ * Remove the valuator from the mask.
+ */
+void
+valuator_mask_unset(ValuatorMask *mask, int valuator)
+{
+	if (mask->last_bit >= valuator) {
+		int i, lastbit = -1;
+
+		ClearBit(mask->mask, valuator);
+		mask->valuators[valuator] = 0.0;
+		mask->unaccelerated[valuator] = 0.0;
+
+		for (i = 0; i <= mask->last_bit; i++)
+			if (valuator_mask_isset(mask, i))
+				lastbit = max(lastbit, i);
+		mask->last_bit = lastbit;
+
+		if (mask->last_bit == -1)
+			mask->has_unaccelerated = FALSE;
+	}
+}
+
 /**
  * Return the requested valuator value as a double. If the mask bit is not
  * set for the given valuator, the returned value is undefined.
@@ -1216,6 +1357,51 @@ TEST_CASE(test_convert_axes)
 	free(mask);
 }
 
+TEST_CASE(test_update_valuator_mask)
+{
+	WacomDeviceRec priv = {0};
+	ValuatorMask *expected = valuator_mask_new(8);
+	WacomAxisData axes = {0};
+	/* a pen, a cursor, a pad and everything sharing valuators */
+	const uint32_t masks[] = {
+		WACOM_AXIS_X | WACOM_AXIS_Y | WACOM_AXIS_PRESSURE |
+			WACOM_AXIS_TILT_X | WACOM_AXIS_TILT_Y | WACOM_AXIS_WHEEL,
+		WACOM_AXIS_X | WACOM_AXIS_Y | WACOM_AXIS_PRESSURE |
+			WACOM_AXIS_ROTATION | WACOM_AXIS_THROTTLE,
+		WACOM_AXIS_STRIP_X | WACOM_AXIS_STRIP_Y | WACOM_AXIS_RING |
+			WACOM_AXIS_RING2,
+		WACOM_AXIS_SCROLL_X | WACOM_AXIS_SCROLL_Y,
+		(_WACOM_AXIS_LAST << 1) - 1,
+		0,
+	};
+	unsigned int seed = 1;
+
+	priv.valuator_mask = valuator_mask_new(8);
+
+	for (int i = 0; i < 20000; i++)
+	{
+		/* mostly the same axes with a few values changing, the
+		 * same axes again now and then */
+		if (rand_r(&seed) % 8 == 0)
+			axes.mask = masks[rand_r(&seed) % ARRAY_SIZE(masks)];
+		if (rand_r(&seed) % 4 == 0)
+			axes.mask ^= 1u << (rand_r(&seed) % WACOM_AXIS_COUNT);
+		if (rand_r(&seed) % 4)
+			for (unsigned int n = 0; n < WACOM_AXIS_COUNT; n++)
+				if (rand_r(&seed) % 3 == 0)
+					axes.value[n] = rand_r(&seed) % 5 - 2;
+
+		updateValuatorMask(&priv, &axes);
+
+		valuator_mask_zero(expected);
+		convertAxes(&axes, expected);
+		assert(memcmp(priv.valuator_mask, expected, sizeof(*expected)) == 0);
+	}
+
+	free(priv.valuator_mask);
+	free(expected);
+}
+
 #endif
 
 /* vim: set noexpandtab tabstop=8 shiftwidth=8: */
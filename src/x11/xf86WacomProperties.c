@@ -58,9 +58,26 @@ static Atom prop_btnactions;
 static Atom prop_product_id;
 static Atom prop_pressure_recal;
 static Atom prop_panscroll_threshold;
+static Atom prop_statistics;
+static Atom prop_recorder;
 #ifdef DEBUG
 static Atom prop_debuglevels;
 #endif
+#ifdef BUILD_TIMING_HISTOGRAMS
+static Atom prop_timing;
+static Atom prop_timing_histograms;
+#endif
+
+/* Atoms of the per-button, strip and wheel action properties */
+static Atom btn_action_atoms[WCM_MAX_BUTTONS];
+static Atom strip_action_atoms[4];
+static Atom wheel_action_atoms[6];
+
+/* Counters as last copied into the statistics property, see wcmGetProperty */
+static uint32_t stats_snapshot[WSTAT_COUNT];
+#ifdef BUILD_TIMING_HISTOGRAMS
+static uint32_t timing_snapshot[WTIME_COUNT][WTIME_BUCKETS];
+#endif
 
 /**
  * Calculate a user-visible pressure level from a driver-internal pressure
@@ -82,15 +99,82 @@ static inline int wcmUserToInternalPressure(WacomDevicePtr priv, int pressure)
 	return pressure * (priv->maxCurve / 2048);
 }
 
+static Atom wcmMakeAtom(const char *name)
+{
+	return MakeAtom(name, strlen(name), TRUE);
+}
+
+/**
+ * Intern the atoms of all our properties. They are the same for every
+ * device, so this is only done once per server generation (atoms are
+ * reset when the server regenerates).
+ */
+static void wcmInternAtoms(void)
+{
+	static unsigned long generation;
+	char name[64];
+	size_t i;
+
+	if (generation == serverGeneration)
+		return;
+	generation = serverGeneration;
+
+	prop_devnode = wcmMakeAtom(XI_PROP_DEVICE_NODE);
+	prop_tablet_area = wcmMakeAtom(WACOM_PROP_TABLET_AREA);
+	prop_rotation = wcmMakeAtom(WACOM_PROP_ROTATION);
+	prop_pressurecurve = wcmMakeAtom(WACOM_PROP_PRESSURECURVE);
+	prop_serials = wcmMakeAtom(WACOM_PROP_SERIALIDS);
+	prop_serial_binding = wcmMakeAtom(WACOM_PROP_SERIAL_BIND);
+	prop_proxout = wcmMakeAtom(WACOM_PROP_PROXIMITY_THRESHOLD);
+	prop_threshold = wcmMakeAtom(WACOM_PROP_PRESSURE_THRESHOLD);
+	prop_suppress = wcmMakeAtom(WACOM_PROP_SAMPLE);
+	prop_touch = wcmMakeAtom(WACOM_PROP_TOUCH);
+	prop_hardware_touch = wcmMakeAtom(WACOM_PROP_HARDWARE_TOUCH);
+	prop_hover = wcmMakeAtom(WACOM_PROP_HOVER);
+	prop_gesture = wcmMakeAtom(WACOM_PROP_ENABLE_GESTURE);
+	prop_gesture_param = wcmMakeAtom(WACOM_PROP_GESTURE_PARAMETERS);
+	prop_tooltype = wcmMakeAtom(WACOM_PROP_TOOL_TYPE);
+	prop_btnactions = wcmMakeAtom(WACOM_PROP_BUTTON_ACTIONS);
+	prop_strip_buttons = wcmMakeAtom(WACOM_PROP_STRIPBUTTONS);
+	prop_wheel_buttons = wcmMakeAtom(WACOM_PROP_WHEELBUTTONS);
+	prop_pressure_recal = wcmMakeAtom(WACOM_PROP_PRESSURE_RECAL);
+	prop_panscroll_threshold = wcmMakeAtom(WACOM_PROP_PANSCROLL_THRESHOLD);
+	prop_product_id = wcmMakeAtom(XI_PROP_PRODUCT_ID);
+	prop_statistics = wcmMakeAtom(WACOM_PROP_STATISTICS);
+	prop_recorder = wcmMakeAtom(WACOM_PROP_RECORDER);
+#ifdef DEBUG
+	prop_debuglevels = wcmMakeAtom(WACOM_PROP_DEBUGLEVELS);
+#endif
+#ifdef BUILD_TIMING_HISTOGRAMS
+	prop_timing = wcmMakeAtom(WACOM_PROP_TIMING);
+	prop_timing_histograms = wcmMakeAtom(WACOM_PROP_TIMING_HISTOGRAMS);
+#endif
+
+	for (i = 0; i < ARRAY_SIZE(btn_action_atoms); i++)
+	{
+		sprintf(name, "Wacom button action %zu", i);
+		btn_action_atoms[i] = wcmMakeAtom(name);
+	}
+	for (i = 0; i < ARRAY_SIZE(strip_action_atoms); i++)
+	{
+		sprintf(name, "Wacom strip action %zu", i);
+		strip_action_atoms[i] = wcmMakeAtom(name);
+	}
+	for (i = 0; i < ARRAY_SIZE(wheel_action_atoms); i++)
+	{
+		sprintf(name, "Wacom wheel action %zu", i);
+		wheel_action_atoms[i] = wcmMakeAtom(name);
+	}
+}
+
 /**
  * Resets an arbitrary Action property, given a pointer to the old
  * handler and information about the new Action.
  */
-static void wcmInitActionProp(WacomDevicePtr priv, const char *name,
+static void wcmInitActionProp(WacomDevicePtr priv, Atom prop,
 			      Atom *handler, WacomAction *action)
 {
 	InputInfoPtr pInfo = priv->frontend;
-	Atom prop = MakeAtom(name, strlen(name), TRUE);
 	size_t sz = wcmActionSize(action);
 
 	XIChangeDeviceProperty(pInfo->dev, prop, XA_INTEGER, 32,
@@ -100,48 +184,37 @@ static void wcmInitActionProp(WacomDevicePtr priv, const char *name,
 
 static void wcmInitButtonActionProp(WacomDevicePtr priv, int button)
 {
-	char name[64];
-
-	sprintf(name, "Wacom button action %d", button);
-	wcmInitActionProp(priv, name, &priv->btn_action_props[button], &priv->key_actions[button]);
+	wcmInitActionProp(priv, btn_action_atoms[button], &priv->btn_action_props[button], &priv->key_actions[button]);
 }
 
 static void wcmInitStripActionProp(WacomDevicePtr priv, int index)
 {
-	char name[64];
-
-	sprintf(name, "Wacom strip action %d", index);
-	wcmInitActionProp(priv, name, &priv->strip_action_props[index], &priv->strip_actions[index]);
+	wcmInitActionProp(priv, strip_action_atoms[index], &priv->strip_action_props[index], &priv->strip_actions[index]);
 }
 
 static void wcmInitWheelActionProp(WacomDevicePtr priv, int index)
 {
-	char name[64];
-
-	sprintf(name, "Wacom wheel action %d", index);
-	wcmInitActionProp(priv, name, &priv->wheel_action_props[index], &priv->wheel_actions[index]);
+	wcmInitActionProp(priv, wheel_action_atoms[index], &priv->wheel_action_props[index], &priv->wheel_actions[index]);
 }
 
 /**
- * Registers a property for the input device. This function registers
- * the property name atom, as well as creates the property itself.
+ * Creates a property on the input device. The atom must have been
+ * interned already, see wcmInternAtoms().
  * At creation, the property values are initialized from the 'values'
  * array. The device property is marked as non-deletable.
  * Initialization values are always to be provided by means of an
  * array of 32 bit integers, regardless of 'format'
  *
  * @param dev Pointer to device structure
- * @param name Name of device property
+ * @param atom Atom of the property name
  * @param type Type of the property
  * @param format Format of the property (8/16/32)
  * @param nvalues Number of values in the property
  * @param values Pointer to 32 bit integer array of initial property values
- * @return Atom handle of property name
  */
-static Atom InitWcmAtom(DeviceIntPtr dev, const char *name, Atom type, int format, int nvalues, int *values)
+static void InitWcmAtom(DeviceIntPtr dev, Atom atom, Atom type, int format, int nvalues, int *values)
 {
 	int i;
-	Atom atom;
 	uint8_t val_8[WCM_MAX_BUTTONS];
 	uint16_t val_16[WCM_MAX_BUTTONS];
 	uint32_t val_32[WCM_MAX_BUTTONS];
@@ -164,12 +237,10 @@ static Atom InitWcmAtom(DeviceIntPtr dev, const char *name, Atom type, int forma
 		case 32: converted = val_32; break;
 	}
 
-	atom = MakeAtom(name, strlen(name), TRUE);
 	XIChangeDeviceProperty(dev, atom, type, format,
 			PropModeReplace, nvalues,
 			converted, FALSE);
 	XISetDevicePropertyDeletable(dev, atom, FALSE);
-	return atom;
 }
 
 void InitWcmDeviceProperties(WacomDevicePtr priv)
@@ -181,7 +252,8 @@ void InitWcmDeviceProperties(WacomDevicePtr priv)
 
 	DBG(10, priv, "\n");
 
-	prop_devnode = MakeAtom(XI_PROP_DEVICE_NODE, strlen(XI_PROP_DEVICE_NODE), TRUE);
+	wcmInternAtoms();
+
 	XIChangeDeviceProperty(pInfo->dev, prop_devnode, XA_STRING, 8,
 				PropModeReplace, strlen(common->device_path),
 				common->device_path, FALSE);
@@ -192,12 +264,12 @@ void InitWcmDeviceProperties(WacomDevicePtr priv)
 		values[1] = priv->topY;
 		values[2] = priv->bottomX;
 		values[3] = priv->bottomY;
-		prop_tablet_area = InitWcmAtom(pInfo->dev, WACOM_PROP_TABLET_AREA, XA_INTEGER, 32, 4, values);
+		InitWcmAtom(pInfo->dev, prop_tablet_area, XA_INTEGER, 32, 4, values);
 	}
 
 	values[0] = common->wcmRotate;
 	if (!IsPad(priv)) {
-		prop_rotation = InitWcmAtom(pInfo->dev, WACOM_PROP_ROTATION, XA_INTEGER, 8, 1, values);
+		InitWcmAtom(pInfo->dev, prop_rotation, XA_INTEGER, 8, 1, values);
 	}
 
 	if (IsPen(priv) || IsTouch(priv)) {
@@ -205,7 +277,7 @@ void InitWcmDeviceProperties(WacomDevicePtr priv)
 		values[1] = priv->nPressCtrl[1];
 		values[2] = priv->nPressCtrl[2];
 		values[3] = priv->nPressCtrl[3];
-		prop_pressurecurve = InitWcmAtom(pInfo->dev, WACOM_PROP_PRESSURECURVE, XA_INTEGER, 32, 4, values);
+		InitWcmAtom(pInfo->dev, prop_pressurecurve, XA_INTEGER, 32, 4, values);
 	}
 
 	values[0] = common->tablet_id;
@@ -213,57 +285,57 @@ void InitWcmDeviceProperties(WacomDevicePtr priv)
 	values[2] = priv->oldState.device_id;
 	values[3] = priv->cur_serial;
 	values[4] = priv->cur_device_id;
-	prop_serials = InitWcmAtom(pInfo->dev, WACOM_PROP_SERIALIDS, XA_INTEGER, 32, 5, values);
+	InitWcmAtom(pInfo->dev, prop_serials, XA_INTEGER, 32, 5, values);
 
 	values[0] = priv->serial;
-	prop_serial_binding = InitWcmAtom(pInfo->dev, WACOM_PROP_SERIAL_BIND, XA_INTEGER, 32, 1, values);
+	InitWcmAtom(pInfo->dev, prop_serial_binding, XA_INTEGER, 32, 1, values);
 
 	if (IsTablet(priv)) {
 		values[0] = priv->wcmProxoutDist;
-		prop_proxout = InitWcmAtom(pInfo->dev, WACOM_PROP_PROXIMITY_THRESHOLD, XA_INTEGER, 32, 1, values);
+		InitWcmAtom(pInfo->dev, prop_proxout, XA_INTEGER, 32, 1, values);
 	}
 
 	values[0] = (!common->wcmMaxZ) ? 0 : common->wcmThreshold;
 	values[0] = wcmInternalToUserPressure(priv, values[0]);
-	prop_threshold = InitWcmAtom(pInfo->dev, WACOM_PROP_PRESSURE_THRESHOLD, XA_INTEGER, 32, 1, values);
+	InitWcmAtom(pInfo->dev, prop_threshold, XA_INTEGER, 32, 1, values);
 
 	values[0] = common->wcmSuppress;
 	values[1] = common->wcmRawSample;
-	prop_suppress = InitWcmAtom(pInfo->dev, WACOM_PROP_SAMPLE, XA_INTEGER, 32, 2, values);
+	InitWcmAtom(pInfo->dev, prop_suppress, XA_INTEGER, 32, 2, values);
 
 	values[0] = common->wcmTouch;
-	prop_touch = InitWcmAtom(pInfo->dev, WACOM_PROP_TOUCH, XA_INTEGER, 8, 1, values);
+	InitWcmAtom(pInfo->dev, prop_touch, XA_INTEGER, 8, 1, values);
 
 	if (common->wcmHasHWTouchSwitch && IsTouch(priv)) {
 		values[0] = common->wcmHWTouchSwitchState;
-		prop_hardware_touch = InitWcmAtom(pInfo->dev, WACOM_PROP_HARDWARE_TOUCH, XA_INTEGER, 8, 1, values);
+		InitWcmAtom(pInfo->dev, prop_hardware_touch, XA_INTEGER, 8, 1, values);
 	}
 
 	if (IsStylus(priv)) {
 		values[0] = !common->wcmTPCButton;
-		prop_hover = InitWcmAtom(pInfo->dev, WACOM_PROP_HOVER, XA_INTEGER, 8, 1, values);
+		InitWcmAtom(pInfo->dev, prop_hover, XA_INTEGER, 8, 1, values);
 	}
 
 	values[0] = common->wcmGesture;
-	prop_gesture = InitWcmAtom(pInfo->dev, WACOM_PROP_ENABLE_GESTURE, XA_INTEGER, 8, 1, values);
+	InitWcmAtom(pInfo->dev, prop_gesture, XA_INTEGER, 8, 1, values);
 
 	values[0] = common->wcmGestureParameters.wcmZoomDistance;
 	values[1] = common->wcmGestureParameters.wcmScrollDistance;
 	values[2] = common->wcmGestureParameters.wcmTapTime;
-	prop_gesture_param = InitWcmAtom(pInfo->dev, WACOM_PROP_GESTURE_PARAMETERS, XA_INTEGER, 32, 3, values);
+	InitWcmAtom(pInfo->dev, prop_gesture_param, XA_INTEGER, 32, 3, values);
 
 	values[0] = MakeAtom(pInfo->type_name, strlen(pInfo->type_name), TRUE);
-	prop_tooltype = InitWcmAtom(pInfo->dev, WACOM_PROP_TOOL_TYPE, XA_ATOM, 32, 1, values);
+	InitWcmAtom(pInfo->dev, prop_tooltype, XA_ATOM, 32, 1, values);
 
 	for (i = 0; i < priv->nbuttons; i++)
 		wcmInitButtonActionProp(priv, i);
-	prop_btnactions = InitWcmAtom(pInfo->dev, WACOM_PROP_BUTTON_ACTIONS, XA_ATOM, 32,
+	InitWcmAtom(pInfo->dev, prop_btnactions, XA_ATOM, 32,
 				      priv->nbuttons, (int*)priv->btn_action_props);
 
 	if (IsPad(priv)) {
 		for (i = 0; i < 4; i++)
 			wcmInitStripActionProp(priv, i);
-		prop_strip_buttons = InitWcmAtom(pInfo->dev, WACOM_PROP_STRIPBUTTONS, XA_ATOM, 32,
+		InitWcmAtom(pInfo->dev, prop_strip_buttons, XA_ATOM, 32,
 						 4, (int*)priv->strip_action_props);
 	}
 
@@ -271,28 +343,44 @@ void InitWcmDeviceProperties(WacomDevicePtr priv)
 	{
 		for (i = 0; i < 6; i++)
 			wcmInitWheelActionProp(priv, i);
-		prop_wheel_buttons = InitWcmAtom(pInfo->dev, WACOM_PROP_WHEELBUTTONS, XA_ATOM, 32,
+		InitWcmAtom(pInfo->dev, prop_wheel_buttons, XA_ATOM, 32,
 						 6, (int*)priv->wheel_action_props);
 	}
 
 	if (IsStylus(priv) || IsEraser(priv)) {
 		values[0] = common->wcmPressureRecalibration;
-		prop_pressure_recal = InitWcmAtom(pInfo->dev,
-						  WACOM_PROP_PRESSURE_RECAL,
-						  XA_INTEGER, 8, 1, values);
+		InitWcmAtom(pInfo->dev, prop_pressure_recal, XA_INTEGER, 8, 1, values);
 	}
 
 	values[0] = common->wcmPanscrollThreshold;
-	prop_panscroll_threshold = InitWcmAtom(pInfo->dev, WACOM_PROP_PANSCROLL_THRESHOLD, XA_INTEGER, 32, 1, values);
+	InitWcmAtom(pInfo->dev, prop_panscroll_threshold, XA_INTEGER, 32, 1, values);
 
 	values[0] = common->vendor_id;
 	values[1] = common->tablet_id;
-	prop_product_id = InitWcmAtom(pInfo->dev, XI_PROP_PRODUCT_ID, XA_INTEGER, 32, 2, values);
+	InitWcmAtom(pInfo->dev, prop_product_id, XA_INTEGER, 32, 2, values);
+
+	for (i = 0; i < WSTAT_COUNT; i++)
+		values[i] = common->wcmStats[i];
+	InitWcmAtom(pInfo->dev, prop_statistics, XA_INTEGER, 32, WSTAT_COUNT, values);
+
+	values[0] = 0;
+	InitWcmAtom(pInfo->dev, prop_recorder, XA_INTEGER, 8, 1, values);
 
 #ifdef DEBUG
 	values[0] = priv->debugLevel;
 	values[1] = common->debugLevel;
-	prop_debuglevels = InitWcmAtom(pInfo->dev, WACOM_PROP_DEBUGLEVELS, XA_INTEGER, 8, 2, values);
+	InitWcmAtom(pInfo->dev, prop_debuglevels, XA_INTEGER, 8, 2, values);
+#endif
+
+#ifdef BUILD_TIMING_HISTOGRAMS
+	values[0] = common->wcmTimingEnabled;
+	InitWcmAtom(pInfo->dev, prop_timing, XA_INTEGER, 8, 1, values);
+
+	/* too many values for InitWcmAtom */
+	XIChangeDeviceProperty(pInfo->dev, prop_timing_histograms, XA_INTEGER, 32,
+				PropModeReplace, WTIME_COUNT * WTIME_BUCKETS,
+				common->wcmTiming, FALSE);
+	XISetDevicePropertyDeletable(pInfo->dev, prop_timing_histograms, FALSE);
 #endif
 
 	XIRegisterPropertyHandler(pInfo->dev, wcmSetProperty, wcmGetProperty, wcmDeleteProperty);
@@ -437,7 +525,7 @@ static int wcmSetActionProperty(DeviceIntPtr dev, Atom property,
 {
 	InputInfoPtr pInfo = (InputInfoPtr) dev->public.devicePrivate;
 	WacomDevicePtr priv = (WacomDevicePtr) pInfo->private;
-	int rc, i;
+	int rc;
 
 	DBG(5, priv, "%s new actions for Atom %u\n", checkonly ? "Checking" : "Setting", property);
 
@@ -457,12 +545,18 @@ static int wcmSetActionProperty(DeviceIntPtr dev, Atom property,
 
 	if (!checkonly)
 	{
-		WacomAction act = {};
+		Bool ok;
 
-		for (i = 0; i < prop->size; i++)
-			wcmActionSet(&act, i, ((unsigned int*)prop->data)[i]);
-
-		wcmActionCopy(action, &act);
+		/* the input thread may be running the old program */
+#if HAVE_THREADED_INPUT
+		input_lock();
+#endif
+		ok = wcmActionCompile(action, (unsigned int*)prop->data, prop->size);
+#if HAVE_THREADED_INPUT
+		input_unlock();
+#endif
+		if (!ok)
+			return BadAlloc;
 		*handler = property;
 	}
 
@@ -544,6 +638,9 @@ static int wcmSetActionsProperty(DeviceIntPtr dev, Atom property,
 		{ /* Interpret 'None' as meaning 'reset' */
 			if (!checkonly)
 			{
+#if HAVE_THREADED_INPUT
+				input_lock();
+#endif
 				if (property == prop_btnactions)
 				{
 					wcmResetButtonAction(priv, index);
@@ -556,6 +653,9 @@ static int wcmSetActionsProperty(DeviceIntPtr dev, Atom property,
 					wcmResetWheelAction(priv, index);
 					wcmInitWheelActionProp(priv, index);
 				}
+#if HAVE_THREADED_INPUT
+				input_unlock();
+#endif
 			}
 		}
 		else
@@ -676,9 +776,31 @@ static int wcmSetProperty(DeviceIntPtr dev, Atom property, XIPropertyValuePtr pr
 	WacomCommonPtr common = priv->common;
 
 	DBG(10, priv, "\n");
+	WCM_PROBE(property, priv->name, property, checkonly);
 
 	if (property == prop_devnode || property == prop_product_id)
 		return BadValue; /* Read-only */
+	else if (property == prop_statistics)
+	{
+		/* This property is read-only but refreshed by wcmGetProperty
+		 * with the snapshot we took there. */
+		if (prop->size == WSTAT_COUNT && prop->format == 32 &&
+		    memcmp(prop->data, stats_snapshot, sizeof(stats_snapshot)) == 0)
+			return Success;
+
+		return BadValue; /* Read-only */
+	}
+#ifdef BUILD_TIMING_HISTOGRAMS
+	else if (property == prop_timing_histograms)
+	{
+		/* Same as prop_statistics */
+		if (prop->size == WTIME_COUNT * WTIME_BUCKETS && prop->format == 32 &&
+		    memcmp(prop->data, timing_snapshot, sizeof(timing_snapshot)) == 0)
+			return Success;
+
+		return BadValue; /* Read-only */
+	}
+#endif
 	else if (property == prop_tablet_area)
 	{
 		INT32 *values = (INT32*)prop->data;
@@ -701,6 +823,7 @@ static int wcmSetProperty(DeviceIntPtr dev, Atom property, XIPropertyValuePtr pr
 			priv->topY = values[1];
 			priv->bottomX = values[2];
 			priv->bottomY = values[3];
+			wcmUpdateTransform(priv);
 		}
 	} else if (property == prop_pressurecurve)
 	{
@@ -905,11 +1028,51 @@ static int wcmSetProperty(DeviceIntPtr dev, Atom property, XIPropertyValuePtr pr
 			priv->debugLevel = values[0];
 			common->debugLevel = values[1];
 		}
+#endif
+#ifdef BUILD_TIMING_HISTOGRAMS
+	} else if (property == prop_timing)
+	{
+		CARD8 *values = (CARD8*)prop->data;
+
+		if (prop->size != 1 || prop->format != 8)
+			return BadValue;
+
+		if ((values[0] != 0) && (values[0] != 1))
+			return BadValue;
+
+		if (!checkonly)
+			wcmTimingSetEnabled(common, values[0]);
 #endif
 	} else if (property == prop_btnactions)
 	{
 		int nbuttons = priv->nbuttons < 4 ? priv->nbuttons : priv->nbuttons + 4;
 		return wcmSetActionsProperty(dev, property, prop, checkonly, nbuttons, priv->btn_action_props, priv->key_actions);
+	} else if (property == prop_recorder)
+	{
+		CARD8 *values = (CARD8*)prop->data;
+
+		if (prop->size != 1 || prop->format != 8)
+			return BadValue;
+
+		if ((values[0] != 0) && (values[0] != 1))
+			return BadValue;
+
+		if (!checkonly && values[0])
+		{
+			int rc;
+
+#if HAVE_THREADED_INPUT
+			input_lock();
+#endif
+			rc = wcmDumpRecorder(priv, "requested");
+#if HAVE_THREADED_INPUT
+			input_unlock();
+#endif
+			if (rc == -EBUSY)
+				return BadAccess;
+			if (rc == -ENOTSUP)
+				return BadMatch;
+		}
 	} else if (property == prop_pressure_recal)
 	{
 		CARD8 *values = (CARD8*)prop->data;
@@ -1006,6 +1169,24 @@ static int wcmGetProperty (DeviceIntPtr dev, Atom property)
 		                              PropModeReplace, nbuttons,
 		                              x11_btn_action_props, FALSE);
 	}
+	else if (property == prop_statistics)
+	{
+		memcpy(stats_snapshot, common->wcmStats, sizeof(stats_snapshot));
+
+		return XIChangeDeviceProperty(dev, property, XA_INTEGER, 32,
+					      PropModeReplace, WSTAT_COUNT,
+					      stats_snapshot, FALSE);
+	}
+#ifdef BUILD_TIMING_HISTOGRAMS
+	else if (property == prop_timing_histograms)
+	{
+		memcpy(timing_snapshot, common->wcmTiming, sizeof(timing_snapshot));
+
+		return XIChangeDeviceProperty(dev, property, XA_INTEGER, 32,
+					      PropModeReplace, WTIME_COUNT * WTIME_BUCKETS,
+					      timing_snapshot, FALSE);
+	}
+#endif
 	else if (property == prop_strip_buttons)
 	{
 		return XIChangeDeviceProperty(dev, property, XA_ATOM, 32,
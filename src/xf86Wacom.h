@@ -26,6 +26,8 @@
 
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include <xf86.h>
 #include <xf86Xinput.h>
@@ -69,6 +71,32 @@
 #define DBG(lvl, priv, ...) do {} while(0)
 #endif
 
+/******************************************************************************
+ * Tracing support
+ *****************************************************************************/
+
+/* USDT probes for bpftrace/perf/systemtap, provider "wacom". Probe names
+ * and their arguments are a stable interface, see tools/wacom-*.bt for
+ * examples. Arguments are evaluated even when no tracer is attached, so
+ * keep them cheap.
+ *
+ * frame_start(nevents), frame_end(nevents, 0 if the frame was dropped)
+ * channel(channel, device_type, serial)
+ * event(channel, device_type, serial, x, y, pressure, time_ms)
+ * suppress(serial, enum WacomSuppressMode)
+ * emit_proximity(in, x, y), emit_motion(axis mask, x, y, pressure),
+ * emit_button(button, is_press, x, y), emit_key(keycode, state),
+ * emit_touch(type, touchid, x, y), emit_touch_frame(ntouches)
+ * hotplug(name, type, serial)
+ * property(device name, atom, checkonly) - X11 only
+ */
+#ifdef BUILD_USDT_PROBES
+#include <sys/sdt.h>
+#define WCM_PROBE(name, ...) STAP_PROBEV(wacom, name, ##__VA_ARGS__)
+#else
+#define WCM_PROBE(name, ...) do {} while(0)
+#endif
+
 /* The rest are defined in a separate .h-file */
 #include "xf86WacomDefs.h"
 
@@ -121,6 +149,7 @@ extern int wcmIsDuplicate(const char* device, WacomDevicePtr priv);
 /* hotplug */
 extern int wcmNeedAutoHotplug(WacomDevicePtr priv, char **type);
 extern void wcmHotplugOthers(WacomDevicePtr priv, const char *basename);
+extern void wcmHotplugSerialOnDemand(WacomCommonPtr common, unsigned int serial);
 
 /* setup */
 extern Bool wcmPreInitParseOptions(WacomDevicePtr priv, Bool is_primary, Bool is_dependent);
@@ -138,12 +167,14 @@ extern void wcmDisableTool(WacomDevicePtr priv);
 extern void wcmUnlinkTouchAndPen(WacomDevicePtr priv);
 
 /* run-time modifications */
-extern int wcmTilt2R(int x, int y, double offset);
+extern int wcmTilt2R(int x, int y, int offset);
 extern void wcmSoftOutEvent(WacomDevicePtr priv);
 extern void wcmCancelGesture(WacomDevicePtr priv);
 
 extern void wcmRotateTablet(WacomDevicePtr priv, int value);
 extern void wcmRotateAndScaleCoordinates(WacomDevicePtr priv, int* x, int* y);
+extern void wcmUpdateTransform(WacomDevicePtr priv);
+extern void wcmTransformSamples(WacomDevicePtr priv, const WacomSamples *samples, size_t n);
 
 extern int wcmCheckPressureCurveValues(int x0, int y0, int x1, int y1);
 extern int wcmGetPhyDeviceID(WacomDevicePtr priv);
@@ -157,29 +188,84 @@ extern void set_absolute(WacomDevicePtr priv, Bool absolute);
 extern WacomCommonPtr wcmRefCommon(WacomCommonPtr common);
 extern void wcmFreeCommon(WacomCommonPtr *common);
 extern WacomCommonPtr wcmNewCommon(void);
+extern void *wcmArenaAlloc(WacomCommonPtr common, size_t size);
+extern Bool wcmSetChannelCount(WacomCommonPtr common, unsigned int count);
+extern void wcmRegisterCommon(WacomCommonPtr common, const struct stat *st);
+extern int wcmForeachNodeDevice(WacomDevicePtr priv, const struct stat *st,
+				WacomDeviceCallback func, void *data);
 extern size_t wcmListModels(const char **names, size_t len);
 extern int wcmScaleAxis(int Cx, int to_max, int to_min, int from_max, int from_min);
+extern void wcmScaleInit(WacomScale *scale, int to_max, int to_min, int from_max, int from_min);
+extern int wcmScaleApply(const WacomScale *scale, int Cx);
+extern void wcmScaleApplyBatch(const WacomScale *scale, const int *in, int *out, size_t n);
+
+extern Bool wcmActionCompile(WacomAction *action, const unsigned *data, size_t len);
+extern void wcmActionFree(WacomAction *action);
 
-static inline void wcmActionCopy(WacomAction *dest, WacomAction *src)
-{
-	memset(dest, 0, sizeof(*dest));
-	memcpy(dest, src, sizeof(*src));
-}
 static inline const unsigned* wcmActionData(const WacomAction *action)
 {
-	return action->action;
+	return action->program;
 }
 static inline size_t wcmActionSize(const WacomAction *action)
 {
 	return action->nactions;
 }
-static inline void wcmActionSet(WacomAction *action, unsigned idx, unsigned act)
+static inline const unsigned* wcmActionReleases(const WacomAction *action)
+{
+	return action->program + action->nactions;
+}
+static inline size_t wcmActionReleaseSize(const WacomAction *action)
+{
+	return action->nreleases;
+}
+
+/* Histogram bucket for a duration in ns, see enum WacomTimingStage */
+static inline int wcmTimingBucket(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+
+	while (us && bucket < WTIME_BUCKETS - 1)
+	{
+		us >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+#ifdef BUILD_TIMING_HISTOGRAMS
+static inline uint64_t wcmTimingNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Returns 0 if timing is disabled, pass the result to wcmTimingEnd */
+static inline uint64_t wcmTimingStart(WacomCommonPtr common)
+{
+	return common->wcmTimingEnabled ? wcmTimingNow() : 0;
+}
+
+static inline void wcmTimingEnd(WacomCommonPtr common, enum WacomTimingStage stage,
+				uint64_t start)
 {
-	if (idx >= ARRAY_SIZE(action->action))
-		return;
-	action->action[idx] = act;
-	action->nactions = idx + 1;
+	if (start)
+		common->wcmTiming[stage][wcmTimingBucket(wcmTimingNow() - start)]++;
 }
+#else
+static inline uint64_t wcmTimingStart(WacomCommonPtr common) { return 0; }
+static inline void wcmTimingEnd(WacomCommonPtr common, enum WacomTimingStage stage,
+				uint64_t start) {}
+#endif
+
+extern void wcmTimingSetEnabled(WacomCommonPtr common, Bool enabled);
+
+/* Dump the raw input flight recorder to a file, if the device class has one.
+ * Call with the input lock held; returns -EBUSY while rate-limited. */
+extern int wcmDumpRecorder(WacomDevicePtr priv, const char *reason);
 
 enum WacomSuppressMode {
 	SUPPRESS_NONE = 8,	/* Process event normally */
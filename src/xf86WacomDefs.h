@@ -85,6 +85,7 @@ typedef struct _WacomCommonRec WacomCommonRec;
 typedef struct _WacomFilterState WacomFilterState, *WacomFilterStatePtr;
 typedef struct _WacomHWClass WacomHWClass, *WacomHWClassPtr;
 typedef struct _WacomTool WacomTool, *WacomToolPtr;
+typedef struct _WacomGestureOps WacomGestureOps;
 
 /******************************************************************************
  * WacomModel - model-specific device capabilities
@@ -220,11 +221,49 @@ static const struct _WacomDeviceState OUTPROX_STATE = {
   .abswheel2 = INT_MAX
 };
 
+/* A compiled action, see wcmActionCompile(). program holds the actions
+ * as set, followed by the releases to send when the button goes up. */
 typedef struct {
-	unsigned action[WCM_MAX_ACTIONS];
-	size_t nactions;
+	unsigned *program;
+	unsigned nactions;
+	unsigned nreleases;
 } WacomAction;
 
+/* wcmScaleAxis() from one fixed range to another, with the division
+ * replaced by a fixed point multiplication. See wcmScaleInit(). */
+typedef struct {
+	int to_max, to_min;
+	int from_max, from_min;
+	int direction;		/* -1 if from_max < from_min, 0 if constant */
+	int low, high;		/* result at and beyond either end */
+	uint64_t range;		/* |from_max - from_min| */
+	uint64_t width;		/* to_max - to_min */
+	uint64_t factor;	/* width / range in .shift fixed point */
+	int shift;		/* 0 to divide instead */
+} WacomScale;
+
+/* wcmRotateAndScaleCoordinates() compiled for the area, the valuator
+ * ranges and the tablet rotation, see wcmUpdateTransform(). Index 0 is
+ * the X axis, 1 the Y axis. */
+typedef struct {
+	Bool area[2];		/* scale the area into the valuator range */
+	WacomScale areaScale[2];
+	Bool swap;		/* X comes from Y and vice versa */
+	WacomScale swapScale[2]; /* from the other axis' valuator range */
+	Bool flip[2];		/* mirror within the valuator range */
+	int min[2], max[2];	/* valuator range */
+} WacomTransform;
+
+/* A batch of samples for wcmTransformSamples(), one array per axis.
+ * Axes the samples don't have are NULL. Transformed in place. */
+typedef struct {
+	int *x;
+	int *y;
+	int *pressure;		/* raw in, after the pressure curve out */
+	int *tiltx;
+	int *tilty;
+} WacomSamples;
+
 typedef enum  {
 	WTYPE_INVALID = 0,
 	WTYPE_STYLUS,
@@ -260,6 +299,7 @@ struct _WacomDeviceRec
 	int valuatorMaxX;	/* X valuator maximum value, as initialized */
 	int valuatorMinY;	/* Y valuator minimum value, as initialized */
 	int valuatorMaxY;	/* Y valuator maximum value, as initialized */
+	WacomTransform transform; /* area and rotation, see wcmUpdateTransform() */
 	unsigned int serial;	/* device serial number this device takes (if 0, any serial is ok) */
 	unsigned int cur_serial; /* current serial in prox */
 	int cur_device_id;	/* current device ID in prox */
@@ -292,6 +332,7 @@ struct _WacomDeviceRec
 	int oldCursorHwProx;	/* previous cursor hardware proximity */
 
 	int maxCurve;		/* maximum pressure curve value */
+	WacomScale pressureScale; /* raw pressure to 0..maxCurve */
 	int *pPressCurve;       /* pressure curve */
 	int nPressCtrl[4];      /* control points for curve */
 	int minPressure;	/* the minimum pressure a pen may hold */
@@ -303,12 +344,14 @@ struct _WacomDeviceRec
 	WacomToolPtr tool;         /* The common tool-structure for this device */
 
 	int isParent;		/* set to 1 if the device is not auto-hotplugged */
+	Bool sharedOptions;	/* tablet-wide options as in the parent, see wcmPreInitParseOptions() */
 
 	WacomTimerPtr serial_timer; /* timer used for serial number property update */
 	WacomTimerPtr tap_timer;   /* timer used for tap timing */
 	WacomTimerPtr touch_timer; /* timer used for touch switch property update */
 
 	ValuatorMask *valuator_mask; /* reusable valuator mask for sending events without reallocation */
+	WacomAxisData valuator_axes; /* the axes valuator_mask holds */
 };
 
 #define MAX_SAMPLES	20
@@ -357,6 +400,8 @@ struct _WacomHWClass
 	int  (*ProbeKeys)(WacomDevicePtr priv); /* set the bits for the keys supported */
 	Bool (*ParseOptions)(WacomDevicePtr priv); /* parse class-specific options */
 	Bool (*Init)(WacomDevicePtr priv);   /* initialize device */
+	int  (*DumpRecorder)(WacomDevicePtr priv, const char *reason); /* write the flight recorder */
+	void (*Free)(WacomCommonPtr common); /* free class data before the common goes */
 };
 
 extern WacomHWClass *WacomGetClassUSB(void);
@@ -367,9 +412,13 @@ extern WacomHWClass *WacomGetClassUSB(void);
 
 #define TILT_ENABLED_FLAG       2
 
+/* The channel pool is sized by the backend once the number of touch
+ * contacts is known, see wcmSetChannelCount(). Until then a common has
+ * MAX_CHANNELS channels. */
 #define MAX_FINGERS 16
 #define MAX_CHANNELS (MAX_FINGERS+2) /* one channel for stylus/mouse. The other one for pad */
-#define PAD_CHANNEL (MAX_CHANNELS-1)
+#define WCM_MAX_CHANNELS 64 /* channels are tracked in 64-bit masks */
+#define PAD_CHANNEL(common) ((common)->wcmChannelCount - 1) /* always the last channel */
 
 typedef struct {
 	unsigned int wcmZoomDistance;        /* minimum distance for a zoom touch gesture */
@@ -377,8 +426,65 @@ typedef struct {
 	unsigned int wcmScrollDirection;     /* store the vertical or horizontal bit in use */
 	unsigned int wcmGestureUsed;         /* retain used gesture count within one in-prox event */
 	unsigned int wcmTapTime;             /* minimum time between taps for a right click */
+	int wcmGestureSpread;                /* distance between the fingers at gesture start */
+	int wcmScrollSent;                   /* scroll valuator total sent in this scroll gesture */
 } WacomGesturesParameters;
 
+/* The tablet-wide options as the parent device parsed them. A dependent
+ * whose copy of these options hashes the same skips them, see
+ * wcmPreInitParseOptions(). */
+typedef struct {
+	Bool valid;                          /* set once the parent is parsed */
+	uint64_t hash;                       /* wcmOptHash() of the parent */
+	int maxZ;                            /* MaxZ, reset by every device's init */
+} WacomSharedOptions;
+
+/* Runtime statistics, one counter each in WacomCommonRec.wcmStats. The
+ * order is exported as-is through the Wacom Statistics property, new
+ * counters must only be appended. */
+enum WacomStatistic {
+	WSTAT_FRAMES,			/* SYN_REPORT frames received */
+	WSTAT_EVENTS,			/* evdev events received */
+	WSTAT_DROP_QUEUE_OVERFLOW,	/* frames dropped, event queue full */
+	WSTAT_DROP_SERIAL_ZERO,		/* frames dropped, MSC_SERIAL of 0 */
+	WSTAT_DROP_EMPTY_FRAME,		/* frames without axis/button data */
+	WSTAT_DROP_PEN_OVER_TOUCH,	/* touch frames while pen is in prox */
+	WSTAT_DROP_NO_CHANNEL,		/* frames dropped, channels exhausted */
+	WSTAT_DROP_NO_TOOL,		/* events without a matching tool */
+	WSTAT_DROP_TOOL_DISABLED,	/* events for tools not initialized yet */
+	WSTAT_SUPPRESSED,		/* events discarded by wcmCheckSuppress */
+	WSTAT_EMIT_PROXIMITY,		/* proximity events sent to the frontend */
+	WSTAT_EMIT_MOTION,		/* motion events sent to the frontend */
+	WSTAT_EMIT_BUTTON,		/* button events sent to the frontend */
+	WSTAT_EMIT_KEY,			/* key events sent to the frontend */
+	WSTAT_EMIT_TOUCH,		/* touch events sent to the frontend */
+	WSTAT_EMIT_TOUCH_FRAME,		/* touch frames sent to the frontend */
+	WSTAT_DROP_TOUCH_DISABLED,	/* touch frames while touch is off */
+	WSTAT_TOUCH_MUTED,		/* touch frames sent while the touch switch is off */
+	WSTAT_READS,			/* reads from the device returning data */
+	WSTAT_BYTES_READ,		/* bytes read from the device */
+	WSTAT_DROP_FILTERED,		/* events discarded by usbFilterEvent */
+
+	WSTAT_COUNT
+};
+
+/* Pipeline stages with a latency histogram in WacomCommonRec.wcmTiming.
+ * Each stage includes the time spent in the stages it calls. Bucket 0
+ * counts durations below 1us, bucket n counts [2^(n-1), 2^n) us and the
+ * last bucket counts everything longer. Only recorded if the driver was
+ * built with timing histograms and they are enabled at runtime.
+ */
+enum WacomTimingStage {
+	WTIME_READ,			/* wcmReadPacket */
+	WTIME_PARSE,			/* usbDispatchEvents */
+	WTIME_CORE,			/* wcmEvent */
+	WTIME_EMIT,			/* wcmEmit* */
+
+	WTIME_COUNT
+};
+
+#define WTIME_BUCKETS 16
+
 enum WacomProtocol {
 	WCM_PROTOCOL_GENERIC,
 	WCM_PROTOCOL_4,
@@ -392,6 +498,9 @@ struct _WacomCommonRec
 	/* Do not move is_common_rec, same offset as priv->is_common_rec. Used by DBG macro */
 	bool is_common_rec;
 	dev_t min_maj;               /* minor/major number */
+	dev_t rdev;                  /* node this struct is registered for, see wcmRegisterCommon() */
+	ino_t ino;                   /* inode of that node */
+	WacomCommonPtr registryNext; /* next common in the same registry bucket */
 	unsigned char wcmFlags;     /* various flags (handle tilt) */
 	int debugLevel;
 	int vendor_id;		     /* Vendor ID */
@@ -448,7 +557,16 @@ struct _WacomCommonRec
 	float wcmVersion;            /* ROM version */
 	int wcmRotate;               /* rotate screen (for TabletPC) */
 	int wcmThreshold;            /* Threshold for button pressure */
-	WacomChannel wcmChannel[MAX_CHANNELS]; /* channel device state */
+	WacomChannelPtr wcmChannel;  /* channel device state, wcmChannelCount entries */
+	unsigned int wcmChannelCount; /* number of channels, the last one is the pad's */
+	/* Touch contacts, kept up to date by wcmEvent. Both are hints, a
+	 * channel may have been recycled since, see getContactNumber(). */
+	uint8_t *wcmContactChannel;  /* channel + 1 by contact number, 0 if none */
+	uint64_t wcmTouchChannels;   /* bitmask of channels last seen with a touch */
+	/* Touch events queued for the current frame, see wcmTouchFrameEnd() */
+	uint64_t wcmTouchPending;    /* bitmask of channels with a queued touch event */
+	uint64_t wcmTouchBegin;      /* subset of wcmTouchPending to send as TouchBegin */
+	WacomDevicePtr wcmTouchFrameDevice; /* device the queued touches are sent to */
 
 	WacomHWClassPtr wcmDevCls; /* device class functions */
 	WacomModelPtr wcmModel;        /* model-specific functions */
@@ -457,8 +575,9 @@ struct _WacomCommonRec
 	int wcmTouchDefault;	     /* default to disable when not supported */
 	int wcmGesture;	     	     /* disable/enable touch gesture */
 	int wcmGestureMode;	       /* data is in Gesture Mode? */
-	WacomDeviceState wcmGestureState[MAX_FINGERS]; /* inital state when in gesture mode */
+	WacomDeviceState wcmGestureState[2]; /* inital state of both fingers when in gesture mode */
 	WacomGesturesParameters wcmGestureParameters;
+	const WacomGestureOps *wcmGestureOps; /* NULL for the frontend, see wcmTouchFilter.h */
 	int wcmProxoutDistDefault;   /* Default value for wcmProxoutDist */
 	int wcmSuppress;        	 /* transmit position on delta > supress */
 	int wcmRawSample;	     /* Number of raw data used to filter an event */
@@ -470,14 +589,23 @@ struct _WacomCommonRec
 	unsigned char buffer[BUFFER_SIZE]; /* data read from device */
 
 	void *private;		     /* backend-specific information */
+	struct WacomArenaChunk *arena; /* see wcmArenaAlloc() */
 
 	WacomToolPtr wcmTool; /* List of unique tools */
 	WacomToolPtr serials; /* Serial numbers provided at startup*/
+	Bool wcmLazySerials;  /* hotplug serials on first proximity */
+	WacomSharedOptions wcmSharedOptions; /* tablet-wide options of the parent */
+	char *wcmSerialBasename; /* device name prefix for lazy serials */
+	WacomTimerPtr wcmSerialTimer; /* hotplugs lazy serials on the main thread */
 
 	/* DO NOT TOUCH THIS. use wcmRefCommon() instead */
 	int refcnt;			/* number of devices sharing this struct */
 
 	ValuatorMask *touch_mask;
+
+	uint32_t wcmStats[WSTAT_COUNT]; /* see enum WacomStatistic */
+	Bool wcmTimingEnabled;	    /* record timing histograms */
+	uint32_t wcmTiming[WTIME_COUNT][WTIME_BUCKETS]; /* see enum WacomTimingStage */
 };
 
 #define HANDLE_TILT(comm) ((comm)->wcmFlags & TILT_ENABLED_FLAG)
@@ -492,6 +620,8 @@ struct _WacomTool
 	int typeid; /* Tool type */
 	unsigned int serial; /* Serial id, 0 == no serial id */
 	Bool enabled;
+	Bool queued; /* ToolSerials entry whose devices have been hotplugged */
+	Bool wanted; /* LazyToolSerials entry seen in proximity, not queued yet */
 	char *name;
 
 	WacomDevicePtr device; /* The InputDevice connected to this tool */
@@ -383,4 +383,36 @@ def test_scroll(mainloop, opts):
     assert have_we_scrolled
 
 
+def test_statistics(mainloop, opts):
+    """
+    Check the runtime counters follow the events we send
+    """
+    dev = Device.from_name("PTH660", "Pen")
+    monitor = Monitor.new_from_device(dev, opts)
+
+    prox_in = [
+        Sev("ABS_X", 50),
+        Sev("ABS_Y", 50),
+        Sev("BTN_TOOL_PEN", 1),
+        Sev("SYN_REPORT", 0),
+    ]
+    prox_out = [
+        Sev("BTN_TOOL_PEN", 0),
+        Sev("SYN_REPORT", 0),
+    ]
+    monitor.write_events(prox_in)
+    monitor.write_events(prox_out)
+    mainloop.run()
+
+    stats = monitor.wacom_device.get_stats()
+    assert stats.frames >= 2
+    assert stats.events >= stats.frames
+    assert stats.dropped_queue_overflow == 0
+    assert stats.dropped_no_channel == 0
+    assert stats.emitted_proximity == 2
+    assert stats.emitted_proximity == len(
+        [e for e in monitor.events if isinstance(e, Proximity)]
+    )
+
+
 # vim: set expandtab tabstop=4 shiftwidth=4:
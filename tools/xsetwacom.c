@@ -116,6 +116,8 @@ static int set_xydefault(Display *dpy, XDevice *dev, param_t *param, int argc, c
 static int get_all(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
 static int get_param(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
 static int set_output(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
+static int get_statistics(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
+static int get_timing_histograms(Display *dpy, XDevice *dev, param_t *param, int argc, char **argv);
 
 /* NOTE: When removing or changing a parameter name, add to
  * deprecated_parameters.
@@ -483,6 +485,36 @@ static param_t parameters[] =
 		.prop_offset = 0,
 		.arg_count = 1,
 	},
+	{
+		.name = "Statistics",
+		.desc = "Returns the runtime event counters of the associated tablet. ",
+		.prop_name = WACOM_PROP_STATISTICS,
+		.prop_format = 32,
+		.prop_offset = 0,
+		.arg_count = 0,
+		.prop_flags = PROP_FLAG_READONLY,
+		.get_func = get_statistics,
+	},
+	{
+		.name = "Timing",
+		.desc = "Turns on/off recording of the event timing histograms "
+		"of the associated tablet. Turning it on resets the histograms. ",
+		.prop_name = WACOM_PROP_TIMING,
+		.prop_format = 8,
+		.prop_offset = 0,
+		.arg_count = 1,
+		.prop_flags = PROP_FLAG_BOOLEAN
+	},
+	{
+		.name = "TimingHistograms",
+		.desc = "Returns the event timing histograms of the associated tablet. ",
+		.prop_name = WACOM_PROP_TIMING_HISTOGRAMS,
+		.prop_format = 32,
+		.prop_offset = 0,
+		.arg_count = 0,
+		.prop_flags = PROP_FLAG_READONLY,
+		.get_func = get_timing_histograms,
+	},
 	{
 		.name = "MapToOutput",
 		.desc = "Map the device to the given output. ",
@@ -759,7 +791,8 @@ static void usage(void)
 	" --list parameters          - display supported parameters\n"
 	" --list modifiers           - display supported modifier and specific keys for keystrokes\n"
 	" --set \"device name\" parameter [values...] - set device parameter by name\n"
-	" --get \"device name\" parameter [param...]  - get current device parameter(s) value by name\n");
+	" --get \"device name\" parameter [param...]  - get current device parameter(s) value by name\n"
+	" --batch file               - run the set/get/list commands in file, one per line (- for stdin)\n");
 }
 
 
@@ -768,6 +801,82 @@ static void version(void)
 	printf(BUILD_VERSION "\n");
 }
 
+/* Atoms looked up so far. The names are all string literals or parameter
+ * names, so the pointers stay valid. */
+static struct {
+	const char *name;
+	Atom atom;
+} atom_cache[64];
+static int atom_cache_size;
+
+/**
+ * XInternAtom with a cache, each lookup is a round trip to the server.
+ * Atoms that don't exist (yet) are not cached.
+ */
+static Atom intern_atom(Display *dpy, const char *name)
+{
+	Atom atom;
+	int i;
+
+	for (i = 0; i < atom_cache_size; i++)
+		if (strcmp(atom_cache[i].name, name) == 0)
+			return atom_cache[i].atom;
+
+	atom = XInternAtom(dpy, name, True);
+	if (atom != None && atom_cache_size < (int)ARRAY_SIZE(atom_cache))
+	{
+		atom_cache[atom_cache_size].name = name;
+		atom_cache[atom_cache_size].atom = atom;
+		atom_cache_size++;
+	}
+
+	return atom;
+}
+
+/* In batch mode the device list is queried once and devices stay open
+ * until all commands have run, see run_batch(). */
+static Bool batch_mode;
+static XDeviceInfo *batch_devices;
+static int batch_ndevices;
+static struct {
+	XID id;
+	XDevice *dev;
+} batch_open[32];
+static int batch_nopen;
+
+static XDevice* open_device(Display *display, XID id)
+{
+	XDevice *dev;
+	int i;
+
+	if (!batch_mode)
+		return XOpenDevice(display, id);
+
+	for (i = 0; i < batch_nopen; i++)
+		if (batch_open[i].id == id)
+			return batch_open[i].dev;
+
+	dev = XOpenDevice(display, id);
+	if (dev && batch_nopen < (int)ARRAY_SIZE(batch_open))
+	{
+		batch_open[batch_nopen].id = id;
+		batch_open[batch_nopen].dev = dev;
+		batch_nopen++;
+	}
+	return dev;
+}
+
+static void close_device(Display *display, XDevice *dev)
+{
+	int i;
+
+	for (i = 0; batch_mode && i < batch_nopen; i++)
+		if (batch_open[i].dev == dev)
+			return;
+
+	XCloseDevice(display, dev);
+}
+
 static XDevice* find_device(Display *display, char *name)
 {
 	XDeviceInfo	*devices;
@@ -790,7 +899,14 @@ static XDevice* find_device(Display *display, char *name)
 	if (is_id)
 		id = atoi(name);
 
-	devices = XListInputDevices(display, &num_devices);
+	if (batch_mode)
+	{
+		if (!batch_devices)
+			batch_devices = XListInputDevices(display, &batch_ndevices);
+		devices = batch_devices;
+		num_devices = batch_ndevices;
+	} else
+		devices = XListInputDevices(display, &num_devices);
 
 	for(i = 0; i < num_devices; i++)
 	{
@@ -815,10 +931,11 @@ static XDevice* find_device(Display *display, char *name)
 	if (found)
 	{
 		TRACE("Device '%s' (%lu) found.\n", found->name, found->id);
-		dev = XOpenDevice(display, found->id);
+		dev = open_device(display, found->id);
 	}
 
-	XFreeDeviceList(devices);
+	if (!batch_mode)
+		XFreeDeviceList(devices);
 
 	return dev;
 }
@@ -858,7 +975,7 @@ static void list_one_device(Display *dpy, XDeviceInfo *info)
 	char		*type_name = NULL;
 
 	if (!wacom_prop)
-		wacom_prop = XInternAtom(dpy, "Wacom Tool Type", True);
+		wacom_prop = intern_atom(dpy, "Wacom Tool Type");
 
 	dev = XOpenDevice(dpy, info->id);
 	if (!dev)
@@ -910,7 +1027,7 @@ static void list_devices(Display *dpy)
 	Atom		wacom_prop;
 
 
-	wacom_prop = XInternAtom(dpy, "Wacom Tool Type", True);
+	wacom_prop = intern_atom(dpy, "Wacom Tool Type");
 	if (wacom_prop == None)
 		return;
 
@@ -1551,7 +1668,7 @@ static int map_actions(Display *dpy, XDevice *dev, param_t* param, int argc, cha
 
 	TRACE("Mapping %s for device %lu.\n", param->name, dev->device_id);
 
-	action_prop = XInternAtom(dpy, param->prop_name, True);
+	action_prop = intern_atom(dpy, param->prop_name);
 	if (!action_prop)
 	{
 		fprintf(stderr, "Unable to locate property '%s'\n", param->prop_name);
@@ -1596,7 +1713,7 @@ static int set_xydefault(Display *dpy, XDevice *dev, param_t* param, int argc, c
 		return EXIT_INVALID_USAGE;
 	}
 
-	prop = XInternAtom(dpy, param->prop_name, True);
+	prop = intern_atom(dpy, param->prop_name);
 	if (!prop)
 	{
 		fprintf(stderr, "Property for '%s' not available.\n",
@@ -1690,7 +1807,7 @@ static int set_rotate(Display *dpy, XDevice *dev, param_t* param, int argc, char
 		return EXIT_INVALID_USAGE;
 	}
 
-	prop = XInternAtom(dpy, param->prop_name, True);
+	prop = intern_atom(dpy, param->prop_name);
 	if (!prop)
 	{
 		fprintf(stderr, "Property for '%s' not available.\n",
@@ -1815,7 +1932,7 @@ static int set(Display *dpy, int argc, char **argv)
 
 	if (param->prop_name)
 	{
-		prop = XInternAtom(dpy, param->prop_name, True);
+		prop = intern_atom(dpy, param->prop_name);
 		if (!prop || !test_property(dpy, dev, prop))
 		{
 			fprintf(stderr, "Property '%s' does not exist on device.\n",
@@ -1896,7 +2013,7 @@ out:
 	for (i = 0; i < nvals; i++)
 		free(values[i]);
 	free(values);
-	XCloseDevice(dpy, dev);
+	close_device(dpy, dev);
 	XFree(data);
 	return status;
 }
@@ -1954,7 +2071,7 @@ static int get_rotate(Display *dpy, XDevice *dev, param_t* param, int argc, char
 		return EXIT_INVALID_USAGE;
 	}
 
-	prop = XInternAtom(dpy, param->prop_name, True);
+	prop = intern_atom(dpy, param->prop_name);
 	if (!prop)
 	{
 		fprintf(stderr, "Property for '%s' not available.\n",
@@ -1998,6 +2115,160 @@ out:
 	return status;
 }
 
+/* Names of the values in the statistics property, in property order */
+static const char *statistics_names[] = {
+	"frames",
+	"events",
+	"dropped-queue-overflow",
+	"dropped-serial-zero",
+	"dropped-empty-frame",
+	"dropped-pen-over-touch",
+	"dropped-no-channel",
+	"dropped-no-tool",
+	"dropped-tool-disabled",
+	"suppressed",
+	"emitted-proximity",
+	"emitted-motion",
+	"emitted-button",
+	"emitted-key",
+	"emitted-touch",
+	"emitted-touch-frames",
+	"dropped-touch-disabled",
+	"touch-frames-muted",
+	"reads",
+	"bytes-read",
+	"dropped-filtered",
+};
+
+static int get_statistics(Display *dpy, XDevice *dev, param_t* param, int argc, char **argv)
+{
+	Atom prop, type;
+	int format;
+	unsigned char* data;
+	unsigned long nitems, bytes_after;
+	long *ldata;
+	unsigned long i;
+
+	if (argc != 0)
+	{
+		fprintf(stderr, "Incorrect number of arguments supplied.\n");
+		return EXIT_INVALID_USAGE;
+	}
+
+	prop = intern_atom(dpy, param->prop_name);
+	if (!prop)
+	{
+		fprintf(stderr, "Property for '%s' not available.\n",
+			param->name);
+		return EXIT_FAILURE;
+	}
+
+	TRACE("Getting statistics for device %lu.\n", dev->device_id);
+
+	XGetDeviceProperty(dpy, dev, prop, 0, 1000, False, AnyPropertyType,
+				&type, &format, &nitems, &bytes_after, &data);
+
+	if (nitems == 0 || format != 32)
+	{
+		fprintf(stderr, "Property for '%s' has no or wrong value - this is a bug.\n",
+			param->name);
+		XFree(data);
+		return EXIT_FAILURE;
+	}
+
+	/* newer drivers may append counters we don't know about */
+	ldata = (long*)data;
+	for (i = 0; i < nitems && i < ARRAY_SIZE(statistics_names); i++)
+		print_value(param, "%s: %u", statistics_names[i],
+			    (unsigned int)ldata[i]);
+
+	XFree(data);
+	return EXIT_SUCCESS;
+}
+
+/* Stages in the timing histograms property, in property order */
+static const char *timing_stage_names[] = {
+	"read",
+	"parse",
+	"core",
+	"emit",
+};
+
+#define TIMING_BUCKETS 16
+#define TIMING_BAR_WIDTH 40
+
+static int get_timing_histograms(Display *dpy, XDevice *dev, param_t* param, int argc, char **argv)
+{
+	Atom prop, type;
+	int format;
+	unsigned char* data;
+	unsigned long nitems, bytes_after;
+	long *ldata;
+	unsigned long stage, i;
+
+	if (argc != 0)
+	{
+		fprintf(stderr, "Incorrect number of arguments supplied.\n");
+		return EXIT_INVALID_USAGE;
+	}
+
+	prop = intern_atom(dpy, param->prop_name);
+	if (!prop)
+	{
+		fprintf(stderr, "Property for '%s' not available.\n",
+			param->name);
+		return EXIT_FAILURE;
+	}
+
+	TRACE("Getting timing histograms for device %lu.\n", dev->device_id);
+
+	XGetDeviceProperty(dpy, dev, prop, 0, 1000, False, AnyPropertyType,
+				&type, &format, &nitems, &bytes_after, &data);
+
+	if (nitems != ARRAY_SIZE(timing_stage_names) * TIMING_BUCKETS || format != 32)
+	{
+		fprintf(stderr, "Property for '%s' has no or wrong value - this is a bug.\n",
+			param->name);
+		XFree(data);
+		return EXIT_FAILURE;
+	}
+
+	ldata = (long*)data;
+	for (stage = 0; stage < ARRAY_SIZE(timing_stage_names); stage++)
+	{
+		long *bucket = &ldata[stage * TIMING_BUCKETS];
+		long highest = 0;
+
+		for (i = 0; i < TIMING_BUCKETS; i++)
+			if (bucket[i] > highest)
+				highest = bucket[i];
+
+		print_value(param, "%s:", timing_stage_names[stage]);
+
+		for (i = 0; i < TIMING_BUCKETS; i++)
+		{
+			char label[32];
+			char bar[TIMING_BAR_WIDTH + 1] = {0};
+
+			if (i == 0)
+				snprintf(label, sizeof(label), "<1us");
+			else if (i == TIMING_BUCKETS - 1)
+				snprintf(label, sizeof(label), ">=%luus", 1UL << (i - 1));
+			else
+				snprintf(label, sizeof(label), "%lu-%luus",
+					 1UL << (i - 1), 1UL << i);
+
+			if (highest)
+				memset(bar, '#', (long long)bucket[i] * TIMING_BAR_WIDTH / highest);
+
+			print_value(param, "  %-12s %10ld %s", label, bucket[i], bar);
+		}
+	}
+
+	XFree(data);
+	return EXIT_SUCCESS;
+}
+
 /**
  * Try to print the value of the action mapped to the given parameter's
  * property. If the property contains data in the wrong format/type then
@@ -2018,7 +2289,7 @@ static int get_actions(Display *dpy, XDevice *dev,
 	char buff[1024] = {0};
 	int last_type;
 
-	prop = XInternAtom(dpy, param->prop_name, True);
+	prop = intern_atom(dpy, param->prop_name);
 
 	if (!prop)
 		return 0;
@@ -2123,7 +2394,7 @@ static int get_button(Display *dpy, XDevice *dev, param_t *param, unsigned int o
 	unsigned long nitems, bytes_after;
 	unsigned char *data;
 
-	prop = XInternAtom(dpy, param->prop_name, True);
+	prop = intern_atom(dpy, param->prop_name);
 
 	if (!prop)
 		return 0;
@@ -2260,7 +2531,7 @@ static Bool need_xinerama(Display *dpy)
  */
 static Bool get_mapped_area(Display *dpy, XDevice *dev, int *width, int *height, int *x_org, int *y_org)
 {
-	Atom matrix_prop = XInternAtom(dpy, "Coordinate Transformation Matrix", True);
+	Atom matrix_prop = intern_atom(dpy, "Coordinate Transformation Matrix");
 	Atom type;
 	int format;
 	unsigned long nitems, bytes_after;
@@ -2282,7 +2553,7 @@ static Bool get_mapped_area(Display *dpy, XDevice *dev, int *width, int *height,
 	                   AnyPropertyType, &type, &format, &nitems,
 	                   &bytes_after, (unsigned char**)&data);
 
-	if (format != 32 || type != XInternAtom(dpy, "FLOAT", True) || nitems != 9)
+	if (format != 32 || type != intern_atom(dpy, "FLOAT") || nitems != 9)
 	{
 		fprintf(stderr,"Property for '%s' has unexpected type - this is a bug.\n",
 			"Coordinate Transformation Matrix");
@@ -2328,7 +2599,7 @@ static Bool get_mapped_area(Display *dpy, XDevice *dev, int *width, int *height,
  */
 static Bool _set_matrix_prop(Display *dpy, XDevice *dev, const float fmatrix[9])
 {
-	Atom matrix_prop = XInternAtom(dpy, "Coordinate Transformation Matrix", True);
+	Atom matrix_prop = intern_atom(dpy, "Coordinate Transformation Matrix");
 	Atom type;
 	int format;
 	unsigned long nitems, bytes_after;
@@ -2352,7 +2623,7 @@ static Bool _set_matrix_prop(Display *dpy, XDevice *dev, const float fmatrix[9])
 				AnyPropertyType, &type, &format, &nitems,
 				&bytes_after, (unsigned char**)&data);
 
-	if (format != 32 || type != XInternAtom(dpy, "FLOAT", True))
+	if (format != 32 || type != intern_atom(dpy, "FLOAT"))
 	{
 		fprintf(stderr, "Property for '%s' has unexpected type - this is a bug.\n",
 			"Coordinate Transformation Matrix");
@@ -2718,7 +2989,7 @@ static int get(Display *dpy, enum printformat printformat, int argc, char **argv
 	status = get_param(dpy, dev, param, argc - 2, &argv[2]);
 
 out:
-	XCloseDevice(dpy, dev);
+	close_device(dpy, dev);
 	return status;
 }
 
@@ -2734,7 +3005,7 @@ static int get_param(Display *dpy, XDevice *dev, param_t *param, int argc, char
 
 	if (param->prop_name)
 	{
-		prop = XInternAtom(dpy, param->prop_name, True);
+		prop = intern_atom(dpy, param->prop_name);
 		if (!prop || !test_property(dpy, dev, prop))
 		{
 			fprintf(stderr, "Property '%s' does not exist on device.\n",
@@ -2801,8 +3072,210 @@ out:
 }
 
 
+/**
+ * Split a line of a batch file into words, in place. Words are separated
+ * by whitespace and may be quoted with ' or ", a backslash escapes the next
+ * character outside of single quotes. Everything after an unquoted # is a
+ * comment.
+ *
+ * @return The number of words or -1 if a quote isn't closed or there are
+ * more than maxwords words.
+ */
+static int split_words(char *line, char **words, int maxwords)
+{
+	char *in = line, *out = line;
+	int nwords = 0;
+
+	while (1)
+	{
+		char quote = 0;
+
+		while (isspace((unsigned char)*in))
+			in++;
+		if (*in == '\0' || *in == '#')
+			break;
+
+		if (nwords == maxwords)
+			return -1;
+		words[nwords++] = out;
+
+		for (; *in && (quote || !isspace((unsigned char)*in)); in++)
+		{
+			if (quote && *in == quote)
+				quote = 0;
+			else if (!quote && (*in == '"' || *in == '\''))
+				quote = *in;
+			else if (*in == '\\' && quote != '\'' && in[1])
+				*out++ = *++in;
+			else
+				*out++ = *in;
+		}
+
+		if (quote)
+			return -1;
+
+		/* in may point at the terminator, only step past a separator */
+		if (*in)
+			in++;
+		*out++ = '\0';
+	}
+
+	return nwords;
+}
+
 #ifndef ENABLE_TESTS
 
+/* One command of a batch file and how it went */
+struct batch_command {
+	int line;
+	unsigned long serial;	/* first request sent for the command */
+	int status;
+	Bool have_error;
+	XErrorEvent error;	/* first X error caused by the command */
+};
+
+static struct batch_command *batch_commands;
+static int batch_ncommands;
+
+/**
+ * Requests are not waited on in batch mode, so errors show up any time
+ * later. They are matched to the command that sent the request by serial
+ * and reported once all commands have run.
+ */
+static int batch_error_handler(Display *dpy, XErrorEvent *event)
+{
+	int i;
+
+	for (i = batch_ncommands - 1; i >= 0; i--)
+	{
+		struct batch_command *cmd = &batch_commands[i];
+
+		if (cmd->serial > event->serial)
+			continue;
+
+		if (!cmd->have_error)
+		{
+			cmd->have_error = True;
+			cmd->error = *event;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static int run_batch_command(Display *dpy, enum printformat format, int argc, char **argv)
+{
+	char *command = argv[0];
+
+	if (strcmp(command, "xsetwacom") == 0 && argc > 1)
+		command = (++argv, --argc, argv[0]);
+
+	if (strncmp(command, "--", 2) == 0)
+		command += 2;
+
+	if (strcmp(command, "set") == 0)
+		return set(dpy, argc - 1, &argv[1]);
+	else if (strcmp(command, "get") == 0)
+		return get(dpy, format, argc - 1, &argv[1]);
+	else if (strcmp(command, "list") == 0)
+		return list(dpy, argc - 1, &argv[1]);
+
+	fprintf(stderr, "Unknown command '%s'.\n", command);
+	return EXIT_INVALID_USAGE;
+}
+
+/**
+ * Run the set/get/list commands in path ("-" for stdin), one per line.
+ * Devices and atoms are looked up once for all commands and the property
+ * changes are sent without waiting for the server, errors are collected
+ * and reported per line at the end.
+ */
+static int run_batch(Display *dpy, enum printformat format, const char *path)
+{
+	FILE *file;
+	char *line = NULL;
+	size_t size = 0;
+	int lineno = 0;
+	int status = EXIT_SUCCESS;
+	int i;
+
+	file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (!file)
+	{
+		fprintf(stderr, "Cannot open '%s': %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	batch_mode = True;
+	XSetErrorHandler(batch_error_handler);
+
+	while (getline(&line, &size, file) != -1)
+	{
+		struct batch_command *cmd;
+		char *words[64];
+		int nwords;
+
+		lineno++;
+		nwords = split_words(line, words, ARRAY_SIZE(words));
+		if (nwords == 0)
+			continue;
+
+		cmd = safe_realloc(batch_commands, batch_ncommands + 1, sizeof(*cmd));
+		if (!cmd)
+		{
+			status = EXIT_FAILURE;
+			break;
+		}
+		batch_commands = cmd;
+		cmd = &batch_commands[batch_ncommands++];
+		memset(cmd, 0, sizeof(*cmd));
+		cmd->line = lineno;
+		cmd->serial = NextRequest(dpy);
+
+		if (nwords < 0)
+		{
+			fprintf(stderr, "Line %d: unbalanced quotes or too many words.\n", lineno);
+			cmd->status = EXIT_INVALID_USAGE;
+		}
+		else
+			cmd->status = run_batch_command(dpy, format, nwords, words);
+	}
+
+	XSync(dpy, False);
+
+	for (i = 0; i < batch_ncommands; i++)
+	{
+		struct batch_command *cmd = &batch_commands[i];
+
+		if (cmd->have_error)
+		{
+			char msg[128];
+
+			XGetErrorText(dpy, cmd->error.error_code, msg, sizeof(msg));
+			fprintf(stderr, "Line %d: %s (request %u.%u)\n", cmd->line,
+				msg, (unsigned int)cmd->error.request_code,
+				(unsigned int)cmd->error.minor_code);
+			cmd->status = EXIT_FAILURE;
+		} else if (cmd->status != EXIT_SUCCESS)
+			fprintf(stderr, "Line %d: failed.\n", cmd->line);
+
+		if (cmd->status != EXIT_SUCCESS)
+			status = cmd->status;
+	}
+
+	for (i = 0; i < batch_nopen; i++)
+		XCloseDevice(dpy, batch_open[i].dev);
+	if (batch_devices)
+		XFreeDeviceList(batch_devices);
+	free(batch_commands);
+	free(line);
+	if (file != stdin)
+		fclose(file);
+
+	return status;
+}
+
 #ifdef BUILD_FUZZINTERFACE
 void argsfromstdin(int *argc, char ***argv)
 {
@@ -2870,6 +3343,7 @@ int main (int argc, char **argv)
 	char *display = NULL;
 	Display *dpy;
 	int do_list = 0, do_set = 0, do_get = 0;
+	char *batch_file = NULL;
 	enum printformat format = FORMAT_DEFAULT;
 	int status = EXIT_SUCCESS;
 
@@ -2883,6 +3357,7 @@ int main (int argc, char **argv)
 		{"list", 0, NULL, 0},
 		{"set", 0, NULL, 0},
 		{"get", 0, NULL, 0},
+		{"batch", 1, NULL, 0},
 		{NULL, 0, NULL, 0}
 	};
 
@@ -2916,6 +3391,7 @@ int main (int argc, char **argv)
 					case 6: do_list = 1; break;
 					case 7: do_set = 1; break;
 					case 8: do_get = 1; break;
+					case 9: batch_file = optarg; break;
 				}
 				break;
 			case 'd':
@@ -2956,6 +3432,13 @@ int main (int argc, char **argv)
 		return EXIT_INVALID_USAGE;
 	}
 
+	if (batch_file)
+	{
+		status = run_batch(dpy, format, batch_file);
+		XCloseDisplay(dpy);
+		return status;
+	}
+
 	if (!do_list && !do_get && !do_set)
 	{
 		if (optind < argc)
@@ -3072,6 +3555,34 @@ TEST_CASE(test_convert_specialkey)
 	}
 }
 
+TEST_CASE(test_split_words)
+{
+	char *words[8];
+	char line[128];
+
+	strcpy(line, "  set \"Wacom Intuos Pen stylus\" Area 0 0 100 100\n");
+	assert(split_words(line, words, 8) == 7);
+	assert(strcmp(words[0], "set") == 0);
+	assert(strcmp(words[1], "Wacom Intuos Pen stylus") == 0);
+	assert(strcmp(words[6], "100") == 0);
+
+	strcpy(line, "set 'pad \\x' Button\\ 1 \"key \\\"a\\\"\" # comment");
+	assert(split_words(line, words, 8) == 4);
+	assert(strcmp(words[1], "pad \\x") == 0);
+	assert(strcmp(words[2], "Button 1") == 0);
+	assert(strcmp(words[3], "key \"a\"") == 0);
+
+	strcpy(line, "# only a comment");
+	assert(split_words(line, words, 8) == 0);
+	strcpy(line, "   \n");
+	assert(split_words(line, words, 8) == 0);
+
+	strcpy(line, "get \"unterminated");
+	assert(split_words(line, words, 8) == -1);
+	strcpy(line, "1 2 3");
+	assert(split_words(line, words, 2) == -1);
+}
+
 TEST_CASE(test_parameter_number)
 {
 	/* If either of those two fails, a parameter was added or removed.
@@ -3079,7 +3590,7 @@ TEST_CASE(test_parameter_number)
 	 * deprecated them.
 	 * Numbers include trailing NULL entry.
 	 */
-	assert(ARRAY_SIZE(parameters) == 40);
+	assert(ARRAY_SIZE(parameters) == 43);
 	assert(ARRAY_SIZE(deprecated_parameters) == 17);
 }
 